@@ -0,0 +1,275 @@
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <vector>
+#include "bench/bench.h"
+
+namespace {
+
+std::atomic<std::uint64_t> alloc_count {0};
+
+} // namespace
+
+// Count allocations by replacing the global allocation functions.
+// The array forms call these by default.
+void *
+operator new(std::size_t n)
+{
+  alloc_count.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(n ? n : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void *
+operator new(std::size_t n, const std::nothrow_t &) noexcept
+{
+  alloc_count.fetch_add(1, std::memory_order_relaxed);
+  return std::malloc(n ? n : 1);
+}
+
+void
+operator delete(void *p) noexcept
+{
+  std::free(p);
+}
+
+void
+operator delete(void *p, const std::nothrow_t &) noexcept
+{
+  std::free(p);
+}
+
+// From C++14 on, the compiler may call the sized form instead, so
+// replace it as well rather than rely on the library's forwarding.
+void
+operator delete(void *p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+namespace bench {
+
+namespace {
+
+struct benchmark {
+  std::string name_;
+  benchmark_fn fn_;
+};
+
+struct result {
+  std::string name_;
+  std::uint64_t iterations_;
+  double ns_per_op_;
+  double bytes_per_second_;
+  double allocs_per_op_;
+};
+
+std::vector<benchmark> &
+registry()
+{
+  static std::vector<benchmark> r;
+  return r;
+}
+
+// Run a benchmark with more and more iterations until it takes at
+// least min_time seconds, like Google Benchmark.
+result
+run_one(const benchmark &b, double min_time)
+{
+  constexpr std::uint64_t max_iterations = 1000000000;
+  std::uint64_t n = 1;
+  for (;;) {
+    state st(n);
+    b.fn_(st);
+    double secs = st.seconds();
+    if (secs >= min_time || n >= max_iterations) {
+      result r;
+      r.name_ = b.name_;
+      r.iterations_ = n;
+      r.ns_per_op_ = secs * 1e9 / n;
+      r.bytes_per_second_ = secs > 0 ? st.bytes_per_iteration() * n / secs : 0;
+      r.allocs_per_op_ = double(st.allocations()) / n;
+      return r;
+    }
+    // Aim 40% past min_time, growing by at most 10x per round.
+    double mult = secs > 0 ? min_time * 1.4 / secs : 10;
+    std::uint64_t next = mult > 10 ? n * 10 : std::uint64_t(n * mult);
+    n = std::min(std::max(next, n + 1), max_iterations);
+  }
+}
+
+std::string
+json_escape(const std::string &s)
+{
+  std::string r;
+  for (char c : s) {
+    if (c == '"' || c == '\\')
+      r += '\\';
+    r += c;
+  }
+  return r;
+}
+
+std::string
+human_rate(double bytes_per_second)
+{
+  static const char *const units[] = { "B/s", "KiB/s", "MiB/s", "GiB/s" };
+  int u = 0;
+  while (bytes_per_second >= 1024 && u < 3) {
+    bytes_per_second /= 1024;
+    ++u;
+  }
+  std::ostringstream os;
+  os << std::fixed << std::setprecision(1) << bytes_per_second << " "
+     << units[u];
+  return os.str();
+}
+
+void
+print_console(std::ostream &os, const std::vector<result> &rs)
+{
+  std::size_t w = 9;
+  for (const result &r : rs)
+    w = std::max(w, r.name_.size());
+  os << std::left << std::setw(w) << "Benchmark" << std::right
+     << std::setw(14) << "ns/op" << std::setw(14) << "iterations"
+     << std::setw(16) << "throughput" << std::setw(12) << "allocs/op"
+     << std::endl << std::string(w + 56, '-') << std::endl;
+  for (const result &r : rs) {
+    os << std::left << std::setw(w) << r.name_ << std::right
+       << std::fixed << std::setprecision(1)
+       << std::setw(14) << r.ns_per_op_ << std::setw(14) << r.iterations_
+       << std::setw(16)
+       << (r.bytes_per_second_ ? human_rate(r.bytes_per_second_) : "")
+       << std::setprecision(2) << std::setw(12) << r.allocs_per_op_
+       << std::endl;
+  }
+}
+
+void
+print_csv(std::ostream &os, const std::vector<result> &rs)
+{
+  os << "name,iterations,ns_per_op,bytes_per_second,allocs_per_op"
+     << std::endl;
+  for (const result &r : rs)
+    os << r.name_ << "," << r.iterations_ << ","
+       << std::setprecision(6) << r.ns_per_op_ << ","
+       << std::fixed << std::setprecision(0) << r.bytes_per_second_ << ","
+       << std::defaultfloat << std::setprecision(6) << r.allocs_per_op_
+       << std::endl;
+}
+
+void
+print_json(std::ostream &os, const std::vector<result> &rs)
+{
+  os << "{" << std::endl << "  \"benchmarks\": [";
+  const char *sep = "";
+  for (const result &r : rs) {
+    os << sep << std::endl
+       << "    {" << std::endl
+       << "      \"name\": \"" << json_escape(r.name_) << "\"," << std::endl
+       << "      \"iterations\": " << r.iterations_ << "," << std::endl
+       << std::setprecision(6)
+       << "      \"ns_per_op\": " << r.ns_per_op_ << "," << std::endl
+       << std::fixed << std::setprecision(0)
+       << "      \"bytes_per_second\": " << r.bytes_per_second_ << ","
+       << std::endl << std::defaultfloat << std::setprecision(6)
+       << "      \"allocs_per_op\": " << r.allocs_per_op_ << std::endl
+       << "    }";
+    sep = ",";
+  }
+  os << std::endl << "  ]" << std::endl << "}" << std::endl;
+}
+
+bool
+option(const char *arg, const char *name, const char **val)
+{
+  std::size_t n = std::strlen(name);
+  if (std::strncmp(arg, name, n) || arg[n] != '=')
+    return false;
+  *val = arg + n + 1;
+  return true;
+}
+
+void
+usage(const char *prog)
+{
+  std::cerr << "usage: " << prog << " [--filter=substring] [--min-time=secs]"
+	    << " [--format=console|csv|json] [--list]" << std::endl;
+}
+
+} // namespace
+
+std::uint64_t
+allocations()
+{
+  return alloc_count.load(std::memory_order_relaxed);
+}
+
+int
+register_benchmark(const std::string &name, benchmark_fn fn)
+{
+  registry().push_back(benchmark{name, std::move(fn)});
+  return 0;
+}
+
+int
+run(int argc, char **argv)
+{
+  std::string filter, format = "console";
+  double min_time = 0.5;
+  bool list = false;
+
+  for (int i = 1; i < argc; i++) {
+    const char *val;
+    if (option(argv[i], "--filter", &val))
+      filter = val;
+    else if (option(argv[i], "--min-time", &val))
+      min_time = std::atof(val);
+    else if (option(argv[i], "--format", &val))
+      format = val;
+    else if (!std::strcmp(argv[i], "--list"))
+      list = true;
+    else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (format != "console" && format != "csv" && format != "json") {
+    usage(argv[0]);
+    return 2;
+  }
+
+  std::vector<result> rs;
+  for (const benchmark &b : registry()) {
+    if (b.name_.find(filter) == std::string::npos)
+      continue;
+    if (list)
+      std::cout << b.name_ << std::endl;
+    else {
+      rs.push_back(run_one(b, min_time));
+      if (format == "console")
+	std::cerr << "." << std::flush;
+    }
+  }
+  if (list)
+    return 0;
+  if (format == "console") {
+    std::cerr << std::endl;
+    print_console(std::cout, rs);
+  }
+  else if (format == "csv")
+    print_csv(std::cout, rs);
+  else
+    print_json(std::cout, rs);
+  return 0;
+}
+
+} // namespace bench
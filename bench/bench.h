@@ -0,0 +1,148 @@
+// -*- C++ -*-
+
+//! \file bench.h Minimal microbenchmark harness, in the style of
+//! Google Benchmark but with no dependencies.  A benchmark is a
+//! function taking a bench::state, which runs the code being measured
+//! once per iteration of a <tt>while (st.keep_running())</tt> loop.
+//! The harness picks the number of iterations, and reports time,
+//! throughput, and heap allocations per iteration.  For example:
+//! \code
+//!   void bm_size(bench::state &st) {
+//!     fix_12 f;
+//!     while (st.keep_running())
+//!       bench::do_not_optimize(xdr::xdr_size(f));
+//!   }
+//!   BENCHMARK(bm_size);
+//!   int main(int argc, char **argv) { return bench::run(argc, argv); }
+//! \endcode
+
+#ifndef _XDRPP_BENCH_H_HEADER_INCLUDED_
+#define _XDRPP_BENCH_H_HEADER_INCLUDED_ 1
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace bench {
+
+//! Number of calls to <tt>operator new</tt> made so far by the
+//! process.
+std::uint64_t allocations();
+
+//! Keep the compiler from discarding the computation of \c v.
+template<typename T> inline void
+do_not_optimize(const T &v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  asm volatile("" : : "r,m"(v) : "memory");
+#else // !__GNUC__
+  static volatile const void *sink;
+  sink = &v;
+#endif // !__GNUC__
+}
+
+//! Keep the compiler from assuming memory is unchanged across this
+//! point, e.g., to stop it hoisting loop-invariant work out of a
+//! benchmark loop.
+inline void
+clobber_memory()
+{
+#if defined(__GNUC__) || defined(__clang__)
+  asm volatile("" : : : "memory");
+#endif // __GNUC__
+}
+
+//! State of one run of a benchmark.
+class state {
+  using clock = std::chrono::steady_clock;
+
+  const std::uint64_t max_iterations_;
+  std::uint64_t iterations_ {0};
+  std::uint64_t bytes_ {0};
+  clock::time_point start_;
+  clock::duration elapsed_ {0};
+  std::uint64_t allocs_ {0};
+  std::uint64_t alloc_start_ {0};
+  bool running_ {false};
+
+  void start() {
+    running_ = true;
+    alloc_start_ = bench::allocations();
+    start_ = clock::now();
+  }
+  void stop() {
+    elapsed_ += clock::now() - start_;
+    allocs_ += bench::allocations() - alloc_start_;
+    running_ = false;
+  }
+
+public:
+  explicit state(std::uint64_t iterations) : max_iterations_(iterations) {}
+  state(const state &) = delete;
+  state &operator=(const state &) = delete;
+
+  //! Returns \c true while more iterations should run.  Timing
+  //! starts at the first call and stops when it returns \c false.
+  bool keep_running() {
+    if (iterations_ < max_iterations_) {
+      if (!iterations_++)
+	start();
+      return true;
+    }
+    if (running_)
+      stop();
+    return false;
+  }
+
+  //! Stop timing, e.g., to reset data between iterations.
+  void pause_timing() { stop(); }
+  //! Resume timing after state::pause_timing.
+  void resume_timing() { start(); }
+
+  //! Set the number of bytes processed by each iteration, for the
+  //! throughput reported.
+  void set_bytes_per_iteration(std::uint64_t n) { bytes_ = n; }
+
+  std::uint64_t iterations() const { return max_iterations_; }
+  std::uint64_t bytes_per_iteration() const { return bytes_; }
+  double seconds() const {
+    return std::chrono::duration<double>(elapsed_).count();
+  }
+  std::uint64_t allocations() const { return allocs_; }
+};
+
+using benchmark_fn = std::function<void(state &)>;
+
+//! Add a benchmark to the set run by bench::run.  Usually called
+//! through the BENCHMARK or BENCHMARK_NAMED macros.
+int register_benchmark(const std::string &name, benchmark_fn fn);
+
+//! Run the registered benchmarks and print the results.  Recognizes
+//! the command-line options:
+//!
+//! - <tt>--filter=</tt><em>substring</em> runs only benchmarks whose
+//!   names contain \e substring;
+//! - <tt>--min-time=</tt><em>seconds</em> sets the time each benchmark
+//!   runs for (default 0.5);
+//! - <tt>--format=</tt><tt>console</tt>|<tt>csv</tt>|<tt>json</tt>
+//!   selects the output format;
+//! - <tt>--list</tt> prints the names of the benchmarks without
+//!   running them.
+//!
+//! Returns an exit status for \c main.
+int run(int argc, char **argv);
+
+} // namespace bench
+
+#define BENCH_CONCAT_(a, b) a##b
+#define BENCH_CONCAT(a, b) BENCH_CONCAT_(a, b)
+
+//! Register function \c fn as a benchmark called \c name.
+#define BENCHMARK_NAMED(name, fn)				\
+  static int BENCH_CONCAT(bench_registered_, __LINE__) =	\
+    ::bench::register_benchmark(name, fn)
+//! Register function \c fn as a benchmark of the same name.
+#define BENCHMARK(fn) BENCHMARK_NAMED(#fn, fn)
+
+#endif // !_XDRPP_BENCH_H_HEADER_INCLUDED_
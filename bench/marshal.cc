@@ -0,0 +1,175 @@
+// Microbenchmarks of marshaling, unmarshaling, sizing, printing, and
+// comparing XDR types of various shapes.  Run with --help for
+// options; --format=json or --format=csv give machine-readable output.
+
+#include <xdrpp/marshal.h>
+#include <xdrpp/printer.h>
+#include "bench/bench.h"
+#include "tests/xdrtest.hh"
+
+using namespace xdr;
+
+namespace {
+
+fix_12
+make_fixed()
+{
+  fix_12 f;
+  f.i = 0x12345678;
+  f.d = 3.25;
+  return f;
+}
+
+testns::numerics
+make_numerics()
+{
+  testns::numerics n;
+  n.b = true;
+  n.i1 = -7;
+  n.i2 = 0xffffff00;
+  n.i3 = -0x123456789;
+  n.i4 = 0x8000000000000000;
+  n.f1 = 1.5f;
+  n.f2 = -2.75;
+  n.e1 = testns::REDDER;
+  return n;
+}
+
+u_4_12
+make_union()
+{
+  u_4_12 u;
+  u.which(12).f12() = make_fixed();
+  return u;
+}
+
+v12
+make_fixed_vector()
+{
+  v12 v;
+  for (int i = 0; i < 1024; i++) {
+    v.push_back(make_fixed());
+    v.back().i = i;
+  }
+  return v;
+}
+
+testns::hasbytes
+make_nested_vector()
+{
+  testns::hasbytes hb;
+  for (int i = 0; i < 64; i++) {
+    hb.the_bytes.emplace_back();
+    testns::bytes &b = hb.the_bytes.back();
+    b.s = "element " + std::to_string(i);
+    for (std::size_t j = 0; j < b.fixed.size(); j++)
+      b.fixed[j] = j + i;
+    b.variable.resize(i % 17);
+  }
+  return hb;
+}
+
+test_recursive
+make_list()
+{
+  test_recursive head;
+  test_recursive *p = &head;
+  for (int i = 0; i < 64; i++) {
+    p->elem = "node " + std::to_string(i);
+    p->next.reset(new test_recursive);
+    p = p->next.get();
+  }
+  return head;
+}
+
+testns::bigopaque
+make_big_opaque()
+{
+  testns::bigopaque o(65536);
+  for (std::size_t i = 0; i < o.size(); i++)
+    o[i] = i * 7;
+  return o;
+}
+
+template<typename T> void
+register_shape(const std::string &shape, T (*make)())
+{
+  bench::register_benchmark("xdr_size/" + shape, [make](bench::state &st) {
+      T t = make();
+      while (st.keep_running()) {
+	bench::clobber_memory();
+	bench::do_not_optimize(xdr_size(t));
+      }
+    });
+
+  bench::register_benchmark("xdr_to_msg/" + shape, [make](bench::state &st) {
+      T t = make();
+      st.set_bytes_per_iteration(xdr_size(t));
+      while (st.keep_running())
+	bench::do_not_optimize(xdr_to_msg(t));
+    });
+
+  bench::register_benchmark("xdr_to_opaque/" + shape,
+			    [make](bench::state &st) {
+      T t = make();
+      st.set_bytes_per_iteration(xdr_size(t));
+      while (st.keep_running())
+	bench::do_not_optimize(xdr_to_opaque(t));
+    });
+
+  // Unmarshal into a new object each time, allocating its contents.
+  bench::register_benchmark("xdr_from_msg/" + shape,
+			    [make](bench::state &st) {
+      msg_ptr m = xdr_to_msg(make());
+      st.set_bytes_per_iteration(m->size());
+      while (st.keep_running()) {
+	T t;
+	xdr_from_msg(m, t);
+	bench::do_not_optimize(t);
+      }
+    });
+
+  // Unmarshal over the same object, reusing its storage.
+  bench::register_benchmark("xdr_from_msg_reuse/" + shape,
+			    [make](bench::state &st) {
+      msg_ptr m = xdr_to_msg(make());
+      st.set_bytes_per_iteration(m->size());
+      T t;
+      while (st.keep_running()) {
+	xdr_from_msg(m, t);
+	bench::do_not_optimize(t);
+      }
+    });
+
+  bench::register_benchmark("xdr_to_string/" + shape,
+			    [make](bench::state &st) {
+      T t = make();
+      while (st.keep_running())
+	bench::do_not_optimize(xdr_to_string(t));
+    });
+
+  // Compare equal values, which requires traversing all of them.
+  bench::register_benchmark("compare/" + shape, [make](bench::state &st) {
+      T a = make(), b = make();
+      while (st.keep_running()) {
+	bench::clobber_memory();
+	bench::do_not_optimize(a == b);
+	bench::do_not_optimize(a < b);
+      }
+    });
+}
+
+} // namespace
+
+int
+main(int argc, char **argv)
+{
+  register_shape("fixed", make_fixed);
+  register_shape("numerics", make_numerics);
+  register_shape("union", make_union);
+  register_shape("fixed_vector", make_fixed_vector);
+  register_shape("nested_vector", make_nested_vector);
+  register_shape("recursive_list", make_list);
+  register_shape("big_opaque", make_big_opaque);
+  return bench::run(argc, argv);
+}
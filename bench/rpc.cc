@@ -0,0 +1,331 @@
+// End-to-end RPC load generator.  Starts a server listening on a
+// loopback TCP port, then keeps a fixed number of calls outstanding on
+// each of a number of client connections for a fixed time, and
+// reports throughput and latency quantiles.  Run with --help for
+// options.
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <xdrpp/arpc.h>
+#include <xdrpp/metrics.h>
+#include <xdrpp/reactor.h>
+#include <xdrpp/srpc.h>
+#include "tests/xdrtest.hh"
+
+using namespace std;
+using namespace xdr;
+using namespace testns;
+
+namespace {
+
+struct options {
+  string server = "arpc";	// arpc, srpc, or srpc-threaded
+  string engine = "default";	// default, poll, or uring
+  string format = "console";	// console, csv, or json
+  unsigned server_threads = 1;
+  unsigned client_threads = 1;
+  unsigned connections = 1;
+  unsigned depth = 1;		// Calls outstanding per connection
+  size_t payload = 64;		// Bytes of argument and of result
+  double warmup = 0.5;
+  double duration = 2;
+};
+
+// Echoes the argument of three(); the other procedures do nothing.
+class async_server {
+public:
+  using rpc_interface_type = xdrtest2;
+  void null2(reply_cb<void> cb) { cb(); }
+  void nonnull2(const u_4_12 &, reply_cb<ContainsEnum> cb) {
+    cb(ContainsEnum(::RED));
+  }
+  void ut(const uniontest &, reply_cb<void> cb) { cb(); }
+  void three(const bool &, const int &, const bigstr &s,
+	     reply_cb<bigstr> cb) {
+    cb(s);
+  }
+};
+
+class sync_server {
+public:
+  using rpc_interface_type = xdrtest2;
+  void null2() {}
+  unique_ptr<ContainsEnum> nonnull2(unique_ptr<u_4_12>) {
+    return unique_ptr<ContainsEnum>(new ContainsEnum(::RED));
+  }
+  void ut(unique_ptr<uniontest>) {}
+  unique_ptr<bigstr> three(const bool &, const int &, const bigstr &s) {
+    return unique_ptr<bigstr>(new bigstr(s));
+  }
+};
+
+enum phase_t { WARMUP, MEASURE, STOP };
+atomic<int> phase {WARMUP};
+
+// Results gathered by one client thread.
+struct client_stats {
+  vector<uint64_t> hist = vector<uint64_t>(latency_buckets::count);
+  uint64_t calls {0};
+  uint64_t errors {0};
+};
+
+struct connection {
+  unique_ptr<rpc_sock> rs_;
+  unique_ptr<arpc_client<xdrtest2>> c_;
+  client_stats *st_;
+  const bigstr *payload_;
+};
+
+uint64_t
+now_ns()
+{
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(
+    steady_clock::now().time_since_epoch()).count();
+}
+
+// Make a call, and make another when it completes.
+void
+issue(connection *c)
+{
+  uint64_t start = now_ns();
+  c->c_->three(true, 0, *c->payload_, [c, start](call_result<bigstr> r) {
+      int ph = phase.load(memory_order_relaxed);
+      if (ph == MEASURE) {
+	if (r) {
+	  ++c->st_->calls;
+	  ++c->st_->hist[latency_buckets::index(now_ns() - start)];
+	}
+	else
+	  ++c->st_->errors;
+      }
+      if (ph != STOP && r)
+	issue(c);
+    });
+}
+
+uint64_t
+quantile(const vector<uint64_t> &hist, uint64_t total, double q)
+{
+  uint64_t rank = uint64_t(q * total), seen = 0;
+  for (unsigned i = 0; i < hist.size(); i++)
+    if ((seen += hist[i]) > rank)
+      return latency_buckets::upper_bound(i);
+  return 0;
+}
+
+// Run the clients against a server on port, and print the results.
+void
+run_clients(const options &o, pollset::engine e, const string &port)
+{
+  reactor r(o.client_threads, e);
+  vector<client_stats> stats(o.client_threads);
+  bigstr payload(o.payload, 'x');
+
+  vector<unique_ptr<connection>> conns;
+  for (unsigned i = 0; i < o.connections; i++) {
+    unsigned t = i % o.client_threads;
+    unique_ptr<connection> c(new connection);
+    c->rs_.reset(new rpc_sock(r.at(t), tcp_connect("127.0.0.1", port.c_str(),
+						   AF_INET).release()));
+    c->c_.reset(new arpc_client<xdrtest2>(*c->rs_));
+    c->st_ = &stats[t];
+    c->payload_ = &payload;
+    conns.push_back(std::move(c));
+  }
+
+  phase = WARMUP;
+  r.start();
+  for (unsigned t = 0; t < o.client_threads; t++)
+    r.at(t).inject_cb([&o, &conns, t]() {
+	for (unsigned i = t; i < conns.size(); i += o.client_threads)
+	  for (unsigned d = 0; d < o.depth; d++)
+	    issue(conns[i].get());
+      });
+
+  this_thread::sleep_for(chrono::duration<double>(o.warmup));
+  phase = MEASURE;
+  uint64_t t0 = now_ns();
+  this_thread::sleep_for(chrono::duration<double>(o.duration));
+  phase = STOP;
+  double secs = (now_ns() - t0) / 1e9;
+  // Let outstanding calls finish, so the server does not see resets
+  this_thread::sleep_for(chrono::milliseconds(100));
+  r.stop();
+  conns.clear();
+
+  client_stats total;
+  for (const client_stats &s : stats) {
+    total.calls += s.calls;
+    total.errors += s.errors;
+    for (unsigned i = 0; i < latency_buckets::count; i++)
+      total.hist[i] += s.hist[i];
+  }
+  double rate = total.calls / secs;
+  // Each call carries the payload both ways
+  double bytes_rate = rate * 2 * o.payload;
+  double p50 = quantile(total.hist, total.calls, .5) / 1e3;
+  double p99 = quantile(total.hist, total.calls, .99) / 1e3;
+  double p999 = quantile(total.hist, total.calls, .999) / 1e3;
+
+  if (o.format == "json")
+    cout << "{" << endl
+	 << "  \"server\": \"" << o.server << "\"," << endl
+	 << "  \"engine\": \"" << o.engine << "\"," << endl
+	 << "  \"server_threads\": " << o.server_threads << "," << endl
+	 << "  \"client_threads\": " << o.client_threads << "," << endl
+	 << "  \"connections\": " << o.connections << "," << endl
+	 << "  \"depth\": " << o.depth << "," << endl
+	 << "  \"payload\": " << o.payload << "," << endl
+	 << "  \"seconds\": " << secs << "," << endl
+	 << "  \"calls\": " << total.calls << "," << endl
+	 << "  \"errors\": " << total.errors << "," << endl
+	 << fixed << setprecision(0)
+	 << "  \"calls_per_second\": " << rate << "," << endl
+	 << "  \"bytes_per_second\": " << bytes_rate << "," << endl
+	 << setprecision(1)
+	 << "  \"p50_us\": " << p50 << "," << endl
+	 << "  \"p99_us\": " << p99 << "," << endl
+	 << "  \"p999_us\": " << p999 << endl
+	 << "}" << endl;
+  else if (o.format == "csv")
+    cout << "server,engine,server_threads,client_threads,connections,"
+	 << "depth,payload,seconds,calls,errors,calls_per_second,"
+	 << "bytes_per_second,p50_us,p99_us,p999_us" << endl
+	 << o.server << "," << o.engine << "," << o.server_threads << ","
+	 << o.client_threads << "," << o.connections << "," << o.depth << ","
+	 << o.payload << "," << secs << "," << total.calls << ","
+	 << total.errors << "," << fixed << setprecision(0) << rate << ","
+	 << bytes_rate << "," << setprecision(1) << p50 << "," << p99 << ","
+	 << p999 << endl;
+  else
+    cout << o.server << " server, " << o.server_threads << " server threads, "
+	 << o.client_threads << " client threads, " << o.connections
+	 << " connections, depth " << o.depth << ", " << o.payload
+	 << "-byte payload" << endl
+	 << fixed << setprecision(0)
+	 << "  " << rate << " calls/s, " << bytes_rate / (1 << 20)
+	 << " MiB/s, " << total.errors << " errors" << endl
+	 << setprecision(1)
+	 << "  latency p50 " << p50 << " us, p99 " << p99 << " us, p999 "
+	 << p999 << " us" << endl;
+}
+
+template<typename Listener, typename Server> void
+run_sharded(const options &o, pollset::engine e)
+{
+  reactor r(o.server_threads, e);
+  Server s;
+  Listener l(r, "0", AF_INET);
+  l.register_service(s);
+  r.start();
+  run_clients(o, e, l.port());
+  r.stop();
+}
+
+void
+run_threaded(const options &o, pollset::engine e)
+{
+  sync_server s;
+  unique_sock ls = tcp_listen("0", AF_INET);
+  string port = sock_port(ls.get());
+  // Each connection ties up a thread
+  srpc_threaded_listener l(std::move(ls),
+			   max(o.server_threads, o.connections));
+  l.register_service(s);
+  l.start();
+  run_clients(o, e, port);
+  l.stop();
+}
+
+bool
+option(const char *arg, const char *name, const char **val)
+{
+  size_t n = strlen(name);
+  if (strncmp(arg, name, n) || arg[n] != '=')
+    return false;
+  *val = arg + n + 1;
+  return true;
+}
+
+[[noreturn]] void
+usage(const char *prog)
+{
+  cerr << "usage: " << prog << " [options]" << endl
+       << "  --server=arpc|srpc|srpc-threaded  server to run (arpc)" << endl
+       << "  --engine=poll|uring      pollset engine (platform default)"
+       << endl
+       << "  --server-threads=N       server threads (1)" << endl
+       << "  --client-threads=N       client threads (1)" << endl
+       << "  --connections=N          client connections (1)" << endl
+       << "  --depth=N                calls outstanding per connection (1)"
+       << endl
+       << "  --payload=BYTES          size of argument and result (64)"
+       << endl
+       << "  --warmup=SECS            time before measuring (0.5)" << endl
+       << "  --duration=SECS          time measured (2)" << endl
+       << "  --format=console|csv|json  output format (console)" << endl;
+  exit(2);
+}
+
+} // namespace
+
+int
+main(int argc, char **argv)
+{
+  options o;
+  for (int i = 1; i < argc; i++) {
+    const char *v;
+    if (option(argv[i], "--server", &v))
+      o.server = v;
+    else if (option(argv[i], "--engine", &v))
+      o.engine = v;
+    else if (option(argv[i], "--format", &v))
+      o.format = v;
+    else if (option(argv[i], "--server-threads", &v))
+      o.server_threads = strtoul(v, nullptr, 10);
+    else if (option(argv[i], "--client-threads", &v))
+      o.client_threads = strtoul(v, nullptr, 10);
+    else if (option(argv[i], "--connections", &v))
+      o.connections = strtoul(v, nullptr, 10);
+    else if (option(argv[i], "--depth", &v))
+      o.depth = strtoul(v, nullptr, 10);
+    else if (option(argv[i], "--payload", &v))
+      o.payload = strtoul(v, nullptr, 10);
+    else if (option(argv[i], "--warmup", &v))
+      o.warmup = atof(v);
+    else if (option(argv[i], "--duration", &v))
+      o.duration = atof(v);
+    else
+      usage(argv[0]);
+  }
+  if (!o.server_threads || !o.client_threads || !o.depth
+      || o.connections < o.client_threads
+      || (o.format != "console" && o.format != "csv" && o.format != "json"))
+    usage(argv[0]);
+
+  pollset::engine e = pollset::default_engine();
+  if (o.engine == "poll")
+    e = pollset::engine::Poll;
+  else if (o.engine == "uring")
+    e = pollset::engine::Uring;
+  else if (o.engine != "default")
+    usage(argv[0]);
+
+  if (o.server == "arpc")
+    run_sharded<arpc_tcp_sharded_listener<>, async_server>(o, e);
+  else if (o.server == "srpc")
+    run_sharded<srpc_tcp_sharded_listener<>, sync_server>(o, e);
+  else if (o.server == "srpc-threaded")
+    run_threaded(o, e);
+  else
+    usage(argv[0]);
+  return 0;
+}
@@ -0,0 +1,78 @@
+
+#include <cassert>
+#include <iostream>
+#include <vector>
+#include <xdrpp/srpc.h>
+
+using namespace std;
+using namespace xdr;
+
+// Poll until the listener has n connections open
+void
+wait_conns(pollset &ps, srpc_tcp_listener<> &l, size_t n)
+{
+  while (l.connections() != n)
+    ps.poll(1000);
+}
+
+// A burst of connections is drained a batch at a time
+void
+test_burst(pollset::engine e)
+{
+  constexpr int nclients = 200;
+  pollset ps(e);
+  unique_sock ls = tcp_listen("0", AF_INET);
+  string port = sock_port(ls.get());
+  srpc_tcp_listener<> l(ps, std::move(ls), false, {});
+  l.set_accept_batch(16);
+
+  vector<unique_sock> clients;
+  for (int i = 0; i < nclients; i++)
+    clients.push_back(tcp_connect("127.0.0.1", port.c_str(), AF_INET));
+  wait_conns(ps, l, nclients);
+
+  clients.clear();
+  wait_conns(ps, l, 0);
+}
+
+// Clients beyond the connection limit wait until others disconnect
+void
+test_limit(pollset::engine e)
+{
+  pollset ps(e);
+  unique_sock ls = tcp_listen("0", AF_INET, 16);
+  string port = sock_port(ls.get());
+  srpc_tcp_listener<> l(ps, std::move(ls), false, {});
+  l.set_max_connections(2);
+
+  vector<unique_sock> clients;
+  for (int i = 0; i < 5; i++)
+    clients.push_back(tcp_connect("127.0.0.1", port.c_str(), AF_INET));
+  wait_conns(ps, l, 2);
+  for (int i = 0; i < 10; i++)
+    ps.poll(10);
+  assert(l.connections() == 2);
+
+  // Each disconnect admits one waiting client
+  clients.erase(clients.begin());
+  for (int i = 0; i < 10; i++)
+    ps.poll(10);
+  assert(l.connections() == 2);
+
+  // Raising the limit admits the rest
+  l.set_max_connections(0);
+  wait_conns(ps, l, 4);
+
+  clients.clear();
+  wait_conns(ps, l, 0);
+}
+
+int
+main()
+{
+  for (auto e : {pollset::engine::Poll, pollset::engine::Uring}) {
+    test_burst(e);
+    test_limit(e);
+  }
+  return 0;
+}
@@ -0,0 +1,90 @@
+
+#include <cassert>
+#include <iostream>
+#include <thread>
+#include <sys/socket.h>
+#include <xdrpp/srpc.h>
+#include "tests/xdrtest.hh"
+
+using namespace std;
+using namespace xdr;
+
+using namespace testns;
+
+class xdrtest2_server {
+public:
+  using rpc_interface_type = xdrtest2;
+
+  void null2() {}
+  unique_ptr<ContainsEnum> nonnull2(unique_ptr<u_4_12> arg) {
+    unique_ptr<ContainsEnum> res(new ContainsEnum);
+    res->c(::REDDER).num() = ContainsEnum::TWO;
+    return res;
+  }
+  void ut(unique_ptr<uniontest> arg) {}
+  unique_ptr<bigstr> three(const bool &arg1, const int &arg2,
+			   const bigstr &arg3) {
+    return unique_ptr<bigstr>(new bigstr(arg3 + to_string(arg2)));
+  }
+};
+
+void
+serve(sock_t s)
+{
+  xdrtest2_server s2;
+  srpc_server srv(s);
+  srv.register_service(s2);
+  try { srv.run(); }
+  catch (const exception &) {}	// Client closed the connection
+}
+
+int
+main()
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+    perror("socketpair");
+    exit(1);
+  }
+  thread t(serve, sock_t(fds[1]));
+
+  {
+    constexpr int ncalls = 1000;
+    srpc_batch b(sock_t(fds[0]), 16);
+    srpc_batch_client<xdrtest2> c{b};
+    srpc_batch_client<xdrtest> bad{b};
+
+    vector<srpc_batch::reply<xdrtest2::three_t>> rs;
+    for (int i = 0; i < ncalls; i++)
+      rs.push_back(c.three(true, i, "x"));
+    auto r_null = c.null2();
+    auto r_nonnull = c.nonnull2(u_4_12(12));
+    // The server does not implement this version of the program
+    auto r_bad = bad.null();
+    assert(b.size() == ncalls + 3);
+
+    b.run();
+    assert(b.size() == 0);
+    for (int i = 0; i < ncalls; i++)
+      assert(*rs[i].get() == "x" + to_string(i));
+    r_null.get();
+    assert(r_nonnull.get()->c() == ::REDDER);
+    try {
+      r_bad.get();
+      assert(!"rejected call did not throw");
+    }
+    catch (const xdr_call_error &e) {
+      assert(e.stat_.type_ == rpc_call_stat::ACCEPT_STAT);
+      assert(e.stat_.accept_ == PROG_MISMATCH);
+    }
+
+    // The ordinary client still works on the same socket
+    srpc_client<xdrtest2> sc{sock_t(fds[0])};
+    assert(*sc.three(false, 7, "y") == "y7");
+  }
+
+  shutdown(fds[0], SHUT_RDWR);
+  t.join();
+  close(fds[0]);
+  return 0;
+}
@@ -1,7 +1,23 @@
 
 #include <cassert>
+#include <string>
 #include "tests/xdrtest.hh"
 
+// Build a linked list of n nodes whose last element is tail.
+static test_recursive
+make_list(int n, const char *tail)
+{
+  test_recursive head;
+  test_recursive *p = &head;
+  for (int i = 1; i < n; i++) {
+    p->elem = "node " + std::to_string(i);
+    p->next.reset(new test_recursive);
+    p = p->next.get();
+  }
+  p->elem = tail;
+  return head;
+}
+
 
 int
 main()
@@ -44,6 +60,39 @@ main()
 
   testns::hasbytes hb1, hb2;
   assert(hb1 == hb2);
-  
+
+  // Ordering must take time linear in the length of a deep recursive
+  // structure, even when the values are equal all the way down.
+  test_recursive l1 = make_list(1000, "a"), l2 = make_list(1000, "a");
+  assert(l1 == l2);
+  assert(!(l1 < l2));
+  assert(!(l2 < l1));
+  test_recursive l3 = make_list(1000, "b");
+  assert(!(l1 == l3));
+  assert(l1 < l3);
+  assert(!(l3 < l1));
+
+  // A missing pointer or a shorter vector orders first
+  test_recursive l4 = make_list(1000, "a");
+  test_recursive *tail = &l4;
+  while (tail->next)
+    tail = tail->next.get();
+  tail->next.reset(new test_recursive);
+  assert(l1 < l4 && !(l4 < l1));
+  test_recursive l5 = make_list(1000, "a");
+  l5.nextvec.emplace_back();
+  assert(l1 < l5 && !(l5 < l1));
+  assert(l5 < l4 && !(l4 < l5));
+
+  // Vectors order by their elements before their lengths
+  test_recursive r1, r2;
+  r1.nextvec.resize(1);
+  r1.nextvec[0].elem = "b";
+  r2.nextvec.resize(2);
+  r2.nextvec[0].elem = "a";
+  assert(r2 < r1 && !(r1 < r2));
+  r1.nextvec[0].elem = "a";
+  assert(r1 < r2 && !(r2 < r1));
+
   return 0;
 }
@@ -0,0 +1,136 @@
+
+#include <cassert>
+#include <iostream>
+#include <stdexcept>
+#include <xdrpp/coro.h>
+#include "tests/xdrtest.hh"
+
+#if XDRPP_HAVE_COROUTINES
+
+using namespace std;
+using namespace xdr;
+
+using namespace testns;
+
+// three() sleeps for arg2 milliseconds unless arg1 is true, so that
+// a handler can be suspended while others run.  ut() always fails.
+class xdrtest2_server {
+public:
+  using rpc_interface_type = xdrtest2;
+  pollset &ps_;
+  int sleeping_ {0};
+
+  xdrtest2_server(pollset &ps) : ps_(ps) {}
+
+  task<void> null2() { co_return; }
+  task<ContainsEnum> nonnull2(const u_4_12 &arg) {
+    co_return ContainsEnum(::REDDER);
+  }
+  task<void> ut(const uniontest &arg) {
+    throw std::runtime_error("ut not implemented");
+    co_return;
+  }
+  task<bigstr> three(const bool &arg1, const int &arg2, const bigstr &arg3) {
+    if (!arg1) {
+      ++sleeping_;
+      co_await co_delay(ps_, arg2);
+      --sleeping_;
+    }
+    co_return arg3 + to_string(arg2);
+  }
+};
+
+task<void>
+basic_calls(arpc_co_client<xdrtest2> &c, bool &done)
+{
+  auto r0 = co_await c.null2();
+  assert(r0);
+
+  auto r1 = co_await c.nonnull2(u_4_12(12));
+  assert(r1 && r1->c() == ::REDDER);
+
+  auto r2 = co_await c.ut(uniontest{});
+  assert(!r2);
+  assert(r2.stat_.type_ == rpc_call_stat::ACCEPT_STAT
+	 && r2.stat_.accept_ == SYSTEM_ERR);
+
+  auto r3 = co_await c.three(false, 1000, "x", 10);
+  assert(!r3 && r3.stat_.type_ == rpc_call_stat::TIMEOUT);
+
+  done = true;
+}
+
+// Awaits a call that replies after delay milliseconds
+task<int>
+one_call(arpc_co_client<xdrtest2> &c, int delay)
+{
+  auto r = co_await c.three(false, delay, "x");
+  assert(r && *r == "x" + to_string(delay));
+  co_return delay;
+}
+
+task<void>
+record(arpc_co_client<xdrtest2> &c, int delay, vector<int> &order)
+{
+  order.push_back(co_await one_call(c, delay));
+}
+
+// Issue ncalls concurrent calls with decreasing delays, and return
+// the order in which they completed.
+vector<int>
+concurrent_calls(pollset &ps, arpc_co_client<xdrtest2> &c, int ncalls)
+{
+  vector<int> order;
+  for (int i = 0; i < ncalls; i++)
+    co_spawn(record(c, 2 * (ncalls - i), order));
+  while (order.size() < size_t(ncalls))
+    ps.poll();
+  return order;
+}
+
+int
+main()
+{
+  pollset ps;
+  xdrtest2_server s(ps);
+  unique_sock ls = tcp_listen("0", AF_INET);
+  string port = sock_port(ls.get());
+  arpc_co_tcp_listener<> rl(ps, std::move(ls), false, {});
+  rl.register_service(s);
+
+  rpc_sock rs(ps, tcp_connect("127.0.0.1", port.c_str(), AF_INET).release());
+  arpc_co_client<xdrtest2> c{rs};
+
+  bool done = false;
+  co_spawn(basic_calls(c, done));
+  while (!done)
+    ps.poll();
+
+  // Handlers run concurrently, so replies come back shortest first
+  const int ncalls = 20;
+  vector<int> order = concurrent_calls(ps, c, ncalls);
+  for (int i = 0; i < ncalls; i++)
+    assert(order[i] == 2 * (i + 1));
+
+  // Once the frame pool is warm, calls allocate no more frames
+  uint64_t allocs = coroutine_frame_heap_allocs();
+  order = concurrent_calls(ps, c, ncalls);
+  assert(order.size() == size_t(ncalls));
+  assert(coroutine_frame_heap_allocs() == allocs);
+
+  // Let the handler of the call that timed out finish
+  while (s.sleeping_)
+    ps.poll();
+
+  return 0;
+}
+
+#else // !XDRPP_HAVE_COROUTINES
+
+int
+main()
+{
+  return 77;			// Skipped
+}
+
+#endif // !XDRPP_HAVE_COROUTINES
@@ -0,0 +1,151 @@
+
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <unistd.h>
+#include <xdrpp/arpc.h>
+#include "tests/xdrtest.hh"
+
+using namespace std;
+using namespace xdr;
+
+using namespace testns;
+
+// Replies to three() immediately if arg1 is true, and otherwise
+// holds on to the reply callback until told to reply.
+class xdrtest2_server {
+public:
+  using rpc_interface_type = xdrtest2;
+  vector<reply_cb<bigstr>> held_;
+
+  void null2(reply_cb<void> cb) { cb(); }
+  void nonnull2(const u_4_12 &arg, reply_cb<ContainsEnum> cb) {
+    cb(ContainsEnum(::REDDER));
+  }
+  void ut(const uniontest &arg, reply_cb<void> cb) { cb(); }
+  void three(const bool &arg1, const int &arg2, const bigstr &arg3,
+	     reply_cb<bigstr> cb) {
+    if (arg1)
+      cb(arg3);
+    else
+      held_.push_back(cb);
+  }
+  void reply_held() {
+    for (auto &cb : held_)
+      cb("late");
+    held_.clear();
+  }
+};
+
+int
+main()
+{
+  pollset ps;
+  xdrtest2_server s;
+  unique_sock ls = tcp_listen("0", AF_INET);
+  string port = sock_port(ls.get());
+  arpc_tcp_listener<> rl(ps, std::move(ls), false, {});
+  rl.register_service(s);
+
+  unique_ptr<rpc_sock> rs {
+    new rpc_sock(ps, tcp_connect("127.0.0.1", port.c_str(),
+				 AF_INET).release())
+  };
+  arpc_client<xdrtest2> c{*rs};
+
+  // A call with no reply times out
+  int ndone = 0;
+  int64_t start = pollset::now_ms();
+  c.three(false, 0, "", [&ndone](call_result<bigstr> r) {
+      assert(!r);
+      assert(r.stat_.type_ == rpc_call_stat::TIMEOUT);
+      ++ndone;
+    }, 50);
+  while (ndone < 1)
+    ps.poll();
+  assert(pollset::now_ms() - start >= 50);
+  assert(rs->calls_pending() == 0);
+
+  // The late reply is ignored
+  s.reply_held();
+  while (rs->unknown_replies() < 1)
+    ps.poll();
+
+  // A call that gets its reply in time succeeds
+  c.three(true, 0, "fast", [&ndone](call_result<bigstr> r) {
+      assert(r && *r == "fast");
+      ++ndone;
+    }, 10000);
+  while (ndone < 2)
+    ps.poll();
+
+  // The client's default timeout applies to calls without one
+  c._xdr_invoker_.set_timeout(20);
+  c.three(false, 0, "", [&ndone](call_result<bigstr> r) {
+      assert(r.stat_.type_ == rpc_call_stat::TIMEOUT);
+      ++ndone;
+    });
+  while (ndone < 3)
+    ps.poll();
+  c._xdr_invoker_.set_timeout(-1);
+
+  // A cancelled call never completes
+  bool called = false;
+  rpc_sock::call_handle h =
+    c.three(false, 0, "", [&called](call_result<bigstr>) { called = true; },
+	    20);
+  assert(h && rs->calls_pending() == 1);
+  assert(h.cancel());
+  assert(!h.cancel());
+  assert(rs->calls_pending() == 0);
+  ps.poll(50);
+  s.reply_held();
+  while (rs->unknown_replies() < 2)
+    ps.poll();
+  assert(!called);
+
+  // Timeouts are still reported as such when the call callback is
+  // wrapped by metrics and tracing, which may clobber errno
+  {
+    char path[] = "/tmp/xdrtraceXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    ::close(fd);
+    trace_writer tw(path);
+    xdr_trace_writer = &tw;
+    rpc_metrics m;
+    c._xdr_invoker_.set_metrics(&m);
+    c.three(false, 0, "", [&ndone](call_result<bigstr> r) {
+	assert(r.stat_.type_ == rpc_call_stat::TIMEOUT);
+	++ndone;
+      }, 20);
+    while (ndone < 4)
+      ps.poll();
+    c._xdr_invoker_.set_metrics(nullptr);
+    xdr_trace_writer = nullptr;
+    unlink(path);
+    s.reply_held();
+  }
+
+  // Callbacks that take only the reply find the error in errno
+  msg_ptr call = detail::arpc_encode_call<xdrtest2::three_t>(
+    rs->get_xid(), false, 0, bigstr());
+  rs->send_call(std::move(call), [&ndone](msg_ptr r) {
+      assert(!r && errno == ETIMEDOUT);
+      ++ndone;
+    }, 20);
+  while (ndone < 5)
+    ps.poll();
+  s.reply_held();
+
+  // Calls pending when the socket goes away fail with NETWORK_ERROR
+  h = c.three(false, 0, "", [&ndone](call_result<bigstr> r) {
+      assert(r.stat_.type_ == rpc_call_stat::NETWORK_ERROR);
+      ++ndone;
+    }, 10000);
+  rs.reset();
+  assert(ndone == 6);
+  assert(!h.cancel());
+
+  return 0;
+}
@@ -0,0 +1,333 @@
+
+#include <cassert>
+#include <iostream>
+#include <xdrpp/arpc.h>
+#include "tests/xdrtest.hh"
+
+using namespace std;
+using namespace xdr;
+
+using namespace testns;
+
+struct counts {
+  int null_ {0};
+  int null2_ {0};
+  int o_null_ {0};
+  int process_ {0};
+  opaque_auth cred_;
+};
+
+class xdrtest_server {
+public:
+  using rpc_interface_type = xdrtest;
+  counts &n_;
+  xdrtest_server(counts &n) : n_(n) {}
+
+  void null(reply_cb<void> cb) { ++n_.null_; cb(); }
+  void nonnull(const u_4_12 &arg, reply_cb<ContainsEnum> cb) {
+    cb(ContainsEnum(::REDDER));
+  }
+};
+
+class xdrtest2_server {
+public:
+  using rpc_interface_type = xdrtest2;
+  counts &n_;
+  xdrtest2_server(counts &n) : n_(n) {}
+
+  void null2(reply_cb<void> cb) { ++n_.null2_; cb(); }
+  void nonnull2(const u_4_12 &arg, reply_cb<ContainsEnum> cb) {
+    cb(ContainsEnum(::REDDER));
+  }
+  void ut(const uniontest &arg, reply_cb<void> cb) { cb(); }
+  void three(const bool &arg1, const int &arg2, const bigstr &arg3,
+	     reply_cb<bigstr> cb) {
+    cb(arg3 + to_string(arg2));
+  }
+};
+
+class opv1_server {
+public:
+  using rpc_interface_type = opv1;
+  counts &n_;
+  opv1_server(counts &n) : n_(n) {}
+
+  void o_null(reply_cb<void> cb) { ++n_.o_null_; cb(); }
+  void multi_arg(const u_4_12 &arg1, const ContainsEnum &arg2,
+		 reply_cb<void> cb) {
+    cb();
+  }
+};
+
+// Service with no per-procedure thunks, which only sees calls
+// through process.  Answers every procedure with a void reply.
+class process_only_service : public service_base {
+  counts &n_;
+public:
+  process_only_service(counts &n, uint32_t prog, uint32_t vers)
+    : service_base(prog, vers), n_(n) {}
+  void process(void *session, rpc_msg &hdr, xdr_get &g,
+	       cb_t &&reply) override {
+    ++n_.process_;
+    n_.cred_ = hdr.body.cbody().cred;
+    reply(xdr_to_msg(rpc_success_hdr(hdr.xid)));
+  }
+};
+
+// Synchronous server that takes arguments by reference and returns
+// results by value, as generated by xdrc -byvalue
+class byvalue_server {
+public:
+  using rpc_interface_type = opv1;
+  int multi_ {0};
+
+  void o_null() {}
+  void multi_arg(const u_4_12 &arg1, const ContainsEnum &arg2) {
+    assert(arg1.f12().i == 7);
+    ++multi_;
+  }
+};
+
+class byvalue2_server {
+public:
+  using rpc_interface_type = xdrtest2;
+
+  void null2() {}
+  ContainsEnum nonnull2(const u_4_12 &arg) { return ContainsEnum(::REDDER); }
+  void ut(const uniontest &arg) {}
+  bigstr three(const bool &arg1, const int &arg2, const bigstr &arg3) {
+    return arg3 + to_string(arg2);
+  }
+};
+
+class unique_ptr_server {
+public:
+  using rpc_interface_type = xdrtest2;
+
+  void null2() {}
+  unique_ptr<ContainsEnum> nonnull2(unique_ptr<u_4_12> arg) {
+    return unique_ptr<ContainsEnum>(new ContainsEnum(::REDDER));
+  }
+  void ut(unique_ptr<uniontest> arg) {}
+  unique_ptr<bigstr> three(const bool &arg1, const int &arg2,
+			   const bigstr &arg3) {
+    return unique_ptr<bigstr>(new bigstr(arg3 + to_string(arg2)));
+  }
+};
+
+// Arguments are only boxed for methods that want unique_ptrs
+static_assert(is_same<dispatch_arg_t<xdrtest2::three_t, byvalue2_server &,
+				     void>,
+		      xdrtest2::three_t::arg_tuple_type>::value,
+	      "by-reference arguments decoded in place");
+static_assert(is_same<dispatch_arg_t<xdrtest2::three_t, xdrtest2_server &,
+				     void, reply_cb<bigstr>>,
+		      xdrtest2::three_t::arg_tuple_type>::value,
+	      "by-reference arguments decoded in place");
+static_assert(is_same<dispatch_arg_t<xdrtest2::nonnull2_t,
+				     unique_ptr_server &, void>,
+		      wrap_transparent_ptr<
+			xdrtest2::nonnull2_t::arg_tuple_type>>::value,
+	      "unique_ptr arguments boxed");
+
+class test_server : public arpc_server {
+public:
+  void register_base(service_base *s) { register_service_base(s); }
+};
+
+rpc_msg
+call_hdr(uint32_t prog, uint32_t vers, uint32_t proc, uint32_t rpcvers = 2)
+{
+  static uint32_t xid;
+  rpc_msg hdr { ++xid, CALL };
+  hdr.body.cbody().rpcvers = rpcvers;
+  hdr.body.cbody().prog = prog;
+  hdr.body.cbody().vers = vers;
+  hdr.body.cbody().proc = proc;
+  return hdr;
+}
+
+msg_ptr
+call_msg(uint32_t prog, uint32_t vers, uint32_t proc, uint32_t rpcvers = 2)
+{
+  return xdr_to_msg(call_hdr(prog, vers, proc, rpcvers));
+}
+
+// Returns the reply to a call, or nullptr if there was none
+msg_ptr
+try_call(test_server &s, msg_ptr m)
+{
+  msg_ptr r;
+  s.dispatch(nullptr, std::move(m), [&r](msg_ptr m) { r = std::move(m); });
+  return r;
+}
+
+rpc_call_stat
+call(test_server &s, msg_ptr m)
+{
+  msg_ptr r = try_call(s, std::move(m));
+  assert(r);
+  xdr_get g(r);
+  rpc_msg hdr;
+  archive(g, hdr);
+  return rpc_call_stat(hdr);
+}
+
+bool
+same(const msg_ptr &a, const msg_ptr &b)
+{
+  return a->size() == b->size() && !memcmp(a->data(), b->data(), a->size());
+}
+
+// Preencoded replies must match the same replies marshaled field by
+// field.
+void
+check_reply_templates()
+{
+  const uint32_t xid = 0x12345678;
+  assert(same(rpc_success_msg(xid, bigstr("abcde")),
+	      xdr_to_msg(rpc_success_hdr(xid), bigstr("abcde"))));
+  assert(same(rpc_success_msg(xid, xdr_void{}),
+	      xdr_to_msg(rpc_success_hdr(xid))));
+
+  for (accept_stat stat : { PROG_UNAVAIL, PROC_UNAVAIL, GARBAGE_ARGS,
+	SYSTEM_ERR })
+    assert(same(rpc_accepted_error_msg(xid, stat),
+		xdr_to_msg(xid, REPLY, MSG_ACCEPTED, AUTH_NONE, uint32_t(0),
+			   stat)));
+  assert(same(rpc_prog_mismatch_msg(xid, 3, 7),
+	      xdr_to_msg(xid, REPLY, MSG_ACCEPTED, AUTH_NONE, uint32_t(0),
+			 PROG_MISMATCH, uint32_t(3), uint32_t(7))));
+  assert(same(rpc_auth_error_msg(xid, AUTH_TOOWEAK),
+	      xdr_to_msg(xid, REPLY, MSG_DENIED, AUTH_ERROR, AUTH_TOOWEAK)));
+  assert(same(rpc_rpc_mismatch_msg(xid),
+	      xdr_to_msg(xid, REPLY, MSG_DENIED, RPC_MISMATCH, uint32_t(2),
+			 uint32_t(2))));
+}
+
+// Call three() with an AUTH_NONE header, and return the result
+bigstr
+three(test_server &s, int arg2, const bigstr &arg3)
+{
+  msg_ptr r = try_call(s, xdr_to_msg(call_hdr(xdrtest::program, 2,
+					      xdrtest2::three_t::proc),
+				     true, arg2, arg3));
+  assert(r);
+  xdr_get g(r);
+  rpc_msg rhdr;
+  bigstr res;
+  archive(g, rhdr);
+  assert(rpc_call_stat(rhdr));
+  archive(g, res);
+  g.done();
+  return res;
+}
+
+int
+main()
+{
+  check_reply_templates();
+
+  counts n;
+  xdrtest_server s1(n);
+  xdrtest2_server s2(n);
+  opv1_server s3(n);
+  test_server s;
+  s.register_service(s1);
+  s.register_service(s2);
+  s.register_service(s3);
+
+  // Calls reach the right service through the table
+  assert(call(s, call_msg(xdrtest::program, 1, xdrtest::null_t::proc)));
+  assert(call(s, call_msg(xdrtest::program, 2, xdrtest2::null2_t::proc)));
+  assert(call(s, call_msg(opv1::program, 1, opv1::o_null_t::proc)));
+  assert(n.null_ == 1 && n.null2_ == 1 && n.o_null_ == 1);
+
+  // Errors are the same as before there was a table
+  rpc_call_stat st = call(s, call_msg(xdrtest::program, 2, 99));
+  assert(st.type_ == rpc_call_stat::ACCEPT_STAT
+	 && st.accept_ == PROC_UNAVAIL);
+  st = call(s, call_msg(xdrtest::program, 3, 1));
+  assert(st.type_ == rpc_call_stat::ACCEPT_STAT
+	 && st.accept_ == PROG_MISMATCH);
+  st = call(s, call_msg(42, 1, 1));
+  assert(st.type_ == rpc_call_stat::ACCEPT_STAT
+	 && st.accept_ == PROG_UNAVAIL);
+  st = call(s, call_msg(xdrtest::program, 2, 1, 3));
+  assert(st.type_ == rpc_call_stat::RPCVERS_MISMATCH);
+  st = call(s, call_msg(xdrtest::program, 1, xdrtest::nonnull_t::proc));
+  assert(st.type_ == rpc_call_stat::ACCEPT_STAT
+	 && st.accept_ == GARBAGE_ARGS);
+
+  // Calls with other authenticators, or credentials that must be
+  // skipped, decode the same as AUTH_NONE
+  rpc_msg hdr = call_hdr(xdrtest::program, 2, xdrtest2::three_t::proc);
+  hdr.body.cbody().cred.flavor = AUTH_SYS;
+  hdr.body.cbody().cred.body.resize(21);
+  msg_ptr r = try_call(s, xdr_to_msg(hdr, true, 5, bigstr("a")));
+  assert(r);
+  {
+    xdr_get g(r);
+    rpc_msg rhdr;
+    bigstr res;
+    archive(g, rhdr);
+    archive(g, res);
+    g.done();
+    assert(rhdr.xid == hdr.xid && rpc_call_stat(rhdr) && res == "a5");
+  }
+  hdr.body.cbody().cred.flavor = AUTH_DH;
+  hdr.body.cbody().verf.flavor = AUTH_SHORT;
+  hdr.body.cbody().verf.body.resize(3);
+  assert(call(s, xdr_to_msg(hdr, true, 5, bigstr("a"))));
+
+  // Malformed headers are dropped
+  assert(!try_call(s, xdr_to_msg(uint32_t(1), uint32_t(CALL))));
+  msg_ptr m = call_msg(xdrtest::program, 2, xdrtest2::null2_t::proc);
+  reinterpret_cast<uint32_t *>(m->data())[7] = swap32le(404);
+  assert(!try_call(s, std::move(m)));
+
+  // Synchronous services with results returned by value or pointer
+  byvalue_server bv;
+  byvalue2_server bv2;
+  unique_ptr_server up;
+  test_server ss1, ss2;
+  ss1.register_base(new srpc_service<byvalue_server, void, opv1>(bv));
+  ss1.register_base(new srpc_service<byvalue2_server, void, xdrtest2>(bv2));
+  ss2.register_base(new srpc_service<unique_ptr_server, void, xdrtest2>(up));
+
+  u_4_12 u(12);
+  u.f12().i = 7;
+  assert(call(ss1, xdr_to_msg(call_hdr(opv1::program, 1,
+				       opv1::multi_arg_t::proc),
+			      u, ContainsEnum(::REDDER))));
+  assert(bv.multi_ == 1);
+  for (test_server *ts : { &ss1, &ss2 }) {
+    assert(three(*ts, 9, "b") == "b9");
+    assert(call(*ts, xdr_to_msg(call_hdr(xdrtest::program, 2,
+					 xdrtest2::nonnull2_t::proc), u)));
+  }
+
+  // Services without thunks still get their calls through process
+  s.register_base(new process_only_service(n, 77, 1));
+  assert(call(s, call_msg(77, 1, 5)));
+  assert(n.process_ == 1);
+  assert(n.cred_.flavor == AUTH_NONE && n.cred_.body.empty());
+  assert(call(s, call_msg(xdrtest::program, 2, xdrtest2::null2_t::proc)));
+
+  // And see AUTH_SYS credentials in full
+  hdr = call_hdr(77, 1, 5);
+  hdr.body.cbody().cred.flavor = AUTH_SYS;
+  hdr.body.cbody().cred.body = { 1, 2, 3, 4, 5 };
+  assert(call(s, xdr_to_msg(hdr)));
+  assert(n.process_ == 2 && n.cred_ == hdr.body.cbody().cred);
+  assert(n.null2_ == 2);
+
+  // Replacing a service replaces its table entries
+  counts n2;
+  xdrtest2_server s2c(n2);
+  s.register_service(s2c);
+  assert(call(s, call_msg(xdrtest::program, 2, xdrtest2::null2_t::proc)));
+  assert(n.null2_ == 2 && n2.null2_ == 1);
+
+  return 0;
+}
@@ -0,0 +1,191 @@
+
+#include <cassert>
+#include <iostream>
+#include <thread>
+#include <xdrpp/arpc.h>
+#include <xdrpp/metrics.h>
+#include "tests/xdrtest.hh"
+
+using namespace std;
+using namespace xdr;
+
+using namespace testns;
+
+class xdrtest2_server {
+public:
+  using rpc_interface_type = xdrtest2;
+
+  void null2(reply_cb<void> cb) { cb(); }
+  void nonnull2(const u_4_12 &arg, reply_cb<ContainsEnum> cb) {
+    cb(ContainsEnum(::REDDER));
+  }
+  void ut(const uniontest &arg, reply_cb<void> cb) {
+    cb.reject(SYSTEM_ERR);
+  }
+  void three(const bool &arg1, const int &arg2, const bigstr &arg3,
+	     reply_cb<bigstr> cb) {
+    cb(arg3 + to_string(arg2));
+  }
+};
+
+void
+test_buckets()
+{
+  unsigned last = 0;
+  for (uint64_t v = 0; v < 100000; v += 1 + v / 64) {
+    unsigned i = latency_buckets::index(v);
+    assert(i >= last && i < latency_buckets::count);
+    last = i;
+    uint64_t ub = latency_buckets::upper_bound(i);
+    assert(v <= ub);
+    assert(!i || v > latency_buckets::upper_bound(i - 1));
+    assert(ub - v <= v / 16);
+  }
+  assert(latency_buckets::index(~uint64_t(0)) == latency_buckets::count - 1);
+}
+
+const rpc_proc_stats *
+find(const xvector<rpc_proc_stats> &v, uint32_t proc)
+{
+  for (const rpc_proc_stats &s : v)
+    if (s.prog == xdrtest2::program && s.vers == xdrtest2::version
+	&& s.proc == proc)
+      return &s;
+  return nullptr;
+}
+
+// Counters from several threads add up
+void
+test_threads()
+{
+  constexpr int nthreads = 4, ncalls = 10000;
+  rpc_metrics m;
+  vector<thread> threads;
+  for (int i = 0; i < nthreads; i++)
+    threads.emplace_back([&m]() {
+	for (int j = 0; j < ncalls; j++)
+	  m.record(rpc_metrics::SERVER, xdrtest2::program, xdrtest2::version,
+		   1, SUCCESS, 10, 20, j);
+      });
+  // Scraping while the counters change is allowed
+  rpc_stats early = m.snapshot();
+  for (thread &t : threads)
+    t.join();
+  rpc_stats s = m.snapshot();
+  const rpc_proc_stats *p = find(s.server, 1);
+  assert(p && p->calls == nthreads * ncalls);
+  assert(p->accept_stats[SUCCESS] == nthreads * ncalls);
+  assert(p->bytes_in == 10 * nthreads * ncalls);
+  assert(p->bytes_out == 20 * nthreads * ncalls);
+  uint64_t p50 = rpc_latency_quantile(*p, .5);
+  assert(p50 >= ncalls / 2 && p50 <= ncalls / 2 * 17 / 16 + 1);
+  assert(s.client.empty());
+}
+
+// Wrapping a callback for metrics does not make it spill to the heap
+void
+test_meter_inline()
+{
+  rpc_metrics m;
+  uint64_t heap = unique_function_heap_allocs();
+  int n = 0;
+  for (int i = 0; i < 3; i++) {
+    unique_function<void(msg_ptr)> scb =
+      m.meter(rpc_metrics::SERVER, xdrtest2::program, xdrtest2::version, 1,
+	      10, [&n](msg_ptr) { ++n; });
+    unique_function<void(msg_ptr, int)> ccb =
+      m.meter(rpc_metrics::CLIENT, xdrtest2::program, xdrtest2::version, 1,
+	      10, [&n](msg_ptr, int) { ++n; });
+    scb(nullptr);
+    ccb(nullptr, 0);
+  }
+  // Dropped without being called, which still counts the call
+  m.meter(rpc_metrics::SERVER, xdrtest2::program, xdrtest2::version, 2, 10,
+	  [&n](msg_ptr) { ++n; });
+  assert(unique_function_heap_allocs() == heap);
+  assert(n == 6);
+
+  rpc_stats s = m.snapshot();
+  const rpc_proc_stats *p = find(s.server, 1);
+  assert(p && p->calls == 3 && p->bytes_in == 30);
+  p = find(s.client, 1);
+  assert(p && p->calls == 3 && p->bytes_out == 30);
+  p = find(s.server, 2);
+  assert(p && p->calls == 1 && p->no_reply == 1);
+}
+
+void
+test_rpc()
+{
+  pollset ps;
+  rpc_metrics server_m, client_m;
+  xdrtest2_server s;
+  rpc_stats_server ss(server_m);
+  unique_sock ls = tcp_listen("0", AF_INET);
+  string port = sock_port(ls.get());
+  arpc_tcp_listener<> rl(ps, std::move(ls), false, {});
+  rl.set_metrics(&server_m);
+  rl.register_service(s);
+  rl.register_service(ss);
+
+  rpc_sock rs(ps, tcp_connect("127.0.0.1", port.c_str(), AF_INET).release());
+  arpc_client<xdrtest2> c{rs};
+  c._xdr_invoker_.set_metrics(&client_m);
+  int pending = 0;
+  for (int i = 0; i < 10; i++) {
+    ++pending;
+    c.three(true, i, "x", [&pending](call_result<bigstr> r) {
+	assert(r);
+	--pending;
+      });
+  }
+  ++pending;
+  c.ut(uniontest{}, [&pending](call_result<void> r) {
+      assert(!r);
+      --pending;
+    });
+  while (pending)
+    ps.poll();
+
+  // Client side
+  rpc_stats cs = client_m.snapshot();
+  assert(cs.server.empty());
+  const rpc_proc_stats *three = find(cs.client, 4);
+  assert(three && three->calls == 10);
+  assert(three->accept_stats[SUCCESS] == 10);
+  assert(three->bytes_out > 0 && three->bytes_in > 0);
+  const rpc_proc_stats *ut = find(cs.client, 3);
+  assert(ut && ut->calls == 1 && ut->accept_stats[SYSTEM_ERR] == 1);
+
+  // Server side, fetched with the stats program
+  arpc_client<xdrpp_stats_v1> sc{rs};
+  unique_ptr<rpc_stats> ssnap;
+  sc.stats_get([&ssnap](call_result<rpc_stats> r) {
+      assert(r);
+      ssnap = std::move(r);
+    });
+  while (!ssnap)
+    ps.poll();
+  three = find(ssnap->server, 4);
+  assert(three && three->calls == 10);
+  assert(three->bytes_in == find(cs.client, 4)->bytes_out);
+  assert(three->bytes_out == find(cs.client, 4)->bytes_in);
+  ut = find(ssnap->server, 3);
+  assert(ut && ut->accept_stats[SYSTEM_ERR] == 1);
+
+  string text = rpc_stats_to_text(*ssnap);
+  assert(text.find("xdrpp_rpc_server_calls_total{prog=\"536870912\","
+		   "vers=\"2\",proc=\"4\"} 10\n") != string::npos);
+  assert(text.find("stat=\"SYSTEM_ERR\"} 1\n") != string::npos);
+  assert(text.find("quantile=\"0.99\"") != string::npos);
+}
+
+int
+main()
+{
+  test_buckets();
+  test_threads();
+  test_meter_inline();
+  test_rpc();
+  return 0;
+}
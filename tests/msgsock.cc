@@ -1,5 +1,6 @@
 
 #include <cassert>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <sstream>
@@ -7,14 +8,16 @@
 #include <sys/socket.h>
 #include <xdrpp/msgsock.h>
 #include <xdrpp/printer.h>
+#include <xdrpp/rpc_msg.hh>
+#include <xdrpp/srpc.h>
 
 using namespace std;
 using namespace xdr;
 
 void
-echoserver(sock_t s)
+echoserver(sock_t s, pollset::engine e)
 {
-  pollset_plus ps;
+  pollset_plus ps(e);
   bool done {false};
   msg_sock ss(ps, s, nullptr);
   int i = 0;
@@ -34,9 +37,9 @@ echoserver(sock_t s)
 }
 
 void
-echoclient(sock_t s)
+echoclient(sock_t s, pollset::engine e)
 {
-  pollset_plus ps;
+  pollset_plus ps(e);
   msg_sock ss { ps, s };
   unsigned int i = 0;
 
@@ -59,10 +62,28 @@ echoclient(sock_t s)
 
   while (i < 100 && ps.pending())
     ps.poll();
+
+  // Larger than an io_uring read-ahead buffer
+  constexpr size_t bigsize = 0x12345;
+  bool gotbig = false;
+  ss.setrcb([&gotbig](msg_ptr b) {
+      assert(b);
+      if (b->size() != bigsize)
+	return;
+      for (size_t j = 0; j < bigsize; j++)
+	assert(b->data()[j] == char(j));
+      gotbig = true;
+    });
+  msg_ptr b (message_t::alloc(bigsize));
+  for (size_t j = 0; j < bigsize; j++)
+    b->data()[j] = char(j);
+  ss.putmsg(b);
+  while (!gotbig && ps.pending())
+    ps.poll();
 }
 
-int
-main(int argc, char **argv)
+void
+test_echo(pollset::engine e)
 {
   int fds[2];
   if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
@@ -70,9 +91,146 @@ main(int argc, char **argv)
     exit(1);
   }
 
-  thread t1 (echoclient, sock_t(fds[0]));
-  echoserver(sock_t(fds[1]));
+  thread t1 (echoclient, sock_t(fds[0]), e);
+  echoserver(sock_t(fds[1]), e);
   t1.join();
+}
+
+void
+set_word(msg_ptr &b, int i, uint32_t v)
+{
+  memcpy(b->data() + 4 * i, &v, 4);
+}
+
+// Send many calls at once through an rpc_sock, and reply to them in
+// reverse order, so the call table has to grow and match replies
+// out of order.
+void
+test_rpc_sock()
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+    perror("socketpair");
+    exit(1);
+  }
+  set_nonblock(sock_t(fds[0]));
+  set_nonblock(sock_t(fds[1]));
+  constexpr int ncalls = 1000;
+  pollset ps;
+  vector<msg_ptr> calls;
+  msg_sock server(ps, sock_t(fds[1]), [&calls](msg_ptr b) {
+      if (b)
+	calls.push_back(std::move(b));
+    });
+  rpc_sock client(ps, sock_t(fds[0]));
+
+  int ndone = 0;
+  for (int i = 0; i < ncalls; i++) {
+    msg_ptr b (message_t::alloc(12));
+    uint32_t xid = client.get_xid();
+    set_word(b, 0, swap32le(xid));
+    set_word(b, 1, swap32le(CALL));
+    set_word(b, 2, i);
+    client.send_call(b, [&ndone,i,xid](msg_ptr r) {
+	assert(r);
+	assert(swap32le(r->word(0)) == xid);
+	assert(r->word(2) == uint32_t(i));
+	++ndone;
+      });
+  }
+  assert(client.calls_pending() == ncalls);
+
+  while (calls.size() < ncalls)
+    ps.poll();
+  for (msg_ptr &b : calls)
+    set_word(b, 1, swap32le(REPLY));
+  // A duplicate reply is ignored
+  msg_ptr dup (message_t::alloc(12));
+  memcpy(dup->data(), calls.back()->data(), 12);
+  for (auto i = calls.rbegin(); i != calls.rend(); ++i)
+    server.putmsg(*i);
+  server.putmsg(dup);
+
+  while (ndone < ncalls)
+    ps.poll();
+  assert(client.calls_pending() == 0);
+  ps.poll(10);
+}
+
+msg_ptr
+make_msg(size_t size)
+{
+  msg_ptr b (message_t::alloc(size));
+  for (size_t j = 0; j < size; j++)
+    b->data()[j] = char(size + j);
+  return b;
+}
+
+void
+check_msg(const msg_ptr &b, size_t size)
+{
+  assert(b && b->size() == size);
+  for (size_t j = 0; j < size; j++)
+    assert(b->data()[j] == char(size + j));
+}
+
+// Messages written in dribs and drabs, in bursts, and bigger than the
+// read-ahead buffer all come out whole.
+void
+test_blocking()
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+    perror("socketpair");
+    exit(1);
+  }
+  const vector<size_t> sizes { 0, 4, 64, 0x10000, 8, 0x4000, 12 };
+
+  thread writer([&sizes,fds]() {
+      // One byte at a time
+      msg_ptr b = make_msg(32);
+      for (size_t i = 0; i < b->raw_size(); i++) {
+	ssize_t n = write(fds[1], b->raw_data() + i, 1);
+	assert(n == 1);
+	this_thread::sleep_for(chrono::microseconds(100));
+      }
+      // Everything at once
+      blocking_msg_sock ws {sock_t(fds[1])};
+      vector<msg_ptr> msgs;
+      for (size_t size : sizes)
+	msgs.push_back(make_msg(size));
+      ws.put(msgs.data(), msgs.size());
+      // Then a truncated message
+      char trunc[50] {};
+      uint32_t len = swap32le(100 | 0x80000000);
+      memcpy(trunc, &len, 4);
+      ssize_t n = write(fds[1], trunc, sizeof(trunc));
+      assert(n == sizeof(trunc));
+      shutdown(fds[1], SHUT_WR);
+    });
+
+  blocking_msg_sock rs(sock_t(fds[0]), 0x100000, 0x1000);
+  check_msg(rs.get(), 32);
+  for (size_t size : sizes)
+    check_msg(rs.get(), size);
+  bool eof = false;
+  try { rs.get(); }
+  catch (const xdr_bad_message_size &) { eof = true; }
+  assert(eof);
+
+  writer.join();
+  close(fds[0]);
+  close(fds[1]);
+}
+
+int
+main(int argc, char **argv)
+{
+  test_blocking();
+  test_rpc_sock();
+  test_echo(pollset::engine::Poll);
+  // Falls back to poll if io_uring is unavailable
+  test_echo(pollset::engine::Uring);
 
   return 0;
 }
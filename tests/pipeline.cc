@@ -0,0 +1,88 @@
+
+#include <cassert>
+#include <iostream>
+#include <xdrpp/arpc.h>
+#include "tests/xdrtest.hh"
+
+using namespace std;
+using namespace xdr;
+
+using namespace testns;
+
+// Replies to three() after a delay that is shorter for later calls,
+// so that calls complete in reverse order.
+class xdrtest2_server {
+public:
+  using rpc_interface_type = xdrtest2;
+  pollset &ps_;
+  int inflight_ {0};
+  int max_inflight_ {0};
+
+  xdrtest2_server(pollset &ps) : ps_(ps) {}
+
+  void null2(reply_cb<void> cb) { cb(); }
+  void nonnull2(const u_4_12 &arg, reply_cb<ContainsEnum> cb) {
+    cb(ContainsEnum(::REDDER));
+  }
+  void ut(const uniontest &arg, reply_cb<void> cb) { cb(); }
+  void three(const bool &arg1, const int &arg2, const bigstr &arg3,
+	     reply_cb<bigstr> cb) {
+    max_inflight_ = max(max_inflight_, ++inflight_);
+    ps_.timeout(100 - arg2, [this,cb,arg2]() {
+	--inflight_;
+	cb(to_string(arg2));
+      });
+  }
+};
+
+// Send ncalls calls at once, and return the order of the replies.
+vector<int>
+pipeline(unsigned limit, bool ordered, int &max_inflight)
+{
+  const int ncalls = 50;
+  pollset ps;
+  xdrtest2_server s(ps);
+  unique_sock ls = tcp_listen("0", AF_INET);
+  string port = sock_port(ls.get());
+  arpc_tcp_listener<> rl(ps, std::move(ls), false, {});
+  rl.set_max_inflight(limit);
+  rl.set_ordered_replies(ordered);
+  rl.register_service(s);
+
+  vector<int> order;
+  {
+    rpc_sock rs(ps, tcp_connect("127.0.0.1", port.c_str(),
+				AF_INET).release());
+    arpc_client<xdrtest2> c{rs};
+    for (int i = 0; i < ncalls; i++)
+      c.three(true, i, "", [&order](call_result<bigstr> r) {
+	  assert(r);
+	  order.push_back(stoi(*r));
+	});
+    while (order.size() < ncalls)
+      ps.poll();
+  }
+  max_inflight = s.max_inflight_;
+  return order;
+}
+
+int
+main()
+{
+  int max_inflight;
+  vector<int> order = pipeline(0, false, max_inflight);
+  assert(max_inflight == int(order.size()));
+  assert(order.front() == int(order.size()) - 1);
+
+  order = pipeline(4, true, max_inflight);
+  assert(max_inflight == 4);
+  for (size_t i = 0; i < order.size(); i++)
+    assert(order[i] == int(i));
+
+  order = pipeline(1, false, max_inflight);
+  assert(max_inflight == 1);
+  for (size_t i = 0; i < order.size(); i++)
+    assert(order[i] == int(i));
+
+  return 0;
+}
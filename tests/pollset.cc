@@ -0,0 +1,233 @@
+
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <xdrpp/pollset.h>
+
+using namespace std;
+using namespace xdr;
+
+void
+test_timeouts()
+{
+  pollset ps;
+  mt19937 rng(1);
+  const int n = 2000;
+  vector<pollset::Timeout> ts(n);
+  vector<int64_t> when(n);
+  vector<bool> fired(n), cancelled(n);
+  int64_t last = 0;
+  int nfired = 0;
+
+  int64_t start = ps.now_us();
+  for (int i = 0; i < n; i++) {
+    // Mostly short delays, with some far enough out to land in high
+    // levels of the timing wheel.
+    int64_t delay = i % 10 ? rng() % 200000 : int64_t(rng() % 1000) << 30;
+    when[i] = start + delay;
+    ts[i] = ps.timeout_at_us(when[i], [&,i]() {
+	assert(!fired[i] && !cancelled[i]);
+	assert(ps.now_us() >= when[i]);
+	assert(when[i] >= last);
+	last = when[i];
+	fired[i] = true;
+	++nfired;
+      });
+    assert(ps.timeout_time_us(ts[i]) == when[i]);
+  }
+  for (int i = 0; i < n; i += 3) {
+    if (when[i] - start > 200000) {
+      // Pull far timeouts in
+      when[i] = start + rng() % 200000;
+      ps.timeout_reschedule_at_us(ts[i], when[i]);
+    }
+    else if (i % 2) {
+      ps.timeout_cancel(ts[i]);
+      assert(!ts[i]);
+      cancelled[i] = true;
+    }
+  }
+
+  int expected = 0;
+  for (int i = 0; i < n; i++)
+    if (!cancelled[i] && when[i] - start <= 200000)
+      ++expected;
+  while (nfired < expected)
+    ps.poll();
+  for (int i = 0; i < n; i++)
+    if (!fired[i] && !cancelled[i]) {
+      assert(when[i] - start > 200000);
+      ps.timeout_cancel(ts[i]);
+    }
+  assert(!ps.pending());
+}
+
+void
+test_order()
+{
+  pollset ps;
+  vector<int> order;
+  ps.timeout(2, [&]() { order.push_back(2); });
+  ps.timeout(1, [&]() {
+      order.push_back(1);
+      ps.timeout(0, [&]() { order.push_back(3); });
+    });
+  pollset::Timeout t = ps.timeout(1000000, [&]() { order.push_back(4); });
+  ps.timeout_reschedule(t, 3);
+  while (ps.pending())
+    ps.poll();
+  assert(order.size() == 4 && order.front() == 1 && order.back() == 4);
+}
+
+void
+test_function()
+{
+  // Small targets are stored inline, and move-only targets work
+  uint64_t heap = unique_function_heap_allocs();
+  unique_ptr<int> up {new int {7}};
+  int *p = up.get();
+  unique_function<int()> f {bind([p](const unique_ptr<int> &u) {
+	assert(u.get() == p);
+	return *u;
+      }, std::move(up))};
+  unique_function<int()> g {std::move(f)};
+  assert(!f && g && g() == 7);
+  assert(unique_function_heap_allocs() == heap);
+
+  // Big ones go on the heap
+  struct big { char buf[unique_function_inline + 1]; } b {};
+  f = [b]() { return int(sizeof b.buf); };
+  assert(unique_function_heap_allocs() == heap + 1);
+  assert(f() == unique_function_inline + 1);
+  f = nullptr;
+  assert(!f);
+
+  // An empty std::function yields an empty unique_function
+  unique_function<void()> e {std::function<void()>{}};
+  assert(!e);
+
+  // As with std::function, a void signature discards the result
+  int x = 0;
+  unique_function<void(int)> v = [&x](int i) { return x = i; };
+  v(3);
+  assert(x == 3);
+  v = [b, &x](int i) { return x = i + int(sizeof b.buf); };
+  v(1);
+  assert(x == unique_function_inline + 2);
+  string str;
+  v = std::bind(&string::empty, &str);
+  v(0);
+
+  // Registering and running typical pollset callbacks does not
+  // allocate
+  pollset ps;
+  heap = unique_function_heap_allocs();
+  int n = 0;
+  for (int i = 0; i < 100; i++)
+    ps.timeout(i % 3, [&ps,&n,i]() { n += i; });
+  while (ps.pending())
+    ps.poll();
+  assert(n == 4950);
+  assert(unique_function_heap_allocs() == heap);
+  ps.timeout(0, [&n]() { return ++n; });
+  ps.poll();
+  assert(n == 4951);
+}
+
+// Callbacks that remove other file descriptors' callbacks while poll
+// is dispatching events.
+void
+test_fds()
+{
+  pollset ps;
+  const int npipes = 50;
+  vector<sock_t> rd, wr;
+  for (int i = 0; i < npipes; i++) {
+    sock_t fds[2];
+    create_selfpipe(fds);
+    rd.push_back(fds[0]);
+    wr.push_back(fds[1]);
+  }
+  vector<int> nread(npipes, 0);
+  for (int i = 0; i < npipes; i++) {
+    ps.fd_cb(rd[i], pollset::Read, [&,i]() {
+	char c;
+	ssize_t n = read(rd[i], &c, 1);
+	assert(n == 1);
+	++nread[i];
+	// Odd pipes take out their successors
+	if (i % 2)
+	  ps.fd_cb(rd[(i + 1) % npipes], pollset::Read);
+	ps.fd_cb(rd[i], pollset::Read);
+      });
+    ps.fd_cb(wr[i], pollset::WriteOnce, [&,i]() {
+	ssize_t n = write(wr[i], "x", 1);
+	assert(n == 1);
+      });
+  }
+  while (ps.pending())
+    ps.poll();
+  for (int i = 0; i < npipes; i++) {
+    assert(nread[i] <= 1);
+    if (!nread[i])
+      assert(i % 2 == 0 && nread[(i + npipes - 1) % npipes] == 1);
+  }
+  for (int i = 0; i < npipes; i++) {
+    close(rd[i]);
+    close(wr[i]);
+  }
+}
+
+// Callbacks injected from several threads at once must all run, in
+// order for any one thread.
+void
+test_inject()
+{
+  pollset_plus ps;
+  const int nthreads = 4, ncbs = 20000;
+  vector<int> last(nthreads, -1);
+  int nrun = 0;
+  vector<thread> threads;
+  for (int t = 0; t < nthreads; t++)
+    threads.emplace_back([&ps,&last,&nrun,t,ncbs]() {
+	for (int i = 0; i < ncbs; i++)
+	  ps.inject_cb([&last,&nrun,t,i]() {
+	      assert(last[t] == i - 1);
+	      last[t] = i;
+	      ++nrun;
+	    });
+      });
+  while (nrun < nthreads * ncbs)
+    ps.poll();
+  for (thread &t : threads)
+    t.join();
+  for (int i : last)
+    assert(i == ncbs - 1);
+
+  // Callbacks left over after an exception run on the next poll
+  int n = 0;
+  ps.inject_cb([&n]() { ++n; throw 0; });
+  ps.inject_cb([&n]() { ++n; });
+  try {
+    ps.poll();
+    assert(false);
+  } catch (int) {}
+  assert(n == 1);
+  ps.poll();
+  assert(n == 2);
+}
+
+int
+main()
+{
+  test_timeouts();
+  test_order();
+  test_fds();
+  test_inject();
+  test_function();
+  return 0;
+}
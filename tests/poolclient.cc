@@ -0,0 +1,104 @@
+
+#include <cassert>
+#include <iostream>
+#include <xdrpp/arpc.h>
+#include "tests/xdrtest.hh"
+
+using namespace std;
+using namespace xdr;
+
+using namespace testns;
+
+class xdrtest2_server {
+public:
+  using rpc_interface_type = xdrtest2;
+  int ncalls_ {0};
+
+  void null2(reply_cb<void> cb) { ++ncalls_; cb(); }
+  void nonnull2(const u_4_12 &arg, reply_cb<ContainsEnum> cb) {
+    ++ncalls_;
+    cb(ContainsEnum(::REDDER));
+  }
+  void ut(const uniontest &arg, reply_cb<void> cb) { ++ncalls_; cb(); }
+  void three(const bool &arg1, const int &arg2, const bigstr &arg3,
+	     reply_cb<bigstr> cb) {
+    ++ncalls_;
+    cb(arg3 + to_string(arg2));
+  }
+};
+
+using listener = arpc_tcp_listener<>;
+
+unique_ptr<listener>
+listen(pollset &ps, xdrtest2_server &s, string &port)
+{
+  unique_sock ls = tcp_listen(port.empty() ? "0" : port.c_str(),
+			      AF_INET, 5, true);
+  port = sock_port(ls.get());
+  unique_ptr<listener> l {new listener(ps, std::move(ls), false, {})};
+  l->register_service(s);
+  return l;
+}
+
+// Issue ncalls calls and wait for their results.  Returns the number
+// that succeeded.
+int
+calls(pollset &ps, arpc_pool_client<xdrtest2> &c, int ncalls)
+{
+  int nok = 0, ndone = 0;
+  for (int i = 0; i < ncalls; i++)
+    c.three(true, i, "x", [&nok,&ndone,i](call_result<bigstr> r) {
+	++ndone;
+	if (r) {
+	  assert(*r == "x" + to_string(i));
+	  ++nok;
+	}
+      });
+  while (ndone < ncalls)
+    ps.poll();
+  return nok;
+}
+
+int
+main()
+{
+  pollset ps;
+  xdrtest2_server s1, s2;
+  string port1, port2;
+  unique_ptr<listener> l1 = listen(ps, s1, port1);
+  unique_ptr<listener> l2 = listen(ps, s2, port2);
+
+  vector<pool_client_base::endpoint> eps {
+    { "127.0.0.1", port1, AF_INET }, { "127.0.0.1", port2, AF_INET }
+  };
+  arpc_pool_client<xdrtest2> c(ps, eps, 2);
+
+  // Calls made before the connections are up wait for them
+  assert(c._xdr_invoker_.connected() == 0);
+  assert(calls(ps, c, 10) == 10);
+  while (c._xdr_invoker_.connected() < 4)
+    ps.poll();
+
+  // Calls are spread over the connections
+  s1.ncalls_ = s2.ncalls_ = 0;
+  assert(calls(ps, c, 200) == 200);
+  assert(s1.ncalls_ == 100 && s2.ncalls_ == 100);
+
+  // Losing one server moves all calls to the other
+  l1.reset();
+  while (c._xdr_invoker_.connected() > 2)
+    ps.poll();
+  int n2 = s2.ncalls_;
+  assert(calls(ps, c, 100) == 100);
+  assert(s2.ncalls_ == n2 + 100);
+
+  // The pool reconnects when the server comes back
+  l1 = listen(ps, s1, port1);
+  while (c._xdr_invoker_.connected() < 4)
+    ps.poll();
+  int n1 = s1.ncalls_;
+  assert(calls(ps, c, 100) == 100);
+  assert(s1.ncalls_ > n1);
+
+  return 0;
+}
@@ -0,0 +1,80 @@
+
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <thread>
+#include <xdrpp/arpc.h>
+#include <xdrpp/srpc.h>
+#include "tests/xdrtest.hh"
+
+using namespace std;
+using namespace xdr;
+
+using namespace testns;
+
+// Called concurrently from all of the reactor's threads
+class xdrtest2_server {
+public:
+  using rpc_interface_type = xdrtest2;
+  atomic<int> ncalls_ {0};
+
+  void null2(reply_cb<void> cb) { ++ncalls_; cb(); }
+  void nonnull2(const u_4_12 &arg, reply_cb<ContainsEnum> cb) {
+    ++ncalls_;
+    ContainsEnum c(::REDDER);
+    c.num() = ContainsEnum::TWO;
+    cb(c);
+  }
+  void ut(const uniontest &arg, reply_cb<void> cb) { ++ncalls_; cb(); }
+  void three(const bool &arg1, const int &arg2, const bigstr &arg3,
+	     reply_cb<bigstr> cb) {
+    ++ncalls_;
+    cb(arg3 + to_string(arg2));
+  }
+};
+
+// Cleared once the reactor's threads have been stopped
+atomic<bool> running {true};
+
+// Sessions record which thread they belong to.  Sessions whose
+// clients have gone away should be freed by that thread, but ones
+// the server had not yet noticed were closed get freed by the thread
+// destroying the listener.
+struct session {
+  thread::id tid_ {this_thread::get_id()};
+  session(rpc_sock *) {}
+  ~session() { assert(!running || tid_ == this_thread::get_id()); }
+};
+
+int
+main()
+{
+  constexpr int nthreads = 4, nclients = 16, ncalls = 100;
+  xdrtest2_server s;
+  {
+    reactor r(nthreads);
+    arpc_tcp_sharded_listener<session> rl(r, "0", AF_INET);
+    rl.register_service(s);
+    r.start();
+
+    vector<thread> clients;
+    for (int i = 0; i < nclients; i++)
+      clients.emplace_back([&rl,i]() {
+	  auto fd = tcp_connect("127.0.0.1", rl.port().c_str(), AF_INET);
+	  srpc_client<xdrtest2> c{fd.get()};
+	  for (int j = 0; j < ncalls; j++) {
+	    c.null2();
+	    auto r = c.three(true, j, "call ");
+	    assert(*r == "call " + to_string(j));
+	  }
+	});
+    for (thread &t : clients)
+      t.join();
+    r.stop();
+    running = false;
+    // Connections still open on the server side are closed when the
+    // listener is destroyed.
+  }
+  assert(s.ncalls_ == 2 * nclients * ncalls);
+  return 0;
+}
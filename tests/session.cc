@@ -0,0 +1,188 @@
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <xdrpp/arena.h>
+#include <xdrpp/arpc.h>
+#include <xdrpp/srpc.h>
+#include "tests/xdrtest.hh"
+
+using namespace std;
+using namespace xdr;
+
+using namespace testns;
+
+bool
+aligned(const void *p, size_t align)
+{
+  return reinterpret_cast<uintptr_t>(p) % align == 0;
+}
+
+struct tracked {
+  vector<int> &log_;
+  int n_;
+  ~tracked() { log_.push_back(n_); }
+};
+
+void
+test_arena()
+{
+  vector<int> log;
+  {
+    arena a(256);
+    assert(a.bytes_used() == 0);
+    for (size_t align : {1, 2, 8, 16, 64}) {
+      void *p = a.allocate(3, align);
+      assert(aligned(p, align));
+    }
+    // Objects survive the arena growing new blocks
+    vector<tracked *> objs;
+    for (int i = 0; i < 100; i++)
+      objs.push_back(a.make<tracked>(log, i));
+    for (int i = 0; i < 100; i++)
+      assert(objs[i]->n_ == i);
+    assert(a.bytes_used() >= 100 * sizeof(tracked));
+
+    // Bigger than any block
+    char *big = static_cast<char *>(a.allocate(4 * arena::max_block));
+    big[4 * arena::max_block - 1] = 'x';
+
+    assert(log.empty());
+    a.clear();
+    assert(log.size() == 100);
+    for (int i = 0; i < 100; i++)
+      assert(log[i] == 99 - i);
+    assert(a.bytes_used() == 0);
+
+    log.clear();
+    a.make<tracked>(log, 7);
+    int *ip = a.make<int>(5);
+    assert(*ip == 5);
+  }
+  assert(log.size() == 1 && log[0] == 7);
+}
+
+struct fake_session {
+  static int live;
+  rpc_sock *s_;
+  char data_[100];
+  fake_session(rpc_sock *s) : s_(s) { ++live; }
+  ~fake_session() { --live; }
+};
+int fake_session::live;
+
+void
+test_pooled_allocator()
+{
+  using alloc_t = pooled_session_allocator<fake_session>;
+  alloc_t a(4);
+  vector<fake_session *> v;
+  for (int i = 0; i < 10; i++) {
+    v.push_back(a.allocate(nullptr));
+    assert(aligned(v.back(), alloc_t::cache_line));
+  }
+  assert(fake_session::live == 10);
+  assert(a.in_use() == 10 && a.capacity() == 12);
+
+  // Freed slots get reused before new chunks are allocated
+  fake_session *freed = v[3];
+  a.deallocate(freed);
+  assert(fake_session::live == 9);
+  v[3] = a.allocate(nullptr);
+  assert(v[3] == freed);
+  assert(a.capacity() == 12);
+
+  // Copies have independent pools
+  alloc_t b(a);
+  assert(b.in_use() == 0 && b.capacity() == 0);
+  fake_session *s = b.allocate(nullptr);
+  assert(a.in_use() == 10 && b.in_use() == 1);
+  b.deallocate(s);
+
+  // A move takes the live sessions and leaves an empty, usable pool
+  alloc_t c(std::move(a));
+  assert(c.in_use() == 10 && c.capacity() == 12);
+  assert(a.in_use() == 0 && a.capacity() == 0);
+  s = a.allocate(nullptr);
+  alloc_t d(a);
+  assert(a.in_use() == 1 && d.in_use() == 0);
+  a.deallocate(s);
+
+  for (fake_session *s : v)
+    c.deallocate(s);
+  assert(fake_session::live == 0 && c.in_use() == 0);
+}
+
+atomic<int> nsessions {0};
+
+// Each connection keeps the strings it has seen in its own arena
+struct session {
+  arena arena_;
+  int ncalls_ {0};
+  session(rpc_sock *) { ++nsessions; }
+  ~session() { --nsessions; }
+};
+
+class xdrtest2_server {
+public:
+  using rpc_interface_type = xdrtest2;
+  atomic<int> ncalls_ {0};
+
+  void null2(reply_cb<void> cb) { cb(); }
+  void nonnull2(const u_4_12 &arg, reply_cb<ContainsEnum> cb) {
+    cb(ContainsEnum(::REDDER));
+  }
+  void ut(const uniontest &arg, reply_cb<void> cb) { cb(); }
+  void three(session *s, const bool &arg1, const int &arg2,
+	     const bigstr &arg3, reply_cb<bigstr> cb) {
+    ++ncalls_;
+    assert(arg2 == s->ncalls_++);
+    string *saved = s->arena_.make<string>(arg3 + to_string(arg2));
+    cb(*saved);
+  }
+};
+
+void
+test_listener()
+{
+  constexpr int nthreads = 2, nclients = 8, ncalls = 50;
+  xdrtest2_server s;
+  {
+    reactor r(nthreads);
+    r.set_pin_threads(true);
+    arpc_tcp_sharded_listener<session, pooled_session_allocator<session>>
+      rl(r, "0", AF_INET, pooled_session_allocator<session>(2));
+    rl.register_service(s);
+    r.start();
+#ifdef __linux__
+    for (unsigned i = 0; i < r.size(); i++)
+      assert(r.cpu(i) >= 0);
+#endif // __linux__
+
+    vector<thread> clients;
+    for (int i = 0; i < nclients; i++)
+      clients.emplace_back([&rl]() {
+	  auto fd = tcp_connect("127.0.0.1", rl.port().c_str(), AF_INET);
+	  srpc_client<xdrtest2> c{fd.get()};
+	  for (int j = 0; j < ncalls; j++)
+	    assert(*c.three(true, j, "call ") == "call " + to_string(j));
+	});
+    for (thread &t : clients)
+      t.join();
+    r.stop();
+    assert(r.cpu(0) == -1);
+  }
+  assert(s.ncalls_ == nclients * ncalls);
+  assert(nsessions == 0);
+}
+
+int
+main()
+{
+  test_arena();
+  test_pooled_allocator();
+  test_listener();
+  return 0;
+}
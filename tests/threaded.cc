@@ -0,0 +1,82 @@
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <xdrpp/srpc.h>
+#include "tests/xdrtest.hh"
+
+using namespace std;
+using namespace xdr;
+
+using namespace testns;
+
+// three() blocks for a while, so that calls from different clients
+// only overlap if they run in different threads.
+class xdrtest2_server {
+public:
+  using rpc_interface_type = xdrtest2;
+  atomic<int> inflight_ {0};
+  atomic<int> max_inflight_ {0};
+
+  void null2() {}
+  unique_ptr<ContainsEnum> nonnull2(unique_ptr<u_4_12> arg) {
+    unique_ptr<ContainsEnum> res(new ContainsEnum);
+    res->c(::REDDER).num() = ContainsEnum::TWO;
+    return res;
+  }
+  void ut(unique_ptr<uniontest> arg) {}
+  unique_ptr<bigstr> three(const bool &arg1, const int &arg2,
+			   const bigstr &arg3) {
+    int n = ++inflight_;
+    int m = max_inflight_;
+    while (n > m && !max_inflight_.compare_exchange_weak(m, n))
+      ;
+    this_thread::sleep_for(chrono::milliseconds(50));
+    --inflight_;
+    return unique_ptr<bigstr>(new bigstr(arg3 + to_string(arg2)));
+  }
+};
+
+int
+main()
+{
+  constexpr int nclients = 4;
+  xdrtest2_server s;
+  unique_sock ls = tcp_listen("0", AF_INET);
+  string port = sock_port(ls.get());
+  srpc_threaded_listener l(std::move(ls), nclients);
+  l.register_service(s);
+  l.start();
+
+  vector<thread> clients;
+  for (int i = 0; i < nclients; i++)
+    clients.emplace_back([&port]() {
+	unique_sock fd = tcp_connect("127.0.0.1", port.c_str(), AF_INET);
+	srpc_client<xdrtest2> c{fd.get()};
+	for (int j = 0; j < 3; j++)
+	  assert(*c.three(true, j, "x") == "x" + to_string(j));
+      });
+  for (thread &t : clients)
+    t.join();
+  assert(s.max_inflight_ > 1);
+
+  // Stopping disconnects idle clients
+  unique_sock fd = tcp_connect("127.0.0.1", port.c_str(), AF_INET);
+  srpc_client<xdrtest2> c{fd.get()};
+  c.null2();
+  l.stop();
+  bool failed = false;
+  try { c.null2(); }
+  catch (const xdr_runtime_error &) { failed = true; }
+  assert(failed);
+
+  // And the listener can be started again
+  l.start();
+  unique_sock fd2 = tcp_connect("127.0.0.1", port.c_str(), AF_INET);
+  srpc_client<xdrtest2> c2{fd2.get()};
+  assert(*c2.three(false, 1, "y") == "y1");
+
+  return 0;
+}
@@ -0,0 +1,152 @@
+
+#include <cassert>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+#include <xdrpp/arpc.h>
+#include <xdrpp/trace.h>
+#include "tests/xdrtest.hh"
+
+using namespace std;
+using namespace xdr;
+
+using namespace testns;
+
+class xdrtest2_server {
+public:
+  using rpc_interface_type = xdrtest2;
+
+  void null2(reply_cb<void> cb) { cb(); }
+  void nonnull2(const u_4_12 &arg, reply_cb<ContainsEnum> cb) {
+    cb(ContainsEnum(::REDDER));
+  }
+  void ut(const uniontest &arg, reply_cb<void> cb) { cb.reject(SYSTEM_ERR); }
+  void three(const bool &arg1, const int &arg2, const bigstr &arg3,
+	     reply_cb<bigstr> cb) {
+    cb(arg3 + to_string(arg2));
+  }
+};
+
+string
+temp_path()
+{
+  char path[] = "/tmp/xdrtraceXXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  ::close(fd);
+  return path;
+}
+
+vector<trace_record>
+read_trace(const string &path)
+{
+  ifstream in(path, ios::binary);
+  trace_reader rd(in);
+  vector<trace_record> v;
+  trace_record r;
+  while (rd.next(r))
+    v.push_back(r);
+  return v;
+}
+
+void
+test_rpc(const string &path)
+{
+  trace_writer tw(path);
+  xdr_trace_writer = &tw;
+  {
+    pollset ps;
+    xdrtest2_server s;
+    unique_sock ls = tcp_listen("0", AF_INET);
+    string port = sock_port(ls.get());
+    arpc_tcp_listener<> rl(ps, std::move(ls), false, {});
+    rl.register_service(s);
+
+    rpc_sock rs(ps, tcp_connect("127.0.0.1", port.c_str(), AF_INET).release());
+    arpc_client<xdrtest2> c{rs};
+    int pending = 2;
+    c.three(true, 7, "seven", [&pending](call_result<bigstr> r) {
+	assert(r && *r == "seven7");
+	--pending;
+      });
+    c.ut(uniontest{}, [&pending](call_result<void> r) {
+	assert(!r);
+	--pending;
+      });
+    while (pending)
+      ps.poll();
+  }
+  xdr_trace_writer = nullptr;
+  tw.flush();
+  assert(tw.dropped() == 0);
+
+  vector<trace_record> v = read_trace(path);
+  // Each call is seen four times: sent, received, replied, and the
+  // reply received.
+  assert(v.size() == 8);
+  int kinds[4] {};
+  for (const trace_record &r : v) {
+    assert(r.prog == xdrtest2::program && r.vers == xdrtest2::version);
+    assert(r.proc == xdrtest2::three_t::proc || r.proc == xdrtest2::ut_t::proc);
+    assert(!r.msg.empty());
+    ++kinds[r.kind];
+  }
+  for (int k : kinds)
+    assert(k == 2);
+
+  ostringstream os;
+  ifstream in(path, ios::binary);
+  print_trace<xdrtest2>(in, os);
+  string text = os.str();
+  assert(text.find("CALL three <- [xid ") != string::npos);
+  assert(text.find("CALL three -> [xid ") != string::npos);
+  assert(text.find("seven7") != string::npos);
+  assert(text.find("SYSTEM_ERR") != string::npos);
+
+  // Without the interface, records are only summarized
+  os.str("");
+  in.clear();
+  in.seekg(0);
+  print_trace<>(in, os);
+  assert(os.str().find("CALL 536870912.2.4 <- [xid ") != string::npos);
+}
+
+void
+test_sample_and_drop(const string &path)
+{
+  trace_writer tw(path, 4, 1024);
+  int n = 0;
+  for (int i = 0; i < 100; i++)
+    n += tw.sample();
+  assert(n == 25);
+
+  // Three of these fit in the buffer however the writer thread runs,
+  // but a record bigger than the whole buffer can never be taken.
+  msg_ptr m = message_t::alloc(200);
+  memset(m->data(), 0, m->size());
+  msg_ptr big = message_t::alloc(2000);
+  memset(big->data(), 0, big->size());
+  for (int i = 0; i < 3; i++)
+    tw.record(TRACE_CALL_IN, i, 1, 2, 3, m);
+  tw.record(TRACE_CALL_IN, 3, 1, 2, 3, big);
+  tw.record(TRACE_REPLY_OUT, 99, 1, 2, 3, nullptr);
+  tw.flush();
+  vector<trace_record> v = read_trace(path);
+  assert(tw.dropped() == 1);
+  assert(v.size() == 4);
+  for (size_t i = 0; i < 3; i++)
+    assert(v[i].xid == i && v[i].msg.size() == 200);
+  assert(v.back().xid == 99 && v.back().msg.empty());
+}
+
+int
+main()
+{
+  string path = temp_path();
+  test_rpc(path);
+  test_sample_and_drop(path);
+  unlink(path.c_str());
+  return 0;
+}
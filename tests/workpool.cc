@@ -0,0 +1,119 @@
+
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <xdrpp/arpc.h>
+#include <xdrpp/workpool.h>
+#include "tests/xdrtest.hh"
+
+using namespace std;
+using namespace xdr;
+using namespace testns;
+
+// Tasks that fan out from within the pool, so that workers have to
+// steal from each other to stay busy.
+void
+test_fanout()
+{
+  atomic<int> n {0};
+  work_pool *wpp = nullptr;
+  // Must outlive the pool, whose destructor runs the queued tasks.
+  function<void(int)> spawn = [&](int depth) {
+    ++n;
+    if (depth)
+      for (int i = 0; i < 4; i++)
+	wpp->submit(bind(spawn, depth - 1));
+  };
+  {
+    work_pool wp(4);
+    wpp = &wp;
+    wp.submit(bind(spawn, 5));
+  }
+  // 1 + 4 + ... + 4^5
+  assert(n == 1365);
+}
+
+void
+test_async()
+{
+  pollset_plus ps;
+  work_pool wp(3);
+  ps.set_work_pool(wp);
+  const int ntasks = 1000;
+  int ndone = 0;
+  long sum = 0;
+  for (int i = 0; i < ntasks; i++)
+    ps.async([i]() { return long(i) * i; },
+	     [&ndone,&sum](long r) { ++ndone; sum += r; });
+  while (ndone < ntasks)
+    ps.poll();
+  assert(ndone == ntasks);
+  assert(sum == long(ntasks - 1) * ntasks * (2 * ntasks - 1) / 6);
+}
+
+// Replies from the work pool through reply_cb::async.
+class async_server {
+public:
+  using rpc_interface_type = xdrtest2;
+  pollset_plus &ps_;
+  atomic<int> nwork_ {0};
+
+  async_server(pollset_plus &ps) : ps_(ps) {}
+
+  void null2(reply_cb<void> cb) {
+    cb.async(ps_, [this]() { ++nwork_; });
+  }
+  void nonnull2(const u_4_12 &, reply_cb<ContainsEnum> cb) {
+    cb(ContainsEnum(::RED));
+  }
+  void ut(const uniontest &, reply_cb<void> cb) { cb(); }
+  void three(const bool &, const int &n, const bigstr &s,
+	     reply_cb<bigstr> cb) {
+    cb.async(ps_, [this, n, s]() {
+	++nwork_;
+	string r;
+	for (int i = 0; i < n; i++)
+	  r += s;
+	return r;
+      });
+  }
+};
+
+void
+test_reply_async()
+{
+  pollset_plus ps;
+  work_pool wp(2);
+  ps.set_work_pool(wp);
+  async_server s(ps);
+  unique_sock ls = tcp_listen("0", AF_INET);
+  string port = sock_port(ls.get());
+  arpc_tcp_listener<> rl(ps, std::move(ls), false, {});
+  rl.register_service(s);
+
+  rpc_sock rs(ps, tcp_connect("127.0.0.1", port.c_str(),
+			      AF_INET).release());
+  arpc_client<xdrtest2> c{rs};
+
+  int ndone = 0;
+  c.three(true, 3, "ab", [&ndone](call_result<bigstr> r) {
+      assert(r && *r == "ababab");
+      ++ndone;
+    });
+  c.null2([&ndone](call_result<void> r) {
+      assert(r);
+      ++ndone;
+    });
+  while (ndone < 2)
+    ps.poll();
+  assert(s.nwork_ == 2);
+}
+
+int
+main()
+{
+  test_fanout();
+  test_async();
+  test_reply_async();
+  return 0;
+}
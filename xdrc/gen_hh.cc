@@ -754,6 +754,14 @@ gen_vers(std::ostream &os, const rpc_program &u, const rpc_vers &v)
      << nl << "return false;"
      << nl.close << "}";
 
+  os << endl
+     << nl << "template<typename T> static void"
+     << nl << "for_each_proc(T &&t) {";
+  ++nl;
+  for (const rpc_proc &p : v.procs)
+    os << nl << "t.template proc<" << p.id << "_t>();";
+  os << nl.close << "}";
+
   // client
   os << endl
      << nl << "template<typename _XDR_INVOKER> struct _xdr_client {";
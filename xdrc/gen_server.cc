@@ -28,6 +28,17 @@ gen_args(std::ostream &os, const rpc_proc &p)
   }
 }
 
+string
+gen_res(const rpc_proc &p)
+{
+  if (server_coro)
+    return "xdr::task<" + p.res + ">";
+  if (server_byvalue)
+    return p.res;
+  return server_async || p.res == "void" ? "void"
+    : (string("std::unique_ptr<") + p.res + ">");
+}
+
 void
 gen_decl(std::ostream &os, const rpc_program &u, const rpc_vers &v)
 {
@@ -41,9 +52,7 @@ gen_decl(std::ostream &os, const rpc_program &u, const rpc_vers &v)
   for (const rpc_proc &p : v.procs) {
     //    string arg = p.arg == "void" ? ""
     //  : (string("std::unique_ptr<") + p.arg + "> arg");
-    string res = server_async || p.res == "void" ? "void"
-      : (string("std::unique_ptr<") + p.res + ">");
-    os << nl << res << " " << p.id << "(";
+    os << nl << gen_res(p) << " " << p.id << "(";
     gen_args(os, p);
     os << ");";
   }
@@ -58,16 +67,27 @@ gen_def(std::ostream &os, const rpc_program &u, const rpc_vers &v)
   for (const rpc_proc &p : v.procs) {
     //string arg = p.arg == "void" ? ""
     //  : (string("std::unique_ptr<") + p.arg + "> arg");
-    string res = p.res == "void" ? "void"
-      : (string("std::unique_ptr<") + p.res + ">");
     os << endl
-       << nl << res
+       << nl << gen_res(p)
        << nl << name << "::" << p.id
        << "(";
     gen_args(os, p);
     os << ")"
        << nl << "{";
-    if (res != "void" && !server_async)
+    if (server_coro)
+       os << nl.open
+	  << nl << "// Fill in function body here"
+	  << nl
+	  << nl << (p.res == "void" ? "co_return;" : "co_return {};")
+	  << nl.close << "}";
+    else if (p.res != "void" && server_byvalue)
+       os << nl.open << p.res << " res;"
+	  << nl
+	  << nl << "// Fill in function body here"
+	  << nl
+	  << nl << "return res;"
+	  << nl.close << "}";
+    else if (p.res != "void" && !server_async)
        os << nl.open << "std::unique_ptr<" << p.res << "> res(new "
 	  << p.res << ");"
 	  << nl
@@ -104,8 +124,10 @@ gen_server_internal(std::ostream &os, bool cc)
     os << nl << "#ifndef " << guard
        << nl << "#define " << guard << " 1"
        << nl;
-    if (server_async)
-      os << nl << "#include <xdrc/arpc.h>";
+    if (server_coro)
+      os << nl << "#include <xdrpp/coro.h>";
+    else if (server_async)
+      os << nl << "#include <xdrpp/arpc.h>";
     os << nl << "#include \"" << file_prefix << ".hh\"";
   }
 
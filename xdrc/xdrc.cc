@@ -19,6 +19,8 @@ string file_prefix;
 string server_session;
 bool server_ptr;
 bool server_async;
+bool server_coro;
+bool server_byvalue;
 
 string
 guard_token(const string &extra)
@@ -97,6 +99,8 @@ and OPTIONAL arguments for -server{hh,cc} can contain:
       -s[ession] T  Use type T to track client sessions
       -p[tr]        To accept arguments by std::unique_ptr
       -a[sync]      To generate arpc server scaffolding (with callbacks)
+      -c[oro]       To generate arpc server scaffolding (with coroutines)
+      -b[yvalue]    To return results by value rather than std::unique_ptr
 )";
   exit(err);
 }
@@ -118,6 +122,8 @@ static const struct option xdrc_options[] = {
   {"ptr", no_argument, nullptr, 'p'},
   {"session", required_argument, nullptr, 's'},
   {"async", no_argument, nullptr, 'a'},
+  {"coro", no_argument, nullptr, 'c'},
+  {"byvalue", no_argument, nullptr, 'b'},
   {nullptr, 0, nullptr, 0}
 };
 
@@ -131,7 +137,7 @@ main(int argc, char **argv)
   bool noclobber = false;
 
   int opt;
-  while ((opt = getopt_long_only(argc, argv, "D:ao:ps:",
+  while ((opt = getopt_long_only(argc, argv, "D:abco:ps:",
 				 xdrc_options, nullptr)) != -1)
     switch (opt) {
     case 'D':
@@ -179,6 +185,12 @@ main(int argc, char **argv)
     case 'a':
       server_async = true;
       break;
+    case 'b':
+      server_byvalue = true;
+      break;
+    case 'c':
+      server_coro = true;
+      break;
     case 's':
       server_session = optarg;
       break;
@@ -187,7 +199,8 @@ main(int argc, char **argv)
       break;
     }
 
-  if (optind + 1 != argc)
+  if (optind + 1 != argc || (server_async && server_coro)
+      || (server_byvalue && (server_async || server_coro || server_ptr)))
     usage();
   if (!gen) {
     cerr << "xdrc: missing mode specifier (e.g., -hh)" << endl;
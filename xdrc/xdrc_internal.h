@@ -254,6 +254,8 @@ extern string file_prefix;
 extern string server_session;
 extern bool server_ptr;
 extern bool server_async;
+extern bool server_coro;
+extern bool server_byvalue;
 
 template <typename T>
 struct omanip {
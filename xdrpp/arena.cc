@@ -0,0 +1,56 @@
+
+#include <algorithm>
+#include <xdrpp/arena.h>
+
+namespace xdr {
+
+constexpr std::size_t arena::max_block;
+
+void *
+arena::grow(std::size_t n, std::size_t align)
+{
+  std::size_t size = initial_;
+  if (blocks_) {
+    used_ += cur_ - blocks_->data();
+    size = std::min(2 * blocks_->size_, max_block);
+  }
+  size = std::max(size, n + align);
+
+  block *b = static_cast<block *>(::operator new(sizeof(block) + size));
+  b->next_ = blocks_;
+  b->size_ = size;
+  blocks_ = b;
+  cur_ = b->data();
+  end_ = cur_ + size;
+  return allocate(n, align);
+}
+
+void
+arena::clear()
+{
+  for (dtor *d = dtors_; d; d = d->next_)
+    d->destroy_(d->obj_);
+  dtors_ = nullptr;
+  if (!blocks_)
+    return;
+  block *b = blocks_->next_;
+  while (b) {
+    block *next = b->next_;
+    ::operator delete(b);
+    b = next;
+  }
+  blocks_->next_ = nullptr;
+  cur_ = blocks_->data();
+  used_ = 0;
+}
+
+void
+arena::release()
+{
+  clear();
+  ::operator delete(blocks_);
+  blocks_ = nullptr;
+  cur_ = end_ = nullptr;
+}
+
+} // namespace xdr
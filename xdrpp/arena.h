@@ -0,0 +1,97 @@
+// -*- C++ -*-
+
+//! \file arena.h Region allocator whose memory is all released at
+//! once.  Meant for per-session state (see xdr::session_allocator):
+//! a session can allocate from its own xdr::arena as calls come in,
+//! and everything is freed together when the connection closes.
+
+#ifndef _XDRPP_ARENA_H_HEADER_INCLUDED_
+#define _XDRPP_ARENA_H_HEADER_INCLUDED_ 1
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace xdr {
+
+//! Bump allocator over a list of blocks.  Individual objects cannot
+//! be freed; arena::clear (or destroying the arena) runs the
+//! destructors of all objects created with arena::make, in reverse
+//! order, and releases the memory.  Not thread safe.
+class arena {
+  struct block {
+    block *next_;
+    std::size_t size_;		// Usable bytes after the header
+    char *data() { return reinterpret_cast<char *>(this + 1); }
+  };
+  struct dtor {
+    void (*destroy_)(void *);
+    void *obj_;
+    dtor *next_;
+  };
+
+  const std::size_t initial_;
+  block *blocks_ {nullptr};	// Current block first
+  char *cur_ {nullptr};
+  char *end_ {nullptr};
+  dtor *dtors_ {nullptr};	// Most recently created object first
+  std::size_t used_ {0};	// Bytes in blocks before the current one
+
+  void *grow(std::size_t n, std::size_t align);
+  template<typename T> static void destroy(void *p) {
+    static_cast<T *>(p)->~T();
+  }
+
+public:
+  //! Maximum block size the arena grows to, though larger single
+  //! allocations get a block of their own.
+  static constexpr std::size_t max_block = 0x10000;
+
+  //! \c initial is the size of the first block, which is only
+  //! allocated when first needed.  Each further block is twice as
+  //! big as the previous one, up to arena::max_block.
+  explicit arena(std::size_t initial = 1024) : initial_(initial) {}
+  ~arena() { release(); }
+  arena(const arena &) = delete;
+  arena &operator=(const arena &) = delete;
+
+  //! Return \c n bytes aligned to \c align (a power of two).
+  void *allocate(std::size_t n,
+		 std::size_t align = alignof(std::max_align_t)) {
+    std::size_t pad = -reinterpret_cast<std::uintptr_t>(cur_) & (align - 1);
+    if (std::size_t(end_ - cur_) < n + pad)
+      return grow(n, align);
+    char *p = cur_ + pad;
+    cur_ = p + n;
+    return p;
+  }
+
+  //! Construct a \c T in the arena.  Its destructor (if not trivial)
+  //! runs when the arena is cleared.
+  template<typename T, typename...A> T *make(A &&...a) {
+    void *p = allocate(sizeof(T), alignof(T));
+    T *t = new (p) T{std::forward<A>(a)...};
+    if (!std::is_trivially_destructible<T>::value)
+      dtors_ = new (allocate(sizeof(dtor), alignof(dtor)))
+	dtor{&destroy<T>, t, dtors_};
+    return t;
+  }
+
+  //! Destroy all objects and reclaim their memory.  Keeps the
+  //! current (largest) block for reuse.
+  void clear();
+  //! Like arena::clear, but also frees every block.
+  void release();
+
+  //! Number of bytes handed out since the arena was last cleared,
+  //! including alignment padding.
+  std::size_t bytes_used() const {
+    return blocks_ ? used_ + (cur_ - blocks_->data()) : 0;
+  }
+};
+
+} // namespace xdr
+
+#endif // !_XDRPP_ARENA_H_HEADER_INCLUDED_
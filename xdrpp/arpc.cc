@@ -1,4 +1,7 @@
 
+#include <algorithm>
+#include <cstring>
+#include <iterator>
 #include <xdrpp/arpc.h>
 
 namespace xdr {
@@ -9,4 +12,162 @@ arpc_server::receive(rpc_sock *ms, msg_ptr buf)
   dispatch(nullptr, std::move(buf), rpc_sock_reply_t{ms});
 }
 
+constexpr std::int64_t pool_client_base::min_backoff_ms;
+constexpr std::int64_t pool_client_base::max_backoff_ms;
+
+pool_client_base::pool_client_base(pollset &ps,
+				   const std::vector<endpoint> &endpoints,
+				   unsigned nconns)
+  : ps_(ps)
+{
+  for (const endpoint &ep : endpoints)
+    addrs_.push_back(get_addrinfo(ep.host_.c_str(), SOCK_STREAM,
+				  ep.service_.c_str(), ep.family_));
+  // Interleave endpoints, so that pick spreads ties over servers
+  for (unsigned i = 0; i < nconns; i++)
+    for (std::size_t ep = 0; ep < addrs_.size(); ep++) {
+      conns_.emplace_back(new conn);
+      conns_.back()->ep_ = ep;
+    }
+  for (auto &c : conns_)
+    connect(*c);
+}
+
+pool_client_base::~pool_client_base()
+{
+  for (auto &c : conns_) {
+    ps_.timeout_cancel(c->retry_);
+    if (c->connecting_)
+      ps_.fd_cb(c->connecting_.get(), pollset::Write);
+    // Fails any outstanding calls
+    c->s_.reset();
+  }
+  fail_waiting(ECANCELED);
+}
+
+rpc_sock *
+pool_client_base::pick()
+{
+  rpc_sock *best = nullptr;
+  std::size_t n = conns_.size();
+  for (std::size_t i = 0; i < n; i++) {
+    rpc_sock *s = conns_[(next_ + i) % n]->s_.get();
+    if (s && (!best || s->calls_pending() < best->calls_pending()))
+      best = s;
+  }
+  ++next_;
+  return best;
+}
+
+void
+pool_client_base::wait(msg_ptr m, rpc_sock::call_cb_t cb,
+		       std::int64_t timeout_ms)
+{
+  if (!nconnecting_) {
+    // Every connection is waiting to retry after failing
+    cb(nullptr, ECONNREFUSED);
+    return;
+  }
+  waiting_.emplace_back();
+  auto wi = std::prev(waiting_.end());
+  wi->m_ = std::move(m);
+  wi->cb_ = std::move(cb);
+  if (timeout_ms >= 0) {
+    wi->deadline_ms_ = pollset::now_ms() + timeout_ms;
+    wi->timeout_ = ps_.timeout(timeout_ms, [this,wi]() {
+	auto cb (std::move(wi->cb_));
+	waiting_.erase(wi);
+	cb(nullptr, ETIMEDOUT);
+      });
+  }
+}
+
+void
+pool_client_base::fail_waiting(int err)
+{
+  decltype(waiting_) waiting;
+  waiting.swap(waiting_);
+  for (waiting_call &w : waiting)
+    ps_.timeout_cancel(w.timeout_);
+  for (waiting_call &w : waiting)
+    w.cb_(nullptr, err);
+}
+
+void
+pool_client_base::connect(conn &c)
+{
+  const addrinfo *first = addrs_[c.ep_].get();
+  // Try the endpoint's addresses in turn on successive attempts
+  c.ai_ = c.ai_ && c.ai_->ai_next ? c.ai_->ai_next : first;
+  c.connecting_ = tcp_connect1(c.ai_, true);
+  if (!c.connecting_) {
+    connect_failed(c);
+    return;
+  }
+  set_close_on_exec(c.connecting_.get());
+  ++nconnecting_;
+  ps_.fd_cb(c.connecting_.get(), pollset::WriteOnce,
+	    [this,&c]() { connect_done(c); });
+}
+
+void
+pool_client_base::connect_done(conn &c)
+{
+  --nconnecting_;
+  int err = 0;
+  socklen_t errlen = sizeof err;
+  if (getsockopt(c.connecting_.get().fd_, SOL_SOCKET, SO_ERROR,
+		 &err, &errlen) == -1)
+    err = errno;
+  if (err) {
+    c.connecting_.clear();
+    connect_failed(c);
+    return;
+  }
+
+  c.s_.reset(new rpc_sock(ps_, c.connecting_.release()));
+  c.s_->set_servcb(std::bind(&pool_client_base::receive, this, std::ref(c),
+			     std::placeholders::_1));
+  c.backoff_ms_ = min_backoff_ms;
+  ++nup_;
+
+  decltype(waiting_) waiting;
+  waiting.swap(waiting_);
+  for (waiting_call &w : waiting)
+    ps_.timeout_cancel(w.timeout_);
+  for (waiting_call &w : waiting) {
+    rpc_sock *s = pick();
+    std::uint32_t xid = swap32le(s->get_xid());
+    std::memcpy(w.m_->data(), &xid, sizeof xid);
+    s->send_call(std::move(w.m_), std::move(w.cb_),
+		 w.deadline_ms_ < 0 ? -1
+		 : std::max<std::int64_t>(w.deadline_ms_ - pollset::now_ms(),
+					  0));
+  }
+}
+
+void
+pool_client_base::connect_failed(conn &c)
+{
+  c.retry_ = ps_.timeout(c.backoff_ms_, [this,&c]() {
+      c.retry_ = pollset::timeout_null();
+      connect(c);
+    });
+  c.backoff_ms_ = std::min(2 * c.backoff_ms_, max_backoff_ms);
+  if (!nup_ && !nconnecting_)
+    fail_waiting(ECONNREFUSED);
+}
+
+void
+pool_client_base::receive(conn &c, msg_ptr m)
+{
+  // Servers do not send calls to clients, so only a null message
+  // (signaling that the connection failed) is interesting.
+  if (m)
+    return;
+  --nup_;
+  c.s_.reset();
+  connect_failed(c);
+}
+
 }
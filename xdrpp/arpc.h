@@ -5,8 +5,11 @@
 #ifndef _XDRPP_ARPC_H_HEADER_INCLUDED_
 #define _XDRPP_ARPC_H_HEADER_INCLUDED_ 1
 
+#include <list>
 #include <xdrpp/exception.h>
+#include <xdrpp/metrics.h>
 #include <xdrpp/server.h>
+#include <xdrpp/trace.h>
 #include <xdrpp/srpc.h>	     // XXX xdr_trace_client
 
 namespace xdr {
@@ -31,71 +34,230 @@ template<> struct call_result<void> {
   xdr_void &operator*() { static xdr_void v; return v; }
 };
 
+namespace detail {
+//! Marshal a call to procedure \c P with transaction ID \c xid.
+template<typename P, typename...A> msg_ptr
+arpc_encode_call(std::uint32_t xid, const A &...a)
+{
+  rpc_msg hdr { xid, CALL };
+  hdr.body.cbody().rpcvers = 2;
+  hdr.body.cbody().prog = P::interface_type::program;
+  hdr.body.cbody().vers = P::interface_type::version;
+  hdr.body.cbody().proc = P::proc;
+    
+  if (xdr_trace_client) {
+    std::string s = "CALL ";
+    s += P::proc_name();
+    s += " -> [xid ";
+    s += std::to_string(hdr.xid);
+    s += "]";
+    std::clog << xdr_to_string(std::tie(a...), s.c_str());
+  }
+  return xdr_to_msg(hdr, a...);
+}
+
+//! Reply callback for rpc_sock::send_call that unmarshals the result
+//! of procedure \c P and passes it to \c cb.  A call that got no
+//! reply fails with rpc_call_stat::TIMEOUT if its deadline passed
+//! (or the connection timed out), otherwise with
+//! rpc_call_stat::NETWORK_ERROR.
+template<typename P> rpc_sock::call_cb_t
+arpc_reply_handler(std::function<void(call_result<typename P::res_type>)> cb)
+{
+  using cb_t = std::function<void(call_result<typename P::res_type>)>;
+  // Bind rather than capture, so cb is moved, not copied
+  return std::bind([](const cb_t &cb, msg_ptr m, int err) {
+      if (!m)
+	return cb(err == ETIMEDOUT ? rpc_call_stat::TIMEOUT
+		  : rpc_call_stat::NETWORK_ERROR);
+      try {
+	xdr_get g(m);
+	rpc_msg hdr;
+	archive(g, hdr);
+	call_result<typename P::res_type> res(hdr);
+	if (res)
+	  archive(g, *res);
+	g.done();
+
+	if (xdr_trace_client) {
+	  std::string s = "REPLY ";
+	  s += P::proc_name();
+	  s += " <- [xid " + std::to_string(hdr.xid) + "]";
+	  if (res)
+	    std::clog << xdr_to_string(*res, s.c_str());
+	  else {
+	    s += ": ";
+	    s += res.message();
+	    s += "\n";
+	    std::clog << s;
+	  }
+	}
+
+	cb(std::move(res));
+      }
+      catch (const xdr_runtime_error &e) {
+	cb(rpc_call_stat::GARBAGE_RES);
+      }
+    }, std::move(cb), std::placeholders::_1, std::placeholders::_2);
+}
+} // namespace detail
+
+//! Invoker for xdr::arpc_client.  Each call method of the client
+//! returns an rpc_sock::call_handle that can be used to cancel the
+//! call, and takes an optional extra argument after the callback:  a
+//! timeout in milliseconds after which the call fails with
+//! rpc_call_stat::TIMEOUT.
 class asynchronous_client_base {
   rpc_sock &s_;
+  std::int64_t timeout_ms_ {-1};
+  rpc_metrics *metrics_ {nullptr};
 
 public:
   asynchronous_client_base(rpc_sock &s) : s_(s) {}
-  asynchronous_client_base(asynchronous_client_base &c) : s_(c.s_) {}
-
-  template<typename P, typename...A>
-  void invoke(const A &...a,
-	      std::function<void(call_result<typename P::res_type>)> cb) {
-    rpc_msg hdr { s_.get_xid(), CALL };
-    hdr.body.cbody().rpcvers = 2;
-    hdr.body.cbody().prog = P::interface_type::program;
-    hdr.body.cbody().vers = P::interface_type::version;
-    hdr.body.cbody().proc = P::proc;
-    
-    if (xdr_trace_client) {
-      std::string s = "CALL ";
-      s += P::proc_name();
-      s += " -> [xid ";
-      s += std::to_string(hdr.xid);
-      s += "]";
-      std::clog << xdr_to_string(std::tie(a...), s.c_str());
+  asynchronous_client_base(asynchronous_client_base &c)
+    : s_(c.s_), timeout_ms_(c.timeout_ms_), metrics_(c.metrics_) {}
+
+  //! Set the timeout for calls that do not specify one.  The default
+  //! of -1 means wait for a reply for as long as the connection lasts.
+  void set_timeout(std::int64_t ms) { timeout_ms_ = ms; }
+  //! Count calls made from now on in \c m (or stop counting if \c m
+  //! is \c nullptr).  Calls that time out or fail for lack of a
+  //! connection count as rpc_metrics::NO_REPLY.
+  void set_metrics(rpc_metrics *m) { metrics_ = m; }
+
+  template<typename P, typename...A> rpc_sock::call_handle
+  invoke(const A &...a,
+	 std::function<void(call_result<typename P::res_type>)> cb,
+	 std::int64_t timeout_ms) {
+    std::uint32_t xid = s_.get_xid();
+    msg_ptr m = detail::arpc_encode_call<P>(xid, a...);
+    rpc_sock::call_cb_t rcb = detail::arpc_reply_handler<P>(std::move(cb));
+    if (metrics_)
+      rcb = metrics_->meter(rpc_metrics::CLIENT, P::interface_type::program,
+			    P::interface_type::version, P::proc, m->size(),
+			    std::move(rcb));
+    if (xdr_trace_writer && xdr_trace_writer->sample()) {
+      xdr_trace_writer->record(TRACE_CALL_OUT, xid,
+			       P::interface_type::program,
+			       P::interface_type::version, P::proc, m);
+      rcb = xdr_trace_writer->trace_reply(TRACE_REPLY_IN, xid,
+					  P::interface_type::program,
+					  P::interface_type::version, P::proc,
+					  std::move(rcb));
     }
+    return s_.send_call(std::move(m), std::move(rcb), timeout_ms);
+  }
+  template<typename P, typename...A> rpc_sock::call_handle
+  invoke(const A &...a,
+	 std::function<void(call_result<typename P::res_type>)> cb) {
+    return invoke<P, A...>(a..., std::move(cb), timeout_ms_);
+  }
 
-    s_.send_call(xdr_to_msg(hdr, a...), [cb](msg_ptr m) {
-	if (!m)
-	  return cb(rpc_call_stat::NETWORK_ERROR);
-	try {
-	  xdr_get g(m);
-	  rpc_msg hdr;
-	  archive(g, hdr);
-	  call_result<typename P::res_type> res(hdr);
-	  if (res)
-	    archive(g, *res);
-	  g.done();
-
-	  if (xdr_trace_client) {
-	    std::string s = "REPLY ";
-	    s += P::proc_name();
-	    s += " <- [xid " + std::to_string(hdr.xid) + "]";
-	    if (res)
-	      std::clog << xdr_to_string(*res, s.c_str());
-	    else {
-	      s += ": ";
-	      s += res.message();
-	      s += "\n";
-	      std::clog << s;
-	    }
-	  }
+  asynchronous_client_base *operator->() { return this; }
+};
 
-	  cb(std::move(res));
-	}
-	catch (const xdr_runtime_error &e) {
-	  cb(rpc_call_stat::GARBAGE_RES);
-	}
-      });
+//! Invoker for xdr::arpc_pool_client.  Owns a fixed number of
+//! connections to one or more servers, and sends each call on the
+//! connection with the fewest calls awaiting replies.  Connections
+//! are established in the background, and re-established (with
+//! exponential backoff) when they fail.  Calls made while no
+//! connection is up wait for one; they fail with
+//! rpc_call_stat::NETWORK_ERROR if every connection attempt fails.
+//! Timeouts work as for xdr::arpc_client, and include any time spent
+//! waiting for a connection.  A call that has to wait returns a null
+//! rpc_sock::call_handle, and so cannot be cancelled.
+class pool_client_base {
+public:
+  //! A server to connect to.
+  struct endpoint {
+    std::string host_;
+    std::string service_;	//!< Port number or service name
+    int family_;
+    endpoint(const std::string &host, const std::string &service,
+	     int family = AF_UNSPEC)
+      : host_(host), service_(service), family_(family) {}
+  };
+  static constexpr std::int64_t min_backoff_ms = 100;
+  static constexpr std::int64_t max_backoff_ms = 10000;
+
+  //! Open \c nconns connections to each of \c endpoints.  Resolves
+  //! the endpoints' addresses immediately, and so may block and can
+  //! throw std::system_error.
+  pool_client_base(pollset &ps, const std::vector<endpoint> &endpoints,
+		   unsigned nconns = 1);
+  ~pool_client_base();
+  pool_client_base(const pool_client_base &) = delete;
+  pool_client_base &operator=(const pool_client_base &) = delete;
+
+  //! Set the timeout for calls that do not specify one.
+  void set_timeout(std::int64_t ms) { timeout_ms_ = ms; }
+
+  template<typename P, typename...A> rpc_sock::call_handle
+  invoke(const A &...a,
+	 std::function<void(call_result<typename P::res_type>)> cb,
+	 std::int64_t timeout_ms) {
+    if (rpc_sock *s = pick())
+      return s->send_call(detail::arpc_encode_call<P>(s->get_xid(), a...),
+			  detail::arpc_reply_handler<P>(std::move(cb)),
+			  timeout_ms);
+    wait(detail::arpc_encode_call<P>(0, a...),
+	 detail::arpc_reply_handler<P>(std::move(cb)), timeout_ms);
+    return {};
+  }
+  template<typename P, typename...A> rpc_sock::call_handle
+  invoke(const A &...a,
+	 std::function<void(call_result<typename P::res_type>)> cb) {
+    return invoke<P, A...>(a..., std::move(cb), timeout_ms_);
   }
 
-  asynchronous_client_base *operator->() { return this; }
+  //! Number of connections currently up.
+  std::size_t connected() const { return nup_; }
+  pollset &get_pollset() { return ps_; }
+
+  pool_client_base *operator->() { return this; }
+
+private:
+  struct conn {
+    std::size_t ep_;		// Index in addrs_
+    const addrinfo *ai_ {nullptr}; // Address being tried
+    unique_sock connecting_;
+    std::unique_ptr<rpc_sock> s_;
+    pollset::Timeout retry_ {pollset::timeout_null()};
+    std::int64_t backoff_ms_ {min_backoff_ms};
+  };
+  struct waiting_call {
+    msg_ptr m_;
+    rpc_sock::call_cb_t cb_;
+    std::int64_t deadline_ms_ {-1};	// Absolute, or -1 for none
+    pollset::Timeout timeout_;
+  };
+
+  pollset &ps_;
+  std::vector<unique_addrinfo> addrs_;
+  std::vector<std::unique_ptr<conn>> conns_;
+  std::list<waiting_call> waiting_;
+  std::size_t nup_ {0};
+  std::size_t nconnecting_ {0};
+  std::size_t next_ {0};	// Where pick starts, to break ties
+  std::int64_t timeout_ms_ {-1};
+
+  rpc_sock *pick();
+  void wait(msg_ptr m, rpc_sock::call_cb_t cb, std::int64_t timeout_ms);
+  void fail_waiting(int err);
+  void connect(conn &c);
+  void connect_done(conn &c);
+  void connect_failed(conn &c);
+  void receive(conn &c, msg_ptr m);
 };
 
 template<typename T> using arpc_client =
   typename T::template _xdr_client<asynchronous_client_base>;
 
+//! Asynchronous client that spreads calls over a pool of connections.
+//! Constructor arguments are those of xdr::pool_client_base.
+template<typename T> using arpc_pool_client =
+  typename T::template _xdr_client<pool_client_base>;
+
 
 // And now for the server
 
@@ -123,14 +285,17 @@ private:
     cb_ = nullptr;
   }
 
-  template<typename T> void send_reply(const T &t) {
+  template<typename T> msg_ptr encode_reply(const T &t) const {
     if (xdr_trace_server) {
       std::string s = "REPLY ";
       s += proc_name_;
       s += " -> [xid " + std::to_string(xid_) + "]";
       std::clog << xdr_to_string(t, s.c_str());
     }
-    send_reply_msg(xdr_to_msg(rpc_success_hdr(xid_), t));
+    return rpc_success_msg(xid_, t);
+  }
+  template<typename T> void send_reply(const T &t) {
+    send_reply_msg(encode_reply(t));
   }
 
   void reject(accept_stat stat) {
@@ -158,6 +323,20 @@ public:
   void operator()(const type &t) const { impl_->send_reply(t); }
   void reject(accept_stat stat) const { impl_->reject(stat); }
   void reject(auth_stat stat) const { impl_->reject(stat); }
+
+  //! Reply with the result of \c work, which is computed and
+  //! marshaled in a worker thread (see pollset_plus::async) so that a
+  //! CPU-heavy procedure does not hold up the event loop.  The reply
+  //! is then sent from the event loop thread of \c ps, which must be
+  //! the pollset of the connection.  \c work must return a value
+  //! convertible to \c T.
+  template<typename Work> void async(pollset_plus &ps, Work &&work) const {
+    std::shared_ptr<impl_t> impl {impl_};
+    ps.async(std::bind([impl](const Work &w) {
+	  return impl->encode_reply(static_cast<const T &>(w()));
+	}, std::forward<Work>(work)),
+      [impl](msg_ptr m) { impl->send_reply_msg(std::move(m)); });
+  }
 };
 template<> class reply_cb<void> : public reply_cb<xdr_void> {
 public:
@@ -165,6 +344,17 @@ public:
   using reply_cb<xdr_void>::reply_cb;
   using reply_cb<xdr_void>::operator();
   void operator()() const { this->operator()(xdr_void{}); }
+
+  //! Like reply_cb::async, but \c work returns nothing and the reply
+  //! is sent once it has run.
+  template<typename Work> void async(pollset_plus &ps, Work &&work) const {
+    std::shared_ptr<detail::reply_cb_impl> impl {impl_};
+    ps.async(std::bind([impl](const Work &w) {
+	  w();
+	  return impl->encode_reply(xdr_void{});
+	}, std::forward<Work>(work)),
+      [impl](msg_ptr m) { impl->send_reply_msg(std::move(m)); });
+  }
 };
 
 template<typename T, typename Session, typename Interface>
@@ -172,9 +362,10 @@ class arpc_service : public service_base {
   T &server_;
 
 public:
-  void process(void *session, rpc_msg &hdr, xdr_get &g, cb_t reply) override {
+  void process(void *session, rpc_msg &hdr, xdr_get &g,
+	       cb_t &&reply) override {
     if (!check_call(hdr))
-      reply(nullptr);
+      return reply(nullptr);
     if (!Interface::call_dispatch(*this, hdr.body.cbody().proc,
 				  static_cast<Session *>(session),
 				  hdr, g, std::move(reply)))
@@ -182,8 +373,8 @@ public:
   }
 
   template<typename P>
-  void dispatch(Session *session, rpc_msg &hdr, xdr_get &g, cb_t reply) {
-    wrap_transparent_ptr<typename P::arg_tuple_type> arg;
+  void dispatch(Session *session, rpc_msg &hdr, xdr_get &g, cb_t &&reply) {
+    dispatch_arg_t<P, T &, Session, reply_cb<typename P::res_type>> arg;
     if (!decode_arg(g, arg))
       return reply(rpc_accepted_error_msg(hdr.xid, GARBAGE_ARGS));
     
@@ -201,7 +392,9 @@ public:
 
   arpc_service(T &server)
     : service_base(Interface::program, Interface::version),
-      server_(server) {}
+      server_(server) {
+    add_procs<arpc_service, Session, Interface>();
+  }
 };
 
 class arpc_server : public rpc_server_base {
@@ -218,6 +411,11 @@ template<typename Session = void,
 using arpc_tcp_listener =
   generic_rpc_tcp_listener<arpc_service, Session, SessionAllocator>;
 
+template<typename Session = void,
+	 typename SessionAllocator = session_allocator<Session>>
+using arpc_tcp_sharded_listener =
+  generic_rpc_tcp_sharded_listener<arpc_service, Session, SessionAllocator>;
+
 } // namespace xdr
 
 #endif // !_XDRPP_ARPC_H_HEADER_INCLUDED_
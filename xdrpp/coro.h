@@ -0,0 +1,428 @@
+// -*- C++ -*-
+
+//! \file coro.h C++20 coroutine interface to asynchronous RPC.  With
+//! xdr::arpc_co_client, calls are awaited rather than given a
+//! callback:
+//! \code
+//!   xdr::task<void> f(xdr::arpc_co_client<myprog_v1> &c) {
+//!     auto r = co_await c.hello(5);
+//!     if (r)
+//!       std::cout << *r << std::endl;
+//!   }
+//! \endcode
+//! On the server side, an xdr::arpc_co_tcp_listener runs handlers
+//! that return \c xdr::task<ResultType> (as generated by \c xdrc \c
+//! -coro) and so may themselves \c co_await other calls or an
+//! xdr::co_delay without holding up the event loop.  Coroutine frames
+//! are recycled through a per-thread pool, so in the steady state a
+//! call allocates no memory beyond its messages.
+//!
+//! Everything in this file requires compiler support for coroutines,
+//! and is omitted otherwise.
+
+#ifndef _XDRPP_CORO_H_HEADER_INCLUDED_
+#define _XDRPP_CORO_H_HEADER_INCLUDED_ 1
+
+#include <xdrpp/arpc.h>
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L \
+  && __has_include(<coroutine>)
+#define XDRPP_HAVE_COROUTINES 1
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+
+namespace xdr {
+
+namespace detail {
+//! Per-thread free lists of coroutine frames, in 64-byte size
+//! classes up to 1 KiB.  Larger frames go straight to the heap.
+class frame_pool {
+  static constexpr std::size_t granularity = 64;
+  static constexpr std::size_t nclasses = 16;
+  static constexpr std::size_t max_cached = 64; // Frames per class
+
+  struct free_frame { free_frame *next_; };
+  free_frame *free_[nclasses] {};
+  std::size_t nfree_[nclasses] {};
+
+  static bool &dead() { static thread_local bool d; return d; }
+  static frame_pool *get() {
+    static thread_local frame_pool p;
+    return dead() ? nullptr : &p;
+  }
+  static std::size_t size_class(std::size_t n) {
+    return (n + granularity - 1) / granularity - 1;
+  }
+
+  frame_pool() = default;
+  ~frame_pool() {
+    dead() = true;
+    for (free_frame *&f : free_)
+      while (free_frame *p = f) {
+	f = p->next_;
+	::operator delete(p);
+      }
+  }
+
+public:
+  static std::atomic<std::uint64_t> &heap_counter() {
+    static std::atomic<std::uint64_t> n {0};
+    return n;
+  }
+
+  static void *allocate(std::size_t n) {
+    std::size_t c = size_class(n);
+    frame_pool *fp;
+    if (c < nclasses && (fp = get()) && fp->free_[c]) {
+      free_frame *f = fp->free_[c];
+      fp->free_[c] = f->next_;
+      --fp->nfree_[c];
+      return f;
+    }
+    heap_counter().fetch_add(1, std::memory_order_relaxed);
+    return ::operator new(c < nclasses ? (c + 1) * granularity : n);
+  }
+
+  static void deallocate(void *p, std::size_t n) {
+    std::size_t c = size_class(n);
+    frame_pool *fp;
+    if (c < nclasses && (fp = get()) && fp->nfree_[c] < max_cached) {
+      free_frame *f = static_cast<free_frame *>(p);
+      f->next_ = fp->free_[c];
+      fp->free_[c] = f;
+      ++fp->nfree_[c];
+    }
+    else
+      ::operator delete(p);
+  }
+};
+
+//! Base of all promise types in this file, so their frames come from
+//! the frame_pool.
+struct pooled_promise {
+  static void *operator new(std::size_t n) {
+    return frame_pool::allocate(n);
+  }
+  static void operator delete(void *p, std::size_t n) {
+    frame_pool::deallocate(p, n);
+  }
+};
+} // namespace detail
+
+//! Number of coroutine frames that could not be taken from the
+//! per-thread pool and were allocated on the heap.  Like
+//! xdr::unique_function_heap_allocs, for checking that a code path
+//! does not allocate in the steady state.
+inline std::uint64_t
+coroutine_frame_heap_allocs()
+{
+  return detail::frame_pool::heap_counter().load(std::memory_order_relaxed);
+}
+
+template<typename T = void> class task;
+
+namespace detail {
+struct task_promise_base : pooled_promise {
+  std::coroutine_handle<> continuation_ {std::noop_coroutine()};
+  std::exception_ptr err_;
+
+  // When the task finishes, resume whatever was awaiting it
+  struct final_awaiter {
+    bool await_ready() noexcept { return false; }
+    template<typename P> std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<P> h) noexcept {
+      return h.promise().continuation_;
+    }
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  final_awaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { err_ = std::current_exception(); }
+};
+
+template<typename T> struct task_promise : task_promise_base {
+  std::optional<T> value_;
+
+  task<T> get_return_object();
+  template<typename U = T> void return_value(U &&u) {
+    value_.emplace(std::forward<U>(u));
+  }
+  T result() {
+    if (err_)
+      std::rethrow_exception(err_);
+    return std::move(*value_);
+  }
+};
+template<> struct task_promise<void> : task_promise_base {
+  task<void> get_return_object();
+  void return_void() {}
+  void result() {
+    if (err_)
+      std::rethrow_exception(err_);
+  }
+};
+} // namespace detail
+
+//! Lazily started coroutine producing a \c T.  The coroutine body
+//! does not run until the task is awaited (or passed to
+//! xdr::co_spawn).  Awaiting a task yields its return value, or
+//! rethrows the exception that escaped it.
+template<typename T> class [[nodiscard]] task {
+public:
+  using promise_type = detail::task_promise<T>;
+  using handle_type = std::coroutine_handle<promise_type>;
+
+  task(task &&t) noexcept : h_(std::exchange(t.h_, {})) {}
+  task &operator=(task &&t) noexcept {
+    if (this != &t) {
+      if (h_)
+	h_.destroy();
+      h_ = std::exchange(t.h_, {});
+    }
+    return *this;
+  }
+  ~task() { if (h_) h_.destroy(); }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+    h_.promise().continuation_ = c;
+    return h_;
+  }
+  T await_resume() { return h_.promise().result(); }
+
+private:
+  friend promise_type;
+  explicit task(handle_type h) : h_(h) {}
+  handle_type h_;
+};
+
+namespace detail {
+template<typename T> inline task<T>
+task_promise<T>::get_return_object()
+{
+  return task<T>(task<T>::handle_type::from_promise(*this));
+}
+inline task<void>
+task_promise<void>::get_return_object()
+{
+  return task<void>(task<void>::handle_type::from_promise(*this));
+}
+
+//! Coroutine that starts immediately and destroys itself when done.
+//! Used to run a task from ordinary (non-coroutine) code.
+struct detached_task {
+  struct promise_type : pooled_promise {
+    detached_task get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() {
+      try { throw; }
+      catch (const std::exception &e) {
+	std::cerr << "xdr::co_spawn: task threw " << e.what() << std::endl;
+      }
+      catch (...) {
+	std::cerr << "xdr::co_spawn: task threw unknown exception"
+		  << std::endl;
+      }
+      std::terminate();
+    }
+  };
+};
+
+template<typename T> detached_task
+spawn_task(task<T> t)
+{
+  co_await std::move(t);
+}
+} // namespace detail
+
+//! Start running task \c t from code that cannot \c co_await it.
+//! The result is discarded; an exception escaping the task is fatal.
+template<typename T> inline void
+co_spawn(task<T> &&t)
+{
+  detail::spawn_task(std::move(t));
+}
+
+//! Awaitable that resumes the awaiting coroutine from the event loop
+//! of \c ps after \c ms milliseconds.  (A coroutine still suspended when
+//! \c ps is destroyed is never resumed, and its frame is leaked.)
+class co_delay {
+  pollset &ps_;
+  std::int64_t ms_;
+public:
+  co_delay(pollset &ps, std::int64_t ms) : ps_(ps), ms_(ms) {}
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h) {
+    ps_.timeout(ms_, [h]() { h.resume(); });
+  }
+  void await_resume() noexcept {}
+};
+
+
+//! Awaitable result of a call through an xdr::arpc_co_client.  The
+//! call is marshaled when the client method is invoked and sent when
+//! the awaitable is awaited; awaiting it yields a call_result.  If
+//! the awaiting coroutine is destroyed before the reply arrives, the
+//! call is cancelled.
+template<typename P> class rpc_call_awaiter {
+  using result_type = call_result<typename P::res_type>;
+
+  rpc_sock &s_;
+  msg_ptr m_;
+  std::int64_t timeout_ms_;
+  std::coroutine_handle<> h_;
+  rpc_sock::call_handle call_;
+  std::optional<result_type> res_;
+
+public:
+  rpc_call_awaiter(rpc_sock &s, msg_ptr &&m, std::int64_t timeout_ms)
+    : s_(s), m_(std::move(m)), timeout_ms_(timeout_ms) {}
+  rpc_call_awaiter(rpc_call_awaiter &&) = default;
+  ~rpc_call_awaiter() { if (!res_) call_.cancel(); }
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h) {
+    h_ = h;
+    // The xid is only chosen now, so that any number of awaiters can
+    // be created before being awaited
+    std::uint32_t xid = swap32le(s_.get_xid());
+    std::memcpy(m_->data(), &xid, sizeof(xid));
+    call_ = s_.send_call(m_, detail::arpc_reply_handler<P>(
+      [this](result_type r) {
+	res_.emplace(std::move(r));
+	h_.resume();
+      }), timeout_ms_);
+  }
+  result_type await_resume() { return std::move(*res_); }
+};
+
+//! Invoker for xdr::arpc_co_client.  Each call method of the client
+//! returns an xdr::rpc_call_awaiter, and takes an optional extra
+//! argument:  a timeout in milliseconds after which the call fails
+//! with rpc_call_stat::TIMEOUT.
+class coroutine_client_base {
+  rpc_sock &s_;
+  std::int64_t timeout_ms_ {-1};
+
+public:
+  coroutine_client_base(rpc_sock &s) : s_(s) {}
+  coroutine_client_base(coroutine_client_base &c)
+    : s_(c.s_), timeout_ms_(c.timeout_ms_) {}
+
+  //! Set the timeout for calls that do not specify one.
+  void set_timeout(std::int64_t ms) { timeout_ms_ = ms; }
+
+  template<typename P, typename...A> rpc_call_awaiter<P>
+  invoke(const A &...a, std::int64_t timeout_ms) {
+    return rpc_call_awaiter<P>(s_, detail::arpc_encode_call<P>(0, a...),
+			       timeout_ms);
+  }
+  // type_identity stops the timeout from being deduced as an argument
+  template<typename P, typename...A> rpc_call_awaiter<P>
+  invoke(const std::type_identity_t<A> &...a) {
+    return invoke<P, A...>(a..., timeout_ms_);
+  }
+
+  coroutine_client_base *operator->() { return this; }
+};
+
+//! Asynchronous client whose methods return awaitables (see
+//! xdr::rpc_call_awaiter).  The constructor takes an xdr::rpc_sock.
+template<typename T> using arpc_co_client =
+  typename T::template _xdr_client<coroutine_client_base>;
+
+
+//! Service whose handlers are coroutines returning \c
+//! xdr::task<typename P::res_type>.  Each call runs as its own
+//! coroutine, so a handler that suspends does not delay other calls.
+//! The decoded arguments live in the call's coroutine frame, so
+//! handlers may take them by reference.  An exception escaping a
+//! handler is reported to the client as \c SYSTEM_ERR.
+template<typename T, typename Session, typename Interface>
+class arpc_co_service : public service_base {
+  T &server_;
+
+  template<typename P, typename R> static msg_ptr
+  encode_reply(std::uint32_t xid, const R &r) {
+    if (xdr_trace_server) {
+      std::string s = "REPLY ";
+      s += P::proc_name();
+      s += " -> [xid " + std::to_string(xid) + "]";
+      std::clog << xdr_to_string(r, s.c_str());
+    }
+    return rpc_success_msg(xid, r);
+  }
+
+  template<typename P> static detail::detached_task
+  run(T &server, Session *session, dispatch_arg_t<P, T &, Session> arg,
+      std::uint32_t xid, cb_t reply) {
+    msg_ptr m;
+    try {
+      if constexpr (std::is_void_v<typename P::res_type>) {
+	co_await dispatch_with_session<P>(server, session, std::move(arg));
+	m = encode_reply<P>(xid, xdr_void{});
+      }
+      else
+	m = encode_reply<P>(xid, co_await dispatch_with_session<P>(
+				      server, session, std::move(arg)));
+    }
+    catch (const std::exception &e) {
+      if (xdr_trace_server)
+	std::clog << "REPLY " << P::proc_name() << " -> [xid " << xid
+		  << "]: " << e.what() << std::endl;
+      m = rpc_accepted_error_msg(xid, SYSTEM_ERR);
+    }
+    reply(std::move(m));
+  }
+
+public:
+  void process(void *session, rpc_msg &hdr, xdr_get &g,
+	       cb_t &&reply) override {
+    if (!check_call(hdr))
+      return reply(nullptr);
+    if (!Interface::call_dispatch(*this, hdr.body.cbody().proc,
+				  static_cast<Session *>(session),
+				  hdr, g, std::move(reply)))
+      reply(rpc_accepted_error_msg(hdr.xid, PROC_UNAVAIL));
+  }
+
+  template<typename P>
+  void dispatch(Session *session, rpc_msg &hdr, xdr_get &g, cb_t &&reply) {
+    dispatch_arg_t<P, T &, Session> arg;
+    if (!decode_arg(g, arg))
+      return reply(rpc_accepted_error_msg(hdr.xid, GARBAGE_ARGS));
+
+    if (xdr_trace_server) {
+      std::string s = "CALL ";
+      s += P::proc_name();
+      s += " <- [xid " + std::to_string(hdr.xid) + "]";
+      std::clog << xdr_to_string(arg, s.c_str());
+    }
+
+    run<P>(server_, session, std::move(arg), hdr.xid, std::move(reply));
+  }
+
+  arpc_co_service(T &server)
+    : service_base(Interface::program, Interface::version),
+      server_(server) {
+    add_procs<arpc_co_service, Session, Interface>();
+  }
+};
+
+//! TCP listener whose services have coroutine handlers (see
+//! xdr::arpc_co_service).
+template<typename Session = void,
+	 typename SessionAllocator = session_allocator<Session>>
+using arpc_co_tcp_listener =
+  generic_rpc_tcp_listener<arpc_co_service, Session, SessionAllocator>;
+
+} // namespace xdr
+
+#endif // coroutines
+
+#endif // !_XDRPP_CORO_H_HEADER_INCLUDED_
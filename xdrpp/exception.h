@@ -33,6 +33,7 @@ struct rpc_call_stat {
     GARBAGE_RES,
     NETWORK_ERROR,
     BAD_ALLOC,
+    TIMEOUT,			//!< No reply before the call's deadline
   };
   stat_type type_;
   union {
@@ -0,0 +1,191 @@
+// -*- C++ -*-
+
+//! \file function.h Move-only function wrapper that stores small
+//! targets inline.  Used for the callbacks of xdr::pollset,
+//! xdr::msg_sock, and xdr::rpc_sock, so that registering a callback
+//! does not normally allocate memory.
+
+#ifndef _XDRPP_FUNCTION_H_HEADER_INCLUDED_
+#define _XDRPP_FUNCTION_H_HEADER_INCLUDED_ 1
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace xdr {
+
+//! Default number of bytes of inline storage in an
+//! xdr::unique_function.  Enough for a lambda capturing six pointers,
+//! or a \c std::bind of a member function pointer and a few
+//! arguments.
+constexpr std::size_t unique_function_inline = 48;
+
+namespace detail {
+inline std::atomic<std::uint64_t> &
+unique_function_heap_counter()
+{
+  static std::atomic<std::uint64_t> n {0};
+  return n;
+}
+}
+
+//! Number of times any xdr::unique_function has had to allocate its
+//! target on the heap because the target was too big (or not
+//! nothrow-movable).  Useful for checking that a code path does not
+//! allocate.
+inline std::uint64_t
+unique_function_heap_allocs()
+{
+  return detail::unique_function_heap_counter()
+    .load(std::memory_order_relaxed);
+}
+
+template<typename Sig, std::size_t N = unique_function_inline>
+class unique_function;
+
+//! Like \c std::function, but move-only (so it can hold move-only
+//! targets), with \c N bytes of inline storage for the target.
+//! Targets that do not fit are allocated on the heap, and counted by
+//! xdr::unique_function_heap_allocs.
+template<typename R, typename...A, std::size_t N>
+class unique_function<R(A...), N> {
+  static_assert(N >= sizeof(void *), "inline buffer too small");
+  using storage_t = typename std::aligned_storage<
+    N, alignof(std::max_align_t)>::type;
+
+  struct ops_t {
+    R (*call)(void *, A&&...);
+    // Move-construct the target at dst from src, and destroy src
+    void (*relocate)(void *dst, void *src);
+    void (*destroy)(void *);
+  };
+
+  // Call f, discarding its result when R is void, as std::function does
+  template<typename F> static R invoke(std::false_type, F &f, A&&...a) {
+    return f(std::forward<A>(a)...);
+  }
+  template<typename F> static void invoke(std::true_type, F &f, A&&...a) {
+    static_cast<void>(f(std::forward<A>(a)...));
+  }
+
+  template<typename F> struct inline_ops {
+    static F &get(void *p) { return *static_cast<F *>(p); }
+    static R call(void *p, A&&...a) {
+      return invoke(std::is_void<R>{}, get(p), std::forward<A>(a)...);
+    }
+    static void relocate(void *dst, void *src) {
+      new (dst) F(std::move(get(src)));
+      get(src).~F();
+    }
+    static void destroy(void *p) { get(p).~F(); }
+    static const ops_t *table() {
+      static const ops_t ops {&call, &relocate, &destroy};
+      return &ops;
+    }
+  };
+
+  template<typename F> struct heap_ops {
+    static F &get(void *p) { return **static_cast<F **>(p); }
+    static R call(void *p, A&&...a) {
+      return invoke(std::is_void<R>{}, get(p), std::forward<A>(a)...);
+    }
+    static void relocate(void *dst, void *src) {
+      *static_cast<F **>(dst) = *static_cast<F **>(src);
+    }
+    static void destroy(void *p) { delete *static_cast<F **>(p); }
+    static const ops_t *table() {
+      static const ops_t ops {&call, &relocate, &destroy};
+      return &ops;
+    }
+  };
+
+  template<typename F> struct fits : std::integral_constant<bool,
+    sizeof(F) <= N && alignof(std::max_align_t) % alignof(F) == 0
+    && std::is_nothrow_move_constructible<F>::value> {};
+
+  // Targets that are themselves empty yield an empty unique_function
+  template<typename F> static bool is_null(const F &) { return false; }
+  template<typename S> static bool is_null(const std::function<S> &f) {
+    return !f;
+  }
+  template<typename T> static bool is_null(T *p) { return !p; }
+
+  template<typename F> void init(F &&f, std::true_type) {
+    new (&buf_) F(std::move(f));
+    ops_ = inline_ops<F>::table();
+  }
+  template<typename F> void init(F &&f, std::false_type) {
+    *reinterpret_cast<F **>(&buf_) = new F(std::move(f));
+    ops_ = heap_ops<F>::table();
+    detail::unique_function_heap_counter()
+      .fetch_add(1, std::memory_order_relaxed);
+  }
+
+  const ops_t *ops_ {nullptr};
+  storage_t buf_;
+
+public:
+  unique_function() = default;
+  unique_function(std::nullptr_t) {}
+  template<typename F, typename D = typename std::decay<F>::type,
+	   typename = typename std::enable_if<
+	     !std::is_same<D, unique_function>::value
+	     && (std::is_void<R>::value || std::is_convertible<
+		   decltype(std::declval<D &>()(std::declval<A>()...)),
+		   R>::value)
+	     >::type>
+  unique_function(F &&f) {
+    if (!is_null(f)) {
+      D d(std::forward<F>(f));
+      init(std::move(d), fits<D>{});
+    }
+  }
+  unique_function(unique_function &&other) noexcept : ops_(other.ops_) {
+    if (ops_) {
+      ops_->relocate(&buf_, &other.buf_);
+      other.ops_ = nullptr;
+    }
+  }
+  ~unique_function() { if (ops_) ops_->destroy(&buf_); }
+
+  unique_function &operator=(unique_function &&other) noexcept {
+    if (this != &other) {
+      *this = nullptr;
+      if ((ops_ = other.ops_)) {
+	ops_->relocate(&buf_, &other.buf_);
+	other.ops_ = nullptr;
+      }
+    }
+    return *this;
+  }
+  unique_function &operator=(std::nullptr_t) noexcept {
+    if (const ops_t *ops = ops_) {
+      ops_ = nullptr;
+      ops->destroy(&buf_);
+    }
+    return *this;
+  }
+  template<typename F> unique_function &operator=(F &&f) {
+    return *this = unique_function(std::forward<F>(f));
+  }
+
+  unique_function(const unique_function &) = delete;
+  unique_function &operator=(const unique_function &) = delete;
+
+  explicit operator bool() const { return ops_; }
+
+  //! Invoke the target, which must not be empty.  Like \c
+  //! std::function, this is a \c const member even though the target
+  //! may modify its own state.
+  R operator()(A...a) const {
+    return ops_->call(const_cast<storage_t *>(&buf_), std::forward<A>(a)...);
+  }
+};
+
+}
+
+#endif // !_XDRPP_FUNCTION_H_HEADER_INCLUDED_
@@ -45,6 +45,9 @@ public:
 
   //! Allocate a new buffer.
   static msg_ptr alloc(std::size_t size);
+  //! Unsized, because the buffer is bigger than \c sizeof(message_t)
+  //! (which C++14 and later would otherwise pass to delete).
+  static void operator delete(void *p) { ::operator delete(p); }
 };
 
 }
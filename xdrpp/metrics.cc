@@ -0,0 +1,416 @@
+
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <tuple>
+#include <unordered_map>
+#include <xdrpp/marshal.h>
+#include <xdrpp/metrics.h>
+#include <xdrpp/rpc_msg.hh>
+
+namespace xdr {
+
+constexpr int rpc_metrics::DENIED;
+constexpr int rpc_metrics::NO_REPLY;
+
+unsigned
+latency_buckets::index(std::uint64_t ns)
+{
+  constexpr std::uint64_t sub = std::uint64_t(1) << sub_bits;
+  if (ns < sub)
+    return ns;
+  if (ns > max_ns)
+    ns = max_ns;
+  unsigned e = 63 - __builtin_clzll(ns);
+  return ((e - sub_bits + 1) << sub_bits) + ((ns >> (e - sub_bits)) & (sub - 1));
+}
+
+std::uint64_t
+latency_buckets::upper_bound(unsigned i)
+{
+  constexpr unsigned sub = 1u << sub_bits;
+  if (i < sub)
+    return i;
+  unsigned shift = (i >> sub_bits) - 1;
+  return ((std::uint64_t(sub + (i & (sub - 1))) + 1) << shift) - 1;
+}
+
+namespace {
+
+using counter = std::atomic<std::uint64_t>;
+
+// Only the thread owning a counter writes it, so there is no need for
+// an atomic read-modify-write.
+inline void
+bump(counter &c, std::uint64_t n = 1)
+{
+  c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline std::uint64_t
+read(const counter &c)
+{
+  return c.load(std::memory_order_relaxed);
+}
+
+using proc_key = std::tuple<std::uint32_t, std::uint32_t, std::uint32_t>;
+
+struct proc_key_hash {
+  std::size_t operator()(const proc_key &k) const {
+    std::uint64_t h = (std::uint64_t(std::get<0>(k)) << 32 | std::get<1>(k))
+      * 0x9e3779b97f4a7c15ULL ^ std::get<2>(k) * 0xc2b2ae3d27d4eb4fULL;
+    return h ^ h >> 32;
+  }
+};
+
+std::atomic<std::uint64_t> next_metrics_id {1};
+
+std::uint64_t
+now_ns()
+{
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(
+    steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+struct rpc_metrics::proc_counters {
+  counter calls_;
+  counter accept_stats_[SYSTEM_ERR + 1];
+  counter denied_;
+  counter no_reply_;
+  counter bytes_in_;
+  counter bytes_out_;
+  counter latency_sum_;
+  counter latency_[latency_buckets::count];
+
+  proc_counters() {
+    for (counter *c : {&calls_, &denied_, &no_reply_, &bytes_in_,
+		       &bytes_out_, &latency_sum_})
+      c->store(0, std::memory_order_relaxed);
+    for (counter &c : accept_stats_)
+      c.store(0, std::memory_order_relaxed);
+    for (counter &c : latency_)
+      c.store(0, std::memory_order_relaxed);
+  }
+};
+
+struct rpc_metrics::shard {
+  // The owning thread looks procedures up without locking, since it
+  // is the only one to add them.  It holds mu_ while adding one, and
+  // rpc_metrics::snapshot holds it while reading.
+  std::mutex mu_;
+  std::unordered_map<proc_key, std::unique_ptr<proc_counters>,
+		     proc_key_hash> procs_[2];
+
+  proc_counters &get(side sd, const proc_key &k) {
+    auto &procs = procs_[sd];
+    auto i = procs.find(k);
+    if (i != procs.end())
+      return *i->second;
+    std::unique_ptr<proc_counters> pc(new proc_counters);
+    proc_counters &ret = *pc;
+    std::lock_guard<std::mutex> lk(mu_);
+    procs.emplace(k, std::move(pc));
+    return ret;
+  }
+};
+
+namespace {
+// Shards of the current thread, by rpc_metrics::id_
+thread_local std::vector<std::pair<std::uint64_t, rpc_metrics::shard *>>
+  local_shards;
+}
+
+rpc_metrics::rpc_metrics()
+  : id_(next_metrics_id.fetch_add(1, std::memory_order_relaxed)) {}
+
+rpc_metrics::~rpc_metrics() {}
+
+rpc_metrics::shard &
+rpc_metrics::local()
+{
+  for (const auto &ls : local_shards)
+    if (ls.first == id_)
+      return *ls.second;
+  std::unique_ptr<shard> s(new shard);
+  shard *sp = s.get();
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    shards_.push_back(std::move(s));
+  }
+  local_shards.emplace_back(id_, sp);
+  return *sp;
+}
+
+void
+rpc_metrics::record(side sd, std::uint32_t prog, std::uint32_t vers,
+		    std::uint32_t proc, int stat, std::size_t in,
+		    std::size_t out, std::uint64_t latency_ns)
+{
+  proc_counters &pc = local().get(sd, proc_key(prog, vers, proc));
+  bump(pc.calls_);
+  if (stat == DENIED)
+    bump(pc.denied_);
+  else if (stat >= 0 && stat <= SYSTEM_ERR)
+    bump(pc.accept_stats_[stat]);
+  else
+    bump(pc.no_reply_);
+  bump(pc.bytes_in_, in);
+  bump(pc.bytes_out_, out);
+  bump(pc.latency_sum_, latency_ns);
+  bump(pc.latency_[latency_buckets::index(latency_ns)]);
+}
+
+namespace {
+// State of one metered call.  It lives out of line, so that
+// metered_cb is a single pointer and fits in the inline buffer of the
+// unique_function it is stored in, and is recycled through a
+// per-thread free list, so metering a call does not normally
+// allocate.
+template<typename...E> struct metered_call {
+  rpc_metrics *m_;
+  rpc_metrics::side sd_;
+  std::uint32_t prog_, vers_, proc_;
+  std::size_t size_;		// Of the call
+  std::uint64_t start_ns_;
+  unique_function<void(msg_ptr, E...)> cb_;
+
+  static constexpr std::size_t max_free = 1024;
+  using free_list = std::vector<std::unique_ptr<metered_call>>;
+  static free_list &free_calls() {
+    static thread_local free_list fl;
+    return fl;
+  }
+
+  static metered_call *get() {
+    free_list &fl = free_calls();
+    if (fl.empty())
+      return new metered_call;
+    metered_call *c = fl.back().release();
+    fl.pop_back();
+    return c;
+  }
+  static void put(metered_call *c) {
+    c->cb_ = nullptr;
+    free_list &fl = free_calls();
+    if (fl.size() < max_free)
+      fl.emplace_back(c);
+    else
+      delete c;
+  }
+
+  void count(const msg_ptr &reply) {
+    std::size_t rsize = reply ? reply->size() : 0;
+    bool server = sd_ == rpc_metrics::SERVER;
+    m_->record(sd_, prog_, vers_, proc_, rpc_reply_status(reply),
+	       server ? size_ : rsize, server ? rsize : size_,
+	       now_ns() - start_ns_);
+  }
+};
+
+// Wraps a server's reply callback, or (with an extra error argument)
+// a client's call callback.
+template<typename...E> class metered_cb {
+  metered_call<E...> *c_;
+
+public:
+  metered_cb(rpc_metrics *m, rpc_metrics::side sd, std::uint32_t prog,
+	     std::uint32_t vers, std::uint32_t proc, std::size_t size,
+	     unique_function<void(msg_ptr, E...)> &&cb)
+    : c_(metered_call<E...>::get()) {
+    c_->m_ = m;
+    c_->sd_ = sd;
+    c_->prog_ = prog;
+    c_->vers_ = vers;
+    c_->proc_ = proc;
+    c_->size_ = size;
+    c_->start_ns_ = now_ns();
+    c_->cb_ = std::move(cb);
+  }
+  metered_cb(metered_cb &&other) noexcept : c_(other.c_) {
+    other.c_ = nullptr;
+  }
+  ~metered_cb() {
+    if (c_) {
+      c_->count(nullptr);
+      metered_call<E...>::put(c_);
+    }
+  }
+
+  void operator()(msg_ptr m, E...e) {
+    c_->count(m);
+    unique_function<void(msg_ptr, E...)> cb {std::move(c_->cb_)};
+    metered_call<E...>::put(c_);
+    c_ = nullptr;
+    cb(std::move(m), e...);
+  }
+};
+} // namespace
+
+unique_function<void(msg_ptr)>
+rpc_metrics::meter(side sd, std::uint32_t prog, std::uint32_t vers,
+		   std::uint32_t proc, std::size_t size,
+		   unique_function<void(msg_ptr)> cb)
+{
+  return metered_cb<>(this, sd, prog, vers, proc, size, std::move(cb));
+}
+
+unique_function<void(msg_ptr, int)>
+rpc_metrics::meter(side sd, std::uint32_t prog, std::uint32_t vers,
+		   std::uint32_t proc, std::size_t size,
+		   unique_function<void(msg_ptr, int)> cb)
+{
+  return metered_cb<int>(this, sd, prog, vers, proc, size, std::move(cb));
+}
+
+rpc_stats
+rpc_metrics::snapshot() const
+{
+  struct totals {
+    std::uint64_t calls_ {0};
+    std::uint64_t accept_stats_[SYSTEM_ERR + 1] {};
+    std::uint64_t denied_ {0};
+    std::uint64_t no_reply_ {0};
+    std::uint64_t bytes_in_ {0};
+    std::uint64_t bytes_out_ {0};
+    std::uint64_t latency_sum_ {0};
+    std::vector<std::uint64_t> latency_ =
+      std::vector<std::uint64_t>(latency_buckets::count);
+  };
+  std::map<proc_key, totals> sums[2];
+
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    for (const auto &s : shards_) {
+      std::lock_guard<std::mutex> slk(s->mu_);
+      for (int sd = SERVER; sd <= CLIENT; sd++)
+	for (const auto &p : s->procs_[sd]) {
+	  const proc_counters &pc = *p.second;
+	  totals &t = sums[sd][p.first];
+	  t.calls_ += read(pc.calls_);
+	  for (int i = 0; i <= SYSTEM_ERR; i++)
+	    t.accept_stats_[i] += read(pc.accept_stats_[i]);
+	  t.denied_ += read(pc.denied_);
+	  t.no_reply_ += read(pc.no_reply_);
+	  t.bytes_in_ += read(pc.bytes_in_);
+	  t.bytes_out_ += read(pc.bytes_out_);
+	  t.latency_sum_ += read(pc.latency_sum_);
+	  for (unsigned i = 0; i < latency_buckets::count; i++)
+	    t.latency_[i] += read(pc.latency_[i]);
+	}
+    }
+  }
+
+  rpc_stats ret;
+  for (int sd = SERVER; sd <= CLIENT; sd++) {
+    auto &out = sd == SERVER ? ret.server : ret.client;
+    for (const auto &p : sums[sd]) {
+      const totals &t = p.second;
+      out.emplace_back();
+      rpc_proc_stats &s = out.back();
+      std::tie(s.prog, s.vers, s.proc) = p.first;
+      s.calls = t.calls_;
+      for (int i = 0; i <= SYSTEM_ERR; i++)
+	s.accept_stats[i] = t.accept_stats_[i];
+      s.denied = t.denied_;
+      s.no_reply = t.no_reply_;
+      s.bytes_in = t.bytes_in_;
+      s.bytes_out = t.bytes_out_;
+      s.latency_sum_ns = t.latency_sum_;
+      for (unsigned i = 0; i < latency_buckets::count; i++)
+	if (t.latency_[i])
+	  s.latency.push_back(rpc_latency_bucket{
+	      latency_buckets::upper_bound(i), t.latency_[i]});
+    }
+  }
+  return ret;
+}
+
+int
+rpc_reply_status(const msg_ptr &m)
+{
+  if (!m)
+    return rpc_metrics::NO_REPLY;
+  try {
+    xdr_get g(m);
+    rpc_msg hdr;
+    archive(g, hdr);
+    if (hdr.body.mtype() != REPLY)
+      return rpc_metrics::NO_REPLY;
+    if (hdr.body.rbody().stat() == MSG_DENIED)
+      return rpc_metrics::DENIED;
+    return hdr.body.rbody().areply().reply_data.stat();
+  }
+  catch (const xdr_runtime_error &) {
+    return rpc_metrics::NO_REPLY;
+  }
+}
+
+std::uint64_t
+rpc_latency_quantile(const rpc_proc_stats &s, double q)
+{
+  std::uint64_t total = 0;
+  for (const auto &b : s.latency)
+    total += b.count;
+  if (!total)
+    return 0;
+  std::uint64_t rank = q * total;
+  if (rank >= total)
+    rank = total - 1;
+  std::uint64_t seen = 0;
+  for (const auto &b : s.latency)
+    if ((seen += b.count) > rank)
+      return b.le_ns;
+  return s.latency.back().le_ns;
+}
+
+namespace {
+void
+text_side(std::ostream &os, const char *side,
+	  const xvector<rpc_proc_stats> &procs)
+{
+  static const char *const stat_names[] = {
+    "SUCCESS", "PROG_UNAVAIL", "PROG_MISMATCH", "PROC_UNAVAIL",
+    "GARBAGE_ARGS", "SYSTEM_ERR",
+  };
+  for (const rpc_proc_stats &s : procs) {
+    std::ostringstream lbl;
+    lbl << "prog=\"" << s.prog << "\",vers=\"" << s.vers
+	<< "\",proc=\"" << s.proc << "\"";
+    std::string l = lbl.str();
+    std::string p = std::string("xdrpp_rpc_") + side + "_";
+
+    os << p << "calls_total{" << l << "} " << s.calls << "\n";
+    for (int i = 0; i <= SYSTEM_ERR; i++)
+      if (s.accept_stats[i])
+	os << p << "replies_total{" << l << ",stat=\"" << stat_names[i]
+	   << "\"} " << s.accept_stats[i] << "\n";
+    if (s.denied)
+      os << p << "replies_total{" << l << ",stat=\"MSG_DENIED\"} "
+	 << s.denied << "\n";
+    if (s.no_reply)
+      os << p << "replies_total{" << l << ",stat=\"NO_REPLY\"} "
+	 << s.no_reply << "\n";
+    os << p << "bytes_in_total{" << l << "} " << s.bytes_in << "\n"
+       << p << "bytes_out_total{" << l << "} " << s.bytes_out << "\n";
+    for (const char *q : {"0.5", "0.99", "0.999"})
+      os << p << "latency_ns{" << l << ",quantile=\"" << q << "\"} "
+	 << rpc_latency_quantile(s, std::stod(q)) << "\n";
+    os << p << "latency_ns_sum{" << l << "} " << s.latency_sum_ns << "\n"
+       << p << "latency_ns_count{" << l << "} " << s.calls << "\n";
+  }
+}
+} // namespace
+
+std::string
+rpc_stats_to_text(const rpc_stats &s)
+{
+  std::ostringstream os;
+  text_side(os, "server", s.server);
+  text_side(os, "client", s.client);
+  return os.str();
+}
+
+} // namespace xdr
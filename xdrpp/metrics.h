@@ -0,0 +1,123 @@
+// -*- C++ -*-
+
+//! \file metrics.h Per-procedure call counters and latency
+//! histograms for RPC servers and clients.
+
+#ifndef _XDRPP_METRICS_H_HEADER_INCLUDED_
+#define _XDRPP_METRICS_H_HEADER_INCLUDED_ 1
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <xdrpp/msgsock.h>
+#include <xdrpp/rpc_stats.hh>
+
+namespace xdr {
+
+//! Bucket layout of the latency histograms kept by xdr::rpc_metrics,
+//! in the style of HdrHistogram:  values below 2^sub_bits nanoseconds
+//! get a bucket each, and every larger power of two is split into
+//! 2^sub_bits buckets, so a bucket's bounds are within 1/16 of each
+//! other.  Values of max_ns or more all go in the last bucket.
+struct latency_buckets {
+  static constexpr unsigned sub_bits = 4;
+  static constexpr unsigned max_log2 = 40;	// About 18 minutes
+  static constexpr std::uint64_t max_ns = (std::uint64_t(1) << max_log2) - 1;
+  static constexpr unsigned count =
+    (max_log2 - sub_bits + 1) << sub_bits;
+
+  //! Bucket containing \c ns.
+  static unsigned index(std::uint64_t ns);
+  //! Largest value in bucket \c i.
+  static std::uint64_t upper_bound(unsigned i);
+};
+
+//! Collects statistics about the calls handled by any number of
+//! servers (see rpc_server_base::set_metrics) and made by any number
+//! of clients (see asynchronous_client_base::set_metrics), which may
+//! run on different threads.  Each thread updates counters of its
+//! own, with no locking or atomic read-modify-write operations, and
+//! rpc_metrics::snapshot adds them all up.  The metrics object must
+//! outlive the servers and clients using it.
+class rpc_metrics {
+public:
+  enum side { SERVER, CLIENT };
+  //! Status of a call that got an \c MSG_DENIED reply, for
+  //! rpc_metrics::record.  Other replies are described by their
+  //! accept_stat.
+  static constexpr int DENIED = -1;
+  //! Status of a call that got no reply.
+  static constexpr int NO_REPLY = -2;
+
+  struct proc_counters;
+  struct shard;
+
+  rpc_metrics();
+  ~rpc_metrics();
+  rpc_metrics(const rpc_metrics &) = delete;
+  rpc_metrics &operator=(const rpc_metrics &) = delete;
+
+  //! Count one completed call.  \c in and \c out are the sizes of
+  //! the messages received and sent (so for a client, \c out is the
+  //! size of the call).
+  void record(side sd, std::uint32_t prog, std::uint32_t vers,
+	      std::uint32_t proc, int stat, std::size_t in,
+	      std::size_t out, std::uint64_t latency_ns);
+
+  //! Wrap a reply callback so that it counts the call when invoked
+  //! (or, if it is destroyed without being invoked, counts the call
+  //! as rpc_metrics::NO_REPLY).  \c size is the size of the call
+  //! message.  For xdr::rpc_server_base, \c cb is what sends the
+  //! reply; for a client, it is what receives it.
+  unique_function<void(msg_ptr)>
+  meter(side sd, std::uint32_t prog, std::uint32_t vers, std::uint32_t proc,
+	std::size_t size, unique_function<void(msg_ptr)> cb);
+  //! Same, for an rpc_sock::call_cb_t.
+  unique_function<void(msg_ptr, int)>
+  meter(side sd, std::uint32_t prog, std::uint32_t vers, std::uint32_t proc,
+	std::size_t size, unique_function<void(msg_ptr, int)> cb);
+
+  //! Add up the counters of all threads.
+  rpc_stats snapshot() const;
+
+private:
+  const std::uint64_t id_;	// Never reused, unlike this
+  mutable std::mutex mu_;
+  std::vector<std::unique_ptr<shard>> shards_;
+
+  shard &local();
+};
+
+//! Status of a reply message for rpc_metrics::record.
+int rpc_reply_status(const msg_ptr &m);
+
+//! Estimate the \c q quantile (between 0 and 1) of a procedure's
+//! latency, as the upper bound of the bucket containing it.
+std::uint64_t rpc_latency_quantile(const rpc_proc_stats &s, double q);
+
+//! Render statistics as text, in the Prometheus exposition format.
+//! Each procedure gets a call counter, counters for errors and
+//! traffic, and a latency summary with the 0.5, 0.99, and 0.999
+//! quantiles.
+std::string rpc_stats_to_text(const rpc_stats &s);
+
+//! Serves the statistics of an xdr::rpc_metrics with the \c
+//! xdrpp_stats_v1 interface defined in <tt>xdrpp/rpc_stats.x</tt>.
+//! Can be registered with synchronous or asynchronous listeners.
+class rpc_stats_server {
+  const rpc_metrics &m_;
+public:
+  using rpc_interface_type = xdrpp_stats_v1;
+  explicit rpc_stats_server(const rpc_metrics &m) : m_(m) {}
+
+  void stats_null() {}
+  template<typename CB> void stats_null(CB &&cb) { cb(); }
+  rpc_stats stats_get() { return m_.snapshot(); }
+  template<typename CB> void stats_get(CB &&cb) { cb(m_.snapshot()); }
+};
+
+} // namespace xdr
+
+#endif // !_XDRPP_METRICS_H_HEADER_INCLUDED_
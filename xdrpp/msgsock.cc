@@ -14,7 +14,28 @@ namespace xdr {
 
 msg_sock::~msg_sock()
 {
-  ps_.fd_cb(s_, pollset::ReadWrite);
+  if (ring_) {
+    ps_.timeout_cancel(rdefer_);
+    if (rop_) {
+      ring_->cancel(rop_);
+      if (rdmsg_)
+	ring_->keep(rop_, std::move(rdmsg_));
+      if (rbuf_)
+	ring_->keep(rop_, std::move(rbuf_));
+      if (rslab_) {
+	ring_->keep(rop_, rslab_);
+	rslab_ = io_slab{};
+      }
+    }
+    ring_->slab_put(rslab_);
+    if (wop_) {
+      ring_->cancel(wop_);
+      for (msg_ptr &m : wqueue_)
+	ring_->keep(wop_, std::move(m));
+    }
+  }
+  else
+    ps_.fd_cb(s_, pollset::ReadWrite);
   close(s_);
   *destroyed_ = true;
 }
@@ -29,17 +50,49 @@ msg_sock::init()
 void
 msg_sock::initcb()
 {
-  if (rcb_)
+  if (ring_) {
+    // Don't call rcb_ from within setrcb; deliver anything received
+    // while there was no callback from the pollset instead.
+    if (rready() && !rdefer_ && (rend_ > rbeg_ || rdmsg_ || rerrno_ >= 0))
+      rdefer_ = ps_.timeout(0, [this]() {
+	  rdefer_ = pollset::timeout_null();
+	  uring_deliver();
+	});
+    else
+      uring_input();
+  }
+  else if (rready())
     ps_.fd_cb(s_, pollset::Read, [this](){ input(); });
   else
     ps_.fd_cb(s_, pollset::Read);
 }
 
+void
+msg_sock::pause_read()
+{
+  if (!rpaused_) {
+    rpaused_ = true;
+    if (!ring_)
+      ps_.fd_cb(s_, pollset::Read);
+    // With io_uring, a read already submitted completes into the
+    // read-ahead buffer, and uring_deliver holds the messages.
+  }
+}
+
+void
+msg_sock::resume_read()
+{
+  if (rpaused_) {
+    rpaused_ = false;
+    initcb();
+  }
+}
+
 void
 msg_sock::input()
 {
   std::shared_ptr<bool> destroyed{destroyed_};
-  for (int i = 0; i < 3 && !*destroyed; i++) {
+  for (int i = 0; i < 3 && !*destroyed && !rpaused_; i++) {
     if (rdmsg_) {
       iovec iov[2];
       iov[0].iov_base = rdmsg_->data() + rdpos_;
@@ -61,7 +114,7 @@ msg_sock::input()
       if (rdpos_ >= rdmsg_->size()) {
 	rdpos_ -= rdmsg_->size();
 	rcb_(std::move(rdmsg_));
-	if (*destroyed)
+	if (*destroyed || rpaused_)
 	  return;
       }
     }
@@ -129,7 +182,9 @@ msg_sock::putmsg(msg_ptr &mb)
   bool was_empty = !wsize_;
   wsize_ += mb->raw_size();
   wqueue_.emplace_back(mb.release());
-  if (was_empty)
+  if (ring_)
+    uring_output();
+  else if (was_empty)
     output(false);
 }
 
@@ -154,12 +209,10 @@ msg_sock::pop_wbytes(size_t n)
   wstart_ = n;
 }
 
-void
-msg_sock::output(bool cbset)
+size_t
+msg_sock::wiov(iovec *v, size_t maxiov) const
 {
-  static constexpr size_t maxiov = 8;
   size_t i = 0;
-  iovec v[maxiov];
   for (auto b = wqueue_.begin(); i < maxiov && b != wqueue_.end(); ++b, ++i) {
     if (i) {
       v[i].iov_len = (*b)->raw_size();
@@ -170,16 +223,22 @@ msg_sock::output(bool cbset)
       v[i].iov_base = const_cast<char *> ((*b)->raw_data()) + wstart_;
     }
   }
-  ssize_t n = writev(s_, v, i);
-  if (n <= 0) {
-    if (n != -1 || !eagain(errno)) {
-      wfail_ = true;
-      wsize_ = wstart_ = 0;
-      wqueue_.clear();
-    }
-    return;
+  return i;
+}
+
+void
+msg_sock::output(bool cbset)
+{
+  static constexpr size_t maxiov = 8;
+  iovec v[maxiov];
+  ssize_t n = writev(s_, v, wiov(v, maxiov));
+  if (n > 0)
+    pop_wbytes(n);
+  else if (n != -1 || !eagain(errno)) {
+    wfail_ = true;
+    wsize_ = wstart_ = 0;
+    wqueue_.clear();
   }
-  pop_wbytes(n);
 
   if (wsize_ && !cbset)
     ps_.fd_cb(s_, pollset::Write, [this](){ output(true); });
@@ -188,47 +247,264 @@ msg_sock::output(bool cbset)
 }
 
 void
-rpc_sock::abort_all_calls()
+msg_sock::uring_input()
+{
+  if (rop_ || !rready() || rfail_ || rdefer_)
+    return;
+  auto cb = [this](int res, bool) { uring_read_done(res); };
+  iovec iov;
+  if (rdmsg_) {
+    // Message too big for the read-ahead buffer; read it directly
+    iov.iov_base = rdmsg_->data() + rdpos_;
+    iov.iov_len = rdmsg_->size() - rdpos_;
+    rop_ = ring_->readv(s_, &iov, 1, cb);
+    return;
+  }
+
+  if (!rslab_ && !rbuf_ && !(rslab_ = ring_->slab_get()))
+    rbuf_ = message_t::alloc(io_ring::default_slab_size);
+  char *base = rbase();
+  if (rbeg_) {
+    std::memmove(base, base + rbeg_, rend_ - rbeg_);
+    rend_ -= rbeg_;
+    rbeg_ = 0;
+  }
+  if (rslab_)
+    rop_ = ring_->read_fixed(s_, rslab_, rend_, rcap() - rend_, cb);
+  else {
+    iov.iov_base = base + rend_;
+    iov.iov_len = rcap() - rend_;
+    rop_ = ring_->readv(s_, &iov, 1, cb);
+  }
+}
+
+void
+msg_sock::uring_read_done(int res)
+{
+  rop_ = nullptr;
+  if (res > 0) {
+    if (rdmsg_)
+      rdpos_ += res;
+    else
+      rend_ += res;
+  }
+  else if (res == 0) {
+    rfail_ = true;
+    rerrno_ = rdmsg_ || rend_ > rbeg_ ? ECONNRESET : 0;
+  }
+  else if (!eagain(-res)) {
+    rfail_ = true;
+    errno = rerrno_ = -res;
+    std::cerr << "msg_sock::input: " << sock_errmsg() << std::endl;
+  }
+  uring_deliver();
+}
+
+void
+msg_sock::uring_deliver()
+{
+  std::shared_ptr<bool> destroyed{destroyed_};
+  if (rready() && rdmsg_ && rdpos_ == rdmsg_->size()) {
+    rdpos_ = 0;
+    rcb_(std::move(rdmsg_));
+    if (*destroyed)
+      return;
+  }
+
+  while (rready() && !rdmsg_ && rend_ - rbeg_ >= sizeof nextlen_) {
+    char *p = rbase() + rbeg_;
+    std::memcpy(&nextlen_, p, sizeof nextlen_);
+    p += sizeof nextlen_;
+    size_t avail = rend_ - rbeg_ - sizeof nextlen_;
+    size_t len = nextlen();
+    if (!(len & 0x80000000)) {
+      std::cerr << "msgsock: message fragments unimplemented" << std::endl;
+      rfail_ = true;
+      rerrno_ = ECONNRESET;
+      break;
+    }
+    len &= 0x7fffffff;
+    if (len > avail && len + sizeof nextlen_ <= rcap())
+      break;			// Rest will fit in read-ahead buffer
+
+    if (len > maxmsglen_) {
+      std::cerr << "msg_sock: rejecting " << len << "-byte message (too long)"
+		<< std::endl;
+      rfail_ = true;
+      rerrno_ = E2BIG;
+      break;
+    }
+    msg_ptr m;
+    // Length comes from untrusted source; don't crash if can't alloc
+    try { m = message_t::alloc(len); }
+    catch (const std::bad_alloc &) {
+      std::cerr << "msg_sock: allocation of " << len << "-byte message failed"
+		<< std::endl;
+      rfail_ = true;
+      rerrno_ = E2BIG;
+      break;
+    }
+
+    if (len > avail) {
+      std::memcpy(m->data(), p, avail);
+      rdpos_ = avail;
+      rdmsg_ = std::move(m);
+      rbeg_ = rend_ = 0;
+      // Let other sockets use the registered buffer in the meantime
+      ring_->slab_put(rslab_);
+      break;
+    }
+    std::memcpy(m->data(), p, len);
+    rbeg_ += sizeof nextlen_ + len;
+    rcb_(std::move(m));
+    if (*destroyed)
+      return;
+  }
+  if (rbeg_ == rend_)
+    rbeg_ = rend_ = 0;
+
+  if (!rfail_)
+    uring_input();
+  else if (rready() && rerrno_ >= 0) {
+    errno = rerrno_;
+    rerrno_ = -1;
+    rcb_(nullptr);
+  }
+}
+
+void
+msg_sock::uring_output()
 {
-  decltype(calls_) calls(std::move(calls_));
-  calls_.clear();
-  for (auto &call : calls)
-    try { call.second(nullptr); }
+  if (wop_ || wqueue_.empty())
+    return;
+  iovec v[io_ring::max_iov];
+  wop_ = ring_->writev(s_, v, wiov(v, io_ring::max_iov),
+		       [this](int res, bool) { uring_write_done(res); });
+}
+
+void
+msg_sock::uring_write_done(int res)
+{
+  wop_ = nullptr;
+  if (res > 0)
+    pop_wbytes(res);
+  else if (res == 0 || !eagain(-res)) {
+    wfail_ = true;
+    wsize_ = wstart_ = 0;
+    wqueue_.clear();
+    return;
+  }
+  uring_output();
+}
+
+constexpr std::size_t rpc_sock::initial_slots;
+
+void
+rpc_sock::grow()
+{
+  std::vector<call> calls(2 * calls_.size());
+  std::size_t mask = calls.size() - 1;
+  // Each call moves to slot i or i + calls_.size(), so none collide
+  for (call &c : calls_)
+    if (c.cb_)
+      calls[c.xid_ & mask] = std::move(c);
+  calls_.swap(calls);
+}
+
+void
+rpc_sock::abort_all_calls(int err)
+{
+  if (!ncalls_)
+    return;
+  std::vector<call_cb_t> cbs;
+  cbs.reserve(ncalls_);
+  for (call &c : calls_)
+    if (c.cb_) {
+      ps_.timeout_cancel(c.timeout_);
+      cbs.push_back(std::move(c.cb_));
+      c.cb_ = nullptr;
+    }
+  ncalls_ = 0;
+  for (auto &cb : cbs)
+    try {
+      cb(nullptr, err);
+    }
     catch (const std::exception &e) {
       std::cerr << e.what() << std::endl;
     }
 }
 
+void
+rpc_sock::call_timeout(uint32_t xid)
+{
+  call *c = find_call(xid);
+  assert(c);
+  c->timeout_ = pollset::timeout_null();
+  auto cb (std::move(c->cb_));
+  c->cb_ = nullptr;
+  --ncalls_;
+  cb(nullptr, ETIMEDOUT);
+}
+
 void
 rpc_sock::recv_msg(msg_ptr b)
 {
   if (!b || b->size() < 8) {
-    abort_all_calls();
+    int err = b ? EBADMSG : errno;
+    abort_all_calls(err);
+    errno = err;
     recv_call(nullptr);
   }
   else if (b->word(1) == swap32le(CALL))
     recv_call(std::move(b));
   else if (b->word(1) == swap32le(REPLY)) {
-    auto calli = calls_.find(b->word(0));
-    if (calli == calls_.end()) {
-      std::cerr << "ignoring reply to unknown call" << std::endl;
+    call *c = find_call(swap32le(b->word(0)));
+    if (!c) {
+      // Normal after a call times out or is cancelled
+      ++unknown_replies_;
       return;
     }
-    auto cb (std::move(calli->second));
-    calls_.erase(calli);
-    cb(std::move(b));
+    ps_.timeout_cancel(c->timeout_);
+    auto cb (std::move(c->cb_));
+    c->cb_ = nullptr;
+    --ncalls_;
+    cb(std::move(b), 0);
   }
   else {
-    abort_all_calls();
+    abort_all_calls(EBADMSG);
     recv_call(nullptr);
   }
 }
 
-void
-rpc_sock::send_call(msg_ptr &b, msg_sock::rcb_t cb)
+rpc_sock::call_handle
+rpc_sock::send_call(msg_ptr &b, call_cb_t cb, std::int64_t timeout_ms)
 {
-  calls_.emplace(b->word(0), std::move(cb));
+  assert(cb);
+  if (2 * (ncalls_ + 1) > calls_.size())
+    grow();
+  uint32_t xid = swap32le(b->word(0));
+  call &c = calls_[xid & (calls_.size() - 1)];
+  assert(!c.cb_);		// xid must come from get_xid
+  c.xid_ = xid;
+  c.cb_ = std::move(cb);
+  if (timeout_ms >= 0)
+    c.timeout_ = ps_.timeout(timeout_ms,
+			     std::bind(&rpc_sock::call_timeout, this, xid));
+  ++ncalls_;
   ms_->putmsg(b);
+  return call_handle(this, xid);
+}
+
+bool
+rpc_sock::cancel_call(uint32_t xid)
+{
+  call *c = find_call(xid);
+  if (!c)
+    return false;
+  ps_.timeout_cancel(c->timeout_);
+  c->cb_ = nullptr;
+  --ncalls_;
+  return true;
 }
 
 void
@@ -236,7 +512,7 @@ rpc_sock::recv_call(msg_ptr b)
 {
   if (servcb_)
     servcb_(std::move(b));
-  else {
+  else if (b) {
     std::cerr << "rpc_sock::recv_call: incoming call but no server"
 	      << std::endl;
     send_reply(rpc_accepted_error_msg(b->word(0), PROG_UNAVAIL));
@@ -6,9 +6,12 @@
 #ifndef _XDRPP_MSGSOCK_H_INCLUDED_
 #define _XDRPP_MSGSOCK_H_INCLUDED_ 1
 
+#include <cerrno>
 #include <deque>
+#include <vector>
 #include <xdrpp/message.h>
 #include <xdrpp/pollset.h>
+#include <xdrpp/uring.h>
 
 namespace xdr {
 
@@ -24,14 +27,20 @@ namespace xdr {
 //! message body (possibly including the next message length).  This
 //! could be fixed to read at least a little bit more data
 //! speculatively and reduce the number of system calls.
+//!
+//! When the pollset uses pollset::engine::Uring, the socket instead
+//! reads ahead into a buffer registered with the kernel, from which
+//! it parses as many messages as have arrived, and keeps one \c
+//! writev of queued messages in flight.
 class msg_sock {
 public:
   static constexpr std::size_t default_maxmsglen = 0x100000;
-  using rcb_t = std::function<void(msg_ptr)>;
+  using rcb_t = unique_function<void(msg_ptr)>;
 
   template<typename T> msg_sock(pollset &ps, sock_t s, T &&rcb,
 				size_t maxmsglen = default_maxmsglen)
-    : ps_(ps), s_(s), maxmsglen_(maxmsglen), rcb_(std::forward<T>(rcb)) {
+    : ps_(ps), s_(s), maxmsglen_(maxmsglen), ring_(ps.ring()),
+      rcb_(std::forward<T>(rcb)) {
     init();
   }
   msg_sock(pollset &ps, sock_t s) : msg_sock(ps, s, nullptr) {}
@@ -43,6 +52,14 @@ public:
     initcb();
   }
 
+  //! Stop reading messages (e.g., because too many are already being
+  //! processed) until msg_sock::resume_read is called.  Messages
+  //! already read but not yet delivered are held until then.  May be
+  //! called from within the read callback.
+  void pause_read();
+  void resume_read();
+  bool read_paused() const { return rpaused_; }
+
   size_t wsize() const { return wsize_; }
   void putmsg(msg_ptr &b);
   void putmsg(msg_ptr &&b) { putmsg(b); }
@@ -58,9 +75,11 @@ private:
   pollset &ps_;
   const sock_t s_;
   const size_t maxmsglen_;
+  io_ring *const ring_;
   std::shared_ptr<bool> destroyed_{std::make_shared<bool>(false)};
 
   rcb_t rcb_;
+  bool rpaused_ {false};
   uint32_t nextlen_;
   msg_ptr rdmsg_;
   size_t rdpos_ {0};
@@ -70,17 +89,40 @@ private:
   size_t wstart_ {0};
   bool wfail_ {false};
 
+  // io_uring state.  Bytes [rbeg_, rend_) of the read-ahead buffer
+  // (rslab_, or rbuf_ if no registered buffer was free) have been
+  // received but not yet delivered.
+  io_op *rop_ {nullptr};
+  io_op *wop_ {nullptr};
+  io_slab rslab_;
+  msg_ptr rbuf_;
+  size_t rbeg_ {0};
+  size_t rend_ {0};
+  bool rfail_ {false};
+  int rerrno_ {-1};		// Error not yet passed to rcb_
+  pollset::Timeout rdefer_ {pollset::timeout_null()};
+
   static constexpr bool eagain(int err) {
     return err == EAGAIN || err == EWOULDBLOCK || err == EINTR;
   }
   char *nextlenp() { return reinterpret_cast<char *>(&nextlen_); }
   uint32_t nextlen() const { return swap32le(nextlen_); }
 
+  bool rready() const { return rcb_ && !rpaused_; }
   void init();
   void initcb();
   void input();
   void pop_wbytes(size_t n);
+  size_t wiov(iovec *v, size_t maxiov) const;
   void output(bool cbset);
+
+  char *rbase() { return rslab_ ? rslab_.data_ : rbuf_->data(); }
+  size_t rcap() const { return rslab_ ? rslab_.size_ : rbuf_->size(); }
+  void uring_input();
+  void uring_read_done(int res);
+  void uring_deliver();
+  void uring_output();
+  void uring_write_done(int res);
 };
 
 //! A wrapper around xdr::msg_sock that separates calls from replies.
@@ -89,11 +131,54 @@ private:
 //! callbacks set with rpc_sock::send_call.  Calls sent via \c
 //! rpc_sock::send_call should already have a unique xid generated by
 //! \c rpc_sock::get_xid().
+//!
+//! A reply callback is invoked exactly once, either with the reply
+//! and 0, or with \c nullptr and an \c errno value giving the reason
+//! the call failed:  \c ETIMEDOUT if its deadline passed, \c
+//! ECANCELED if the rpc_sock was destroyed, or the error that closed
+//! the connection.  The exception is a call cancelled with
+//! rpc_sock::cancel_call, whose callback is never invoked.
 class rpc_sock {
+public:
+  //! Callback for the reply to a call (see above).
+  using call_cb_t = unique_function<void(msg_ptr, int)>;
+
+private:
+  // Adapts a callback taking only the reply, setting errno on failure
+  struct errno_cb {
+    msg_sock::rcb_t cb_;
+    void operator()(msg_ptr m, int err) const {
+      if (!m)
+	errno = err;
+      cb_(std::move(m));
+    }
+  };
+
+  struct call {
+    uint32_t xid_;
+    call_cb_t cb_;		// Null if the slot is free
+    pollset::Timeout timeout_;
+  };
+
+  pollset &ps_;
   uint32_t xid_{0};
-  std::unordered_map<uint32_t, msg_sock::rcb_t> calls_;
+  // Calls awaiting replies, in a table of slots indexed by the low
+  // bits of the (host byte order) xid.  Since xids are allocated
+  // sequentially, the high bits act as a generation number, and
+  // comparing the whole xid rejects replies to old calls.  The table
+  // doubles when more than half full, so get_xid rarely has to skip
+  // an xid whose slot is taken.
+  std::vector<call> calls_;
+  std::size_t ncalls_{0};
+  std::uint64_t unknown_replies_{0};
 
-  void abort_all_calls();
+  call *find_call(uint32_t xid) {
+    call &c = calls_[xid & (calls_.size() - 1)];
+    return c.cb_ && c.xid_ == xid ? &c : nullptr;
+  }
+  void grow();
+  void abort_all_calls(int err);
+  void call_timeout(uint32_t xid);
   void recv_msg(msg_ptr b);
   void recv_call(msg_ptr);
 public:
@@ -101,35 +186,86 @@ public:
   using rcb_t = msg_sock::rcb_t;
   rcb_t servcb_;
 
+  //! Identifies a call sent with rpc_sock::send_call so that it can
+  //! be cancelled.  Remains safe to use after the call completes or
+  //! the rpc_sock is destroyed, in which case cancelling does nothing.
+  class call_handle {
+    rpc_sock *s_ {nullptr};
+    std::shared_ptr<const bool> destroyed_;
+    uint32_t xid_ {0};
+  public:
+    call_handle() = default;
+    call_handle(rpc_sock *s, uint32_t xid)
+      : s_(s), destroyed_(s->ms_->destroyed_ptr()), xid_(xid) {}
+    //! Forget the call without invoking its callback (a reply that
+    //! arrives later is ignored).  Returns \c false if the call had
+    //! already completed.
+    bool cancel() { return s_ && !*destroyed_ && s_->cancel_call(xid_); }
+    uint32_t xid() const { return xid_; }
+    explicit operator bool() const { return s_; }
+  };
+
   template<typename T>
   rpc_sock(pollset &ps, sock_t s, T &&t,
 	   size_t maxmsglen = msg_sock::default_maxmsglen)
-    : ms_(new msg_sock(ps, s,
+    : ps_(ps), calls_(initial_slots),
+      ms_(new msg_sock(ps, s,
 		       std::bind(&rpc_sock::recv_msg, this,
 				 std::placeholders::_1),
 		       maxmsglen)),
       servcb_(std::forward<T>(t)) {}
   rpc_sock(pollset &ps, sock_t s) : rpc_sock(ps, s, rcb_t(nullptr)) {}
-  ~rpc_sock() { abort_all_calls(); }
+  ~rpc_sock() { abort_all_calls(ECANCELED); }
   template<typename T> void set_servcb(T &&scb) {
     servcb_ = std::forward<T>(scb);
   }
 
+  //! Initial size of the table of outstanding calls.
+  static constexpr std::size_t initial_slots = 16;
+
+  //! Return an xid not used by any call awaiting a reply.
   uint32_t get_xid() {
-    while (calls_.find(++xid_) != calls_.end() && xid_ != 0)
+    std::size_t mask = calls_.size() - 1;
+    while (calls_[++xid_ & mask].cb_ || xid_ == 0)
       ;
     return xid_;
   }
 
-  void send_call(msg_ptr &b, rcb_t cb);
-  void send_call(msg_ptr &&b, rcb_t cb) { send_call(b, cb); }
+  //! Number of calls sent that are still awaiting replies.
+  std::size_t calls_pending() const { return ncalls_; }
+  //! Number of replies received that matched no call awaiting a
+  //! reply, such as late replies to calls that timed out or were
+  //! cancelled.  These are dropped.
+  std::uint64_t unknown_replies() const { return unknown_replies_; }
+
+  //! Send a call and arrange for \c cb to receive the reply.  If \c
+  //! timeout_ms is non-negative and no reply arrives within that many
+  //! milliseconds, \c cb is invoked with \c nullptr and \c
+  //! ETIMEDOUT.
+  call_handle send_call(msg_ptr &b, call_cb_t cb,
+			std::int64_t timeout_ms = -1);
+  call_handle send_call(msg_ptr &&b, call_cb_t cb,
+			std::int64_t timeout_ms = -1) {
+    return send_call(b, std::move(cb), timeout_ms);
+  }
+  //! Send a call with a callback that takes only the reply, and finds
+  //! the reason for a failure in \c errno.
+  call_handle send_call(msg_ptr &b, rcb_t cb, std::int64_t timeout_ms = -1) {
+    return send_call(b, call_cb_t(errno_cb{std::move(cb)}), timeout_ms);
+  }
+  call_handle send_call(msg_ptr &&b, rcb_t cb, std::int64_t timeout_ms = -1) {
+    return send_call(b, std::move(cb), timeout_ms);
+  }
+  //! Forget about the call with transaction ID \c xid, without
+  //! invoking its callback.  Returns \c false if there is no such
+  //! call awaiting a reply.
+  bool cancel_call(uint32_t xid);
   void send_reply(msg_ptr &&b) { ms_->putmsg(std::move(b)); }
 };
 
-//! Functor wrapper around \c rpc_sock::send_reply.  Mostly useful
-//! because std::function implementations avoid memory allocation with
-//! \c operator(), whereas passing any other method to \c std::bind
-//! may require more overhead.
+//! Functor wrapper around \c rpc_sock::send_reply.  Smaller than the
+//! equivalent \c std::bind, so it always fits in the inline storage
+//! of an xdr::unique_function.
 struct rpc_sock_reply_t {
   rpc_sock *ms_;
   constexpr rpc_sock_reply_t(rpc_sock *ms) : ms_(ms) {}
@@ -1,29 +1,36 @@
 
+#include <xdrpp/config.h>
 #include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <chrono>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <limits>
 #include <system_error>
 #include <signal.h>
 #include <unistd.h>
+#if HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif // HAVE_SYS_EVENTFD_H
 #include <xdrpp/pollset.h>
+#include <xdrpp/uring.h>
 
 namespace xdr {
 
 std::mutex pollset_plus::signal_owners_lock;
 pollset_plus *pollset_plus::signal_owners[num_sig];
 volatile std::sig_atomic_t pollset_plus::signal_flags[num_sig];
+pollset_plus::inject_node pollset_plus::inject_unlinked_;
+thread_local pollset_plus::inject_stash pollset_plus::inject_stash_;
 
 pollset::Timeout
 pollset::timeout_null()
 {
-  static decltype(pollset::time_cbs_) dummy_time_cbs_;
-  return Timeout{dummy_time_cbs_.end()};
+  return Timeout{};
 }
-const pollset::Timeout pollset::Timeout::null_(pollset::timeout_null());
+const pollset::Timeout pollset::Timeout::null_;
 
 void
 pollset_plus::signal_handler(int sig)
@@ -43,14 +50,60 @@ pollset_plus::signal_handler(int sig)
   signal_flags[sig] = 2;
 }
 
-pollset_plus::pollset_plus()
+pollset::pollset(engine e)
+  : wheel_now_(now_us())
 {
-  create_selfpipe(selfpipe_);
-  set_close_on_exec(selfpipe_[0]);
-  set_close_on_exec(selfpipe_[1]);
-  set_nonblock(selfpipe_[0]);
-  set_nonblock(selfpipe_[1]);
-  this->fd_cb(selfpipe_[0], Read, [this](){ this->run_pending_asyncs(); });
+  for (auto &level : wheel_)
+    for (tlink &slot : level)
+      slot.init();
+  expired_.init();
+  if (e == engine::Uring)
+    ring_ = io_ring::create();
+}
+
+pollset::~pollset()
+{
+  auto free_list = [](tlink &head) {
+    while (!head.empty()) {
+      timer *t = static_cast<timer *>(head.next_);
+      t->unlink();
+      delete t;
+    }
+  };
+  for (auto &level : wheel_)
+    for (tlink &slot : level)
+      free_list(slot);
+  free_list(expired_);
+  for (timer *t : free_timers_)
+    delete t;
+}
+
+pollset::engine
+pollset::default_engine()
+{
+  static const engine e = []() {
+    const char *p = std::getenv("XDR_POLLSET_ENGINE");
+    return p && !std::strcmp(p, "uring") ? engine::Uring : engine::Poll;
+  }();
+  return e;
+}
+
+pollset_plus::pollset_plus(engine e)
+  : pollset(e)
+{
+#if HAVE_SYS_EVENTFD_H
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd == -1)
+    throw std::system_error(errno, std::system_category(), "eventfd");
+  wakefd_[0] = wakefd_[1] = sock_t(fd);
+#else // !HAVE_SYS_EVENTFD_H
+  create_selfpipe(wakefd_);
+  set_close_on_exec(wakefd_[0]);
+  set_close_on_exec(wakefd_[1]);
+  set_nonblock(wakefd_[0]);
+  set_nonblock(wakefd_[1]);
+#endif // !HAVE_SYS_EVENTFD_H
+  this->fd_cb(wakefd_[0], Read, [this](){ this->run_pending_asyncs(); });
 }
 
 pollset_plus::~pollset_plus()
@@ -61,9 +114,28 @@ pollset_plus::~pollset_plus()
       erase_signal_cb(signal_cbs_.begin()->first);
   }
 
-  fd_cb(selfpipe_[0], Read);
-  close(selfpipe_[0]);
-  close(selfpipe_[1]);
+  fd_cb(wakefd_[0], Read);
+  close(wakefd_[0]);
+  if (wakefd_[1] != wakefd_[0])
+    close(wakefd_[1]);
+
+  // Callbacks that never got to run
+  inject_node *n = inject_head_.exchange(nullptr);
+  while (n) {
+    inject_node *next = n->next_.load();
+    delete n;
+    n = next;
+  }
+  while ((n = inject_run_)) {
+    inject_run_ = n->next_.load(std::memory_order_relaxed);
+    delete n;
+  }
+  n = inject_free_.exchange(nullptr, std::memory_order_acquire);
+  while (n) {
+    inject_node *next = n->next_.load(std::memory_order_relaxed);
+    delete n;
+    n = next;
+  }
 }
 
 pollset::fd_state::~fd_state()
@@ -75,72 +147,172 @@ pollset::fd_state::~fd_state()
 void
 pollset_plus::wake(wake_type wt)
 {
+  if (wt == wake_type::Signal)
+    signal_wake_.store(true);
+#if HAVE_SYS_EVENTFD_H
+  std::uint64_t one = 1;
+  write(wakefd_[1], &one, sizeof one);
+#else // !HAVE_SYS_EVENTFD_H
   static_assert(sizeof wt == 1, "uint8_t enum has wrong size");
-  write(selfpipe_[1], &wt, 1);
+  write(wakefd_[1], &wt, 1);
+#endif // !HAVE_SYS_EVENTFD_H
+}
+
+pollset_plus::inject_stash::~inject_stash()
+{
+  while (inject_node *n = head_) {
+    head_ = n->next_.load(std::memory_order_relaxed);
+    delete n;
+  }
+}
+
+pollset_plus::inject_node *
+pollset_plus::inject_node_get()
+{
+  inject_node *n = inject_stash_.head_;
+  if (!n && !(n = inject_free_.exchange(nullptr, std::memory_order_acquire)))
+    return new inject_node;
+  inject_stash_.head_ = n->next_.load(std::memory_order_relaxed);
+  return n;
 }
 
 void
-pollset_plus::run_pending_asyncs()
+pollset_plus::inject_node_free(inject_node *head, inject_node *tail)
 {
-  std::vector<cb_t> cbs;
-  std::vector<cb_t>::iterator i;
+  inject_node *old = inject_free_.load(std::memory_order_relaxed);
+  do {
+    tail->next_.store(old, std::memory_order_relaxed);
+  } while (!inject_free_.compare_exchange_weak(old, head,
+					       std::memory_order_release,
+					       std::memory_order_relaxed));
+}
 
+void
+pollset_plus::inject_node_push(inject_node *n)
+{
+  n->next_.store(&inject_unlinked_, std::memory_order_relaxed);
+  inject_node *prev = inject_head_.exchange(n, std::memory_order_acq_rel);
+  n->next_.store(prev, std::memory_order_release);
+  if (!prev)
+    wake();
+}
+
+void
+pollset_plus::run_pending_asyncs()
+{
   // Catching and re-throwing exceptions ruins the stack trace from
   // uncaught exceptions, which hurts debugability, particularly in a
   // core routine that calls a bunch of callbacks.  Hence, we abuse
   // RAII where catch would be more approriate.
   struct cleanup {
-    bool active;
-    cb_t action;
-    ~cleanup() { if (active) action(); }
-  } c { false, [&](){inject_cb_vec(i+1, cbs.end());} };
-
+    pollset_plus *ps;
+    ~cleanup() { if (ps->inject_run_) ps->wake(); }
+  } c { this };
+
+  // Drain the wakeup fd before emptying the queue, so that a
+  // callback injected after the exchange below is sure to wake us
+  // again.
+#if HAVE_SYS_EVENTFD_H
+  std::uint64_t count;
+  read(wakefd_[0], &count, sizeof count);
+#else // !HAVE_SYS_EVENTFD_H
   {
-    wake_type buf[128];
-    int n;
-    while ((n = read(selfpipe_[0], buf, sizeof buf)) > 0)
-      for (int i = 0; i < n && !signal_pending_; i++)
-	if (buf[i] == wake_type::Signal)
-	  signal_pending_ = true;
+    char buf[128];
+    while (read(wakefd_[0], buf, sizeof buf) > 0)
+      ;
   }
-  {
-    std::lock_guard<std::mutex> lk {async_cbs_lock_};
-    async_pending_ = false;
-    swap(cbs, async_cbs_);
+#endif // !HAVE_SYS_EVENTFD_H
+  if (signal_wake_.exchange(false))
+    signal_pending_ = true;
+
+  // The queue runs newest to oldest; reverse it onto the end of
+  // inject_run_.
+  inject_node *batch = nullptr;
+  inject_node *n = inject_head_.exchange(nullptr, std::memory_order_acquire);
+  while (n) {
+    inject_node *next;
+    // A producer has swapped in n but not yet linked it to next
+    while ((next = n->next_.load(std::memory_order_acquire))
+	   == &inject_unlinked_)
+      std::this_thread::yield();
+    n->next_.store(batch, std::memory_order_relaxed);
+    batch = n;
+    n = next;
+  }
+  if (!(n = inject_run_))
+    inject_run_ = batch;
+  else {
+    while (inject_node *next = n->next_.load(std::memory_order_relaxed))
+      n = next;
+    n->next_.store(batch, std::memory_order_relaxed);
+  }
+
+  // Spent nodes go back on the free list, even if a callback throws
+  struct recycle {
+    pollset_plus *ps;
+    inject_node *head, *tail;
+    ~recycle() { if (head) ps->inject_node_free(head, tail); }
+  } r { this, nullptr, nullptr };
+
+  while ((n = inject_run_)) {
+    inject_run_ = n->next_.load(std::memory_order_relaxed);
+    cb_t cb {std::move(n->cb_)};
+    n->next_.store(r.head, std::memory_order_relaxed);
+    if (!r.head)
+      r.tail = n;
+    r.head = n;
+    cb();
   }
+}
 
-  for (i = cbs.begin(), c.active = true; i != cbs.end(); i++)
-    (*i)();
-  c.active = false;
+pollset::fd_state &
+pollset::fd_get(sock_t s)
+{
+  assert(s.fd_ >= 0);
+  std::size_t c = std::size_t(s.fd_) / fd_chunk;
+  while (c >= fd_chunks_.size())
+    fd_chunks_.emplace_back(new fd_state[fd_chunk]);
+  return fd_chunks_[c][s.fd_ % fd_chunk];
 }
 
+// Remove a file descriptor from pollfds_.
 void
-pollset_plus::inject_cb_vec(std::vector<cb_t>::iterator b,
-			    std::vector<cb_t>::iterator e)
-{
-  if (b != e) {
-    std::lock_guard<std::mutex> lk {async_cbs_lock_};
-    std::move(b, e, async_cbs_.end());
-    if (!async_pending_) {
-      async_pending_ = true;
-      wake();
-    }
+pollset::fd_remove(fd_state &fs)
+{
+  int i = fs.idx;
+  fs.idx = -1;
+  if (std::size_t(i) + 1 < pollfds_.size()) {
+    pollfds_[i] = pollfds_.back();
+    fd_find(sock_t(pollfds_[i].fd))->idx = i; // XXX
+  }
+  pollfds_.pop_back();
+}
+
+// Called when a file descriptor no longer has any events of interest.
+void
+pollset::fd_idle(fd_state &fs)
+{
+  if (!dispatching_)
+    fd_remove(fs);
+  else if (!fs.idle) {
+    fs.idle = true;
+    idle_.push_back(&fs);
   }
 }
 
 pollset::cb_t &
 pollset::fd_cb_helper(sock_t s, op_t op)
 {
-  fd_state &fs = state_[s];
+  fd_state &fs = fd_get(s);
   pollfd *pfdp;
   if (fs.idx < 0) {
     fs.idx = pollfds_.size();
-    pollfds_.resize(fs.idx + 1);
+    pollfds_.emplace_back();
     pfdp = &pollfds_.back();
     pfdp->fd = s.fd_;		// XXX
   }
   else {
-    pfdp = &pollfds_.at(fs.idx);
+    pfdp = &pollfds_[fs.idx];
     assert (pfdp->fd == s.fd_);	// XXX
   }
   if (op & kReadFlag) {
@@ -151,11 +323,15 @@ pollset::fd_cb_helper(sock_t s, op_t op)
     }
     fs.roneshot = op & kOnceFlag;
     pfdp->events |= POLLIN;
+    if (ring_)
+      uring_arm(s, fs);
     return fs.rcb;
   }
   else if (op & kWriteFlag) {
     fs.woneshot = op & kOnceFlag;
     pfdp->events |= POLLOUT;
+    if (ring_)
+      uring_arm(s, fs);
     return fs.wcb;
   }
   else {
@@ -169,25 +345,93 @@ pollset::fd_cb_helper(sock_t s, op_t op)
 void
 pollset::fd_cb(sock_t s, op_t op, std::nullptr_t)
 {
-  auto fi = state_.find(s);
-  if (fi == state_.end())
+  fd_state *fs = fd_find(s);
+  if (!fs || fs->idx < 0)
     return;
-  pollfd &pfd = pollfds_.at(fi->second.idx);
+  pollfd &pfd = pollfds_[fs->idx];
   
   if (op & kReadFlag) {
     pfd.events &= ~POLLIN;
-    fi->second.rcb = nullptr;
+    fs->rcb = nullptr;
   }
   if (op & kWriteFlag) {
     pfd.events &= ~POLLOUT;
-    fi->second.wcb = nullptr;
+    fs->wcb = nullptr;
+  }
+  if (!pfd.events)
+    fd_idle(*fs);
+  if (ring_)
+    uring_arm(s, *fs);
+}
+
+// Make the outstanding io_uring polls on a file descriptor match
+// the events of interest.
+void
+pollset::uring_arm(sock_t s, fd_state &fs)
+{
+  short events = fs.idx < 0 ? 0 : pollfds_[fs.idx].events;
+  if (!(events & POLLIN) != !fs.rop) {
+    if (fs.rop) {
+      ring_->cancel(fs.rop);
+      fs.rop = nullptr;
+    }
+    else
+      fs.rop = ring_->poll_add(s, POLLIN, [this,s](int res, bool) {
+	  uring_ready(s, false, res);
+	});
+  }
+  if (!(events & POLLOUT) != !fs.wop) {
+    if (fs.wop) {
+      ring_->cancel(fs.wop);
+      fs.wop = nullptr;
+    }
+    else
+      fs.wop = ring_->poll_add(s, POLLOUT, [this,s](int res, bool) {
+	  uring_ready(s, true, res);
+	});
+  }
+}
+
+void
+pollset::uring_ready(sock_t s, bool write, int res)
+{
+  fd_state &fs = *fd_find(s);
+  (write ? fs.wop : fs.rop) = nullptr;
+  // Re-arm even if the callback throws.  fd_state structures never
+  // move, so fs remains valid.
+  struct rearm {
+    pollset *ps;
+    sock_t s;
+    fd_state &fs;
+    ~rearm() { ps->uring_arm(s, fs); }
+  } r {this, s, fs};
+  short revents = res < 0 ? POLLERR : res;
+  if (revents & (write ? POLLOUT : POLLIN) || revents & (POLLHUP|POLLERR))
+    run_fd_cb(fs, write);
+}
+
+// Invoke a read or write callback, removing it first if one-shot.
+void
+pollset::run_fd_cb(fd_state &fs, bool write)
+{
+  cb_t &cb = write ? fs.wcb : fs.rcb;
+  if (!cb)
+    return;
+  if (write ? fs.woneshot : fs.roneshot) {
+    cb_t tmp {std::move(cb)};
+    cb = nullptr;
+    if (!(pollfds_[fs.idx].events &= write ? ~POLLOUT : ~POLLIN))
+      fd_idle(fs);
+    tmp();
   }
+  else
+    cb();
 }
 
 std::size_t
 pollset::num_cbs() const
 {
-  return pollfds_.size() + time_cbs_.size();
+  return pollfds_.size() + ntimers_ + (ring_ ? ring_->active() : 0);
 }
 
 bool
@@ -196,60 +440,88 @@ pollset_plus::pending() const
   return nasync_ || num_cbs();
 }
 
-int
-pollset::next_timeout(int ms)
+// Microseconds until the next timeout, or until ms milliseconds if
+// sooner, or -1 if both are infinite.
+std::int64_t
+pollset::next_timeout_us(int ms)
 {
-  auto next = time_cbs_.begin();
-  if (next == time_cbs_.end())
-    return ms;
-  int64_t now = now_ms();
-  if (now >= next->first)
+  std::int64_t limit = ms < 0 ? -1 : std::int64_t(ms) * 1000;
+  if (!expired_.empty())
     return 0;
-  int64_t wait = next->first - now;
-  if (wait > std::numeric_limits<int>::max())
-    wait = std::numeric_limits<int>::max();
-  if (ms >= 0 && ms <= wait)
-    return ms;
-  return wait;
+  for (int level = 0; level < wheel_levels; level++) {
+    if (!occupied_[level])
+      continue;
+    // All timeouts in a level are in slots after wheel_now_'s, so
+    // the lowest occupied slot of the lowest level holds the next
+    // one to expire.
+    int slot = __builtin_ctzll(occupied_[level]);
+    const tlink &head = wheel_[level][slot];
+    std::int64_t next = std::numeric_limits<std::int64_t>::max();
+    for (const tlink *l = head.next_; l != &head; l = l->next_)
+      next = std::min(next, static_cast<const timer *>(l)->when_);
+    std::int64_t wait = std::max<std::int64_t>(next - now_us(), 0);
+    return limit >= 0 && limit < wait ? limit : wait;
+  }
+  return limit;
 }
 
 void
 pollset::poll(int timeout)
 {
-  int r = ::poll(pollfds_.data(), pollfds_.size(), next_timeout(timeout));
-  if (r < 0) {
-    if (errno == EINTR)
-      return;
-    std::cerr << "poll: " << sock_errmsg() << std::endl;
-    std::terminate();
+  // In case a callback threw an exception during the last poll
+  consolidate();
+  std::int64_t wait = next_timeout_us(timeout);
+  if (ring_) {
+    // Completion callbacks, including those of file descriptor
+    // polls, run inside io_ring::run.
+    if (ring_->run(wait) < 0) {
+      if (errno == EINTR)
+	return;
+      std::cerr << "io_uring_enter: " << sock_errmsg() << std::endl;
+      std::terminate();
+    }
   }
-  size_t maxpoll = pollfds_.size();
-  for (size_t i = 0; r > 0 && i < maxpoll; i++) {
-    pollfd *pfp = &pollfds_.at(i);
-    fd_state &fi = state_.at(sock_t(pfp->fd)); // XXX
-    assert (!(pfp->revents & POLLNVAL));
-    if (pfp->revents)
-      --r;
-    if (pfp->revents & (POLLIN|POLLHUP|POLLERR) && fi.rcb) {
-      if (fi.roneshot) {
-	cb_t cb {std::move(fi.rcb)};
-	fi.rcb = nullptr;
-	pfp->events &= ~POLLIN;
-	cb();
-      }
-      else
-	fi.rcb();
+  else {
+#if HAVE_PPOLL
+    timespec ts, *tsp = nullptr;
+    if (wait >= 0) {
+      ts.tv_sec = wait / 1000000;
+      ts.tv_nsec = wait % 1000000 * 1000;
+      tsp = &ts;
+    }
+    int r = ::ppoll(pollfds_.data(), pollfds_.size(), tsp, nullptr);
+#else // !HAVE_PPOLL
+    // Round up so as not to spin until a timeout is due
+    if (wait > 0)
+      wait = std::min<std::int64_t>((wait + 999) / 1000,
+				    std::numeric_limits<int>::max());
+    int r = ::poll(pollfds_.data(), pollfds_.size(), int(wait));
+#endif // !HAVE_PPOLL
+    if (r < 0) {
+      if (errno == EINTR)
+	return;
+      std::cerr << "poll: " << sock_errmsg() << std::endl;
+      std::terminate();
     }
-    pfp = &pollfds_.at(i); // callback might have resized vector
-    if (pfp->revents & (POLLOUT|POLLHUP|POLLERR) && fi.wcb) {
-      if (fi.woneshot) {
-	cb_t cb {std::move(fi.wcb)};
-	fi.wcb = nullptr;
-	pfp->events &= ~POLLOUT;
-	cb();
-      }
-      else
-	fi.wcb();
+    // Callbacks may add file descriptors (at the end of pollfds_),
+    // but removals are deferred until the loop is done.
+    struct dispatch_guard {
+      bool &d;
+      dispatch_guard(bool &dd) : d(dd) { d = true; }
+      ~dispatch_guard() { d = false; }
+    } g {dispatching_};
+    size_t maxpoll = pollfds_.size();
+    for (size_t i = 0; r > 0 && i < maxpoll; i++) {
+      short revents = pollfds_[i].revents;
+      if (!revents)
+	continue;
+      --r;
+      assert (!(revents & POLLNVAL));
+      fd_state &fi = *fd_find(sock_t(pollfds_[i].fd)); // XXX
+      if (revents & (POLLIN|POLLHUP|POLLERR))
+	run_fd_cb(fi, false);
+      if (revents & (POLLOUT|POLLHUP|POLLERR))
+	run_fd_cb(fi, true);
     }
   }
 
@@ -261,16 +533,120 @@ pollset::poll(int timeout)
 void
 pollset::run_timeouts()
 {
-  auto i = time_cbs_.begin();
-  if (i != time_cbs_.end()) {
-    int64_t now = now_ms();
-    while (i != time_cbs_.end() && now >= i->first) {
-      struct cleanup {
-	cb_t cb_;
-	~cleanup() { cb_(); }
-      } c {[&]() { time_cbs_.erase(i++); }};
-      i->second();
+  if (!ntimers_)
+    return;
+  timer_advance(now_us());
+  while (!expired_.empty()) {
+    timer *t = static_cast<timer *>(expired_.next_);
+    cb_t cb {std::move(t->cb_)};
+    timer_unlink(t);
+    t->cb_ = nullptr;
+    free_timers_.push_back(t);
+    cb();
+  }
+}
+
+pollset::timer *
+pollset::timer_add(std::int64_t us, cb_t &&cb)
+{
+  timer *t;
+  if (free_timers_.empty())
+    t = new timer;
+  else {
+    t = free_timers_.back();
+    free_timers_.pop_back();
+  }
+  t->cb_ = std::move(cb);
+  t->when_ = us;
+  timer_link(t);
+  ++ntimers_;
+  return t;
+}
+
+void
+pollset::timer_link(timer *t)
+{
+  tlink *head;
+  if (t->when_ <= wheel_now_) {
+    t->level_ = wheel_levels;
+    head = &expired_;
+  }
+  else {
+    std::uint64_t diff = std::uint64_t(t->when_) ^ std::uint64_t(wheel_now_);
+    int level = (63 - __builtin_clzll(diff)) / wheel_bits;
+    int slot = (std::uint64_t(t->when_) >> (level * wheel_bits))
+      & (wheel_size - 1);
+    t->level_ = level;
+    t->slot_ = slot;
+    occupied_[level] |= std::uint64_t(1) << slot;
+    head = &wheel_[level][slot];
+  }
+  t->insert_before(head);
+}
+
+void
+pollset::timer_unlink(timer *t)
+{
+  t->unlink();
+  --ntimers_;
+  if (t->level_ < wheel_levels && wheel_[t->level_][t->slot_].empty())
+    occupied_[t->level_] &= ~(std::uint64_t(1) << t->slot_);
+}
+
+// Move the wheel forward to time now, putting timeouts that are due
+// on the expired_ list in order of expiration and redistributing
+// other timeouts in crossed slots into lower levels.
+void
+pollset::timer_advance(std::int64_t now)
+{
+  if (now <= wheel_now_)
+    return;
+  const std::uint64_t from = wheel_now_, to = now;
+  tlink moved;
+  moved.init();
+  for (int level = 0; level < wheel_levels; level++) {
+    const int shift = level * wheel_bits;
+    const std::uint64_t elapsed = (to >> shift) - (from >> shift);
+    if (!elapsed)
+      break;			// Higher levels have not changed either
+    std::uint64_t mask = ~std::uint64_t(0);
+    if (elapsed < wheel_size) {
+      // Slots after from's, up to and including to's (mod wheel_size)
+      const int first = ((from >> shift) + 1) & (wheel_size - 1);
+      mask = (std::uint64_t(1) << elapsed) - 1;
+      if (first)
+	mask = mask << first | mask >> (wheel_size - first);
+    }
+    for (std::uint64_t crossed = occupied_[level] & mask; crossed;
+	 crossed &= crossed - 1) {
+      tlink &head = wheel_[level][__builtin_ctzll(crossed)];
+      // Splice the whole slot onto moved
+      head.next_->prev_ = moved.prev_;
+      moved.prev_->next_ = head.next_;
+      head.prev_->next_ = &moved;
+      moved.prev_ = head.prev_;
+      head.init();
     }
+    occupied_[level] &= ~mask;
+  }
+  wheel_now_ = now;
+
+  due_.clear();
+  while (!moved.empty()) {
+    timer *t = static_cast<timer *>(moved.next_);
+    t->unlink();
+    if (t->when_ <= now)
+      due_.push_back(t);
+    else
+      timer_link(t);
+  }
+  std::stable_sort(due_.begin(), due_.end(),
+		   [](const timer *a, const timer *b) {
+		     return a->when_ < b->when_;
+		   });
+  for (timer *t : due_) {
+    t->level_ = wheel_levels;
+    t->insert_before(&expired_);
   }
 }
 
@@ -300,7 +676,7 @@ pollset_plus::run_subtype_handlers()
     while(signal_flags[i] & 1)
       std::this_thread::yield();
     signal_flags[i] = 0;
-    cb_t cb {cbi->second};
+    std::function<void()> cb {cbi->second};
     lk.unlock();
     cb();
     lk.lock();
@@ -311,33 +687,17 @@ pollset_plus::run_subtype_handlers()
 void
 pollset::consolidate()
 {
-  while (!pollfds_.empty() && !pollfds_.back().events) {
-    auto fi = state_.find(sock_t(pollfds_.back().fd)); // XXX
-    if (fi != state_.end())
-      state_.erase(fi);
-    pollfds_.pop_back();
-  }
-
-  int i = pollfds_.size();
-  if (i < 2)
-    return;
-  for (i -= 2; i >= 0; --i) {
-    {
-      pollfd &pfd1 = pollfds_.at(i);
-      if (pfd1.events)
-	continue;
-      auto fi = state_.find(sock_t(pfd1.fd)); // XXX
-      if (fi != state_.end())
-	state_.erase(fi);
-    }
-    const pollfd &pfd = pollfds_[i] = pollfds_.back();
-    state_.at(sock_t(pfd.fd)).idx = i; // XXX
-    pollfds_.pop_back();
+  // Only file descriptors whose removal was deferred need looking at
+  for (fd_state *fs : idle_) {
+    fs->idle = false;
+    if (fs->idx >= 0 && !pollfds_[fs->idx].events)
+      fd_remove(*fs);
   }
+  idle_.clear();
 }
 
 void
-pollset_plus::signal_cb(int sig, cb_t cb)
+pollset_plus::signal_cb(int sig, std::function<void()> cb)
 {
   if (!cb) {
     signal_cb(sig);
@@ -406,10 +766,10 @@ pollset_plus::signal_cb(int sig, std::nullptr_t)
 }
 
 std::int64_t
-pollset::now_ms()
+pollset::now_us()
 {
   using namespace std::chrono;
-  return duration_cast<milliseconds>(steady_clock::now().time_since_epoch())
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch())
     .count();
 }
 
@@ -417,18 +777,21 @@ void
 pollset::timeout_cancel(Timeout &t)
 {
   if (t) {
-    assert(time_cbs_.find(t.i_->first) != time_cbs_.end());
-    time_cbs_.erase(t.i_);
+    assert(t.t_->cb_);
+    timer_unlink(t.t_);
+    t.t_->cb_ = nullptr;
+    free_timers_.push_back(t.t_);
     t = timeout_null();
   }
 }
 
 void
-pollset::timeout_reschedule_at(Timeout &t, std::int64_t ms)
+pollset::timeout_reschedule_at_us(Timeout &t, std::int64_t us)
 {
-  auto i = t.i_;
-  t.i_ = time_cbs_.emplace(ms, std::move(i->second));
-  time_cbs_.erase(i);
+  timer_unlink(t.t_);
+  t.t_->when_ = us;
+  timer_link(t.t_);
+  ++ntimers_;
 }
 
 }
@@ -5,6 +5,7 @@
 
 /** \file pollset.h Asynchronous I/O and event harness. */
 
+#include <atomic>
 #include <csignal>
 #include <functional>
 #include <map>
@@ -12,13 +13,17 @@
 #include <mutex>
 #include <thread>
 #include <type_traits>
-#include <unordered_map>
 #include <vector>
 #include <poll.h>
+#include <xdrpp/function.h>
 #include <xdrpp/socket.h>
+#include <xdrpp/workpool.h>
 
 namespace xdr {
 
+class io_ring;
+struct io_op;
+
 //! Structure to poll for a set of file descriptors and timeouts.
 class pollset {
 protected:
@@ -42,7 +47,20 @@ public:
     WriteOnce = kWriteFlag | kOnceFlag
   };
 
-  using cb_t = std::function<void()>;
+  //! Type of callbacks.  Move-only, and stores small callables (such
+  //! as lambdas capturing a few pointers) without allocating memory.
+  using cb_t = unique_function<void()>;
+
+  //! Mechanism used to wait for events.
+  enum class engine {
+    //! Readiness notification with poll(2).
+    Poll,
+    //! Linux io_uring.  File descriptor callbacks become one-shot
+    //! poll requests on the ring, and classes such as xdr::msg_sock
+    //! use pollset::ring() to submit reads and writes directly.
+    //! Falls back to \c Poll where io_uring is unavailable.
+    Uring
+  };
 
 private:
   // File descriptor callback information
@@ -52,27 +70,103 @@ private:
     int idx {-1};		// Index in pollfds_
     bool roneshot;
     bool woneshot;
+    bool idle {false};		// On idle_
+    io_op *rop {nullptr};	// Outstanding io_uring polls
+    io_op *wop {nullptr};
     ~fd_state();		// Sanity check no active callbacks
   };
 
-  // File descriptor callback state
+  // File descriptor callback state.  fd_state structures are indexed
+  // by file descriptor number, in fixed-size chunks so that they
+  // never move.  pollfds_ holds only descriptors with callbacks, and
+  // an entry is removed (by moving the last entry into its place) as
+  // soon as it has no events of interest, except while poll is
+  // iterating over pollfds_, when removal is deferred by queuing the
+  // fd_state on idle_.
+  static constexpr std::size_t fd_chunk = 256;
+  std::vector<std::unique_ptr<fd_state[]>> fd_chunks_;
   std::vector<pollfd> pollfds_;
-  std::unordered_map<sock_t, fd_state> state_;
+  std::vector<fd_state *> idle_;
+  bool dispatching_ {false};
 
-  // Timeout callback state
-  std::multimap<std::int64_t, cb_t> time_cbs_;
+  fd_state *fd_find(sock_t s) {
+    std::size_t c = std::size_t(s.fd_) / fd_chunk;
+    return c < fd_chunks_.size() ? &fd_chunks_[c][s.fd_ % fd_chunk]
+      : nullptr;
+  }
+  fd_state &fd_get(sock_t s);
+  void fd_idle(fd_state &fs);
+
+  // Timeout callback state.  Timeouts are kept in a hierarchical
+  // timing wheel with microsecond ticks:  a timeout is in level L if
+  // the most significant bit in which its expiration time differs
+  // from wheel_now_ is in bits [6L, 6L+6), and in the slot given by
+  // those 6 bits of its expiration time.  Hence timeouts in lower
+  // levels always expire before timeouts in higher ones, and
+  // advancing the clock only needs to look at the slots whose
+  // boundaries have been crossed.
+  struct tlink {
+    tlink *prev_;
+    tlink *next_;
+    void init() { prev_ = next_ = this; }
+    bool empty() const { return next_ == this; }
+    void unlink() { prev_->next_ = next_; next_->prev_ = prev_; }
+    void insert_before(tlink *pos) {
+      prev_ = pos->prev_;
+      next_ = pos;
+      prev_->next_ = next_->prev_ = this;
+    }
+  };
+  struct timer : tlink {
+    cb_t cb_;
+    std::int64_t when_;		// Microseconds, as returned by now_us()
+    std::uint8_t level_;	// Or wheel_levels if on expired_ list
+    std::uint8_t slot_;
+  };
+  static constexpr int wheel_bits = 6;
+  static constexpr int wheel_size = 1 << wheel_bits;
+  static constexpr int wheel_levels = (64 + wheel_bits - 1) / wheel_bits;
+  tlink wheel_[wheel_levels][wheel_size];
+  std::uint64_t occupied_[wheel_levels] {}; // Bitmaps of non-empty slots
+  std::int64_t wheel_now_;
+  tlink expired_;		// Due timeouts, in order
+  std::size_t ntimers_ {0};
+  std::vector<timer *> free_timers_;
+  std::vector<timer *> due_;	// Scratch space for timer_advance
+
+  // Non-null when using engine::Uring
+  std::unique_ptr<io_ring> ring_;
 
   cb_t &fd_cb_helper(sock_t s, op_t op);
+  void run_fd_cb(fd_state &fs, bool write);
+  void uring_arm(sock_t s, fd_state &fs);
+  void uring_ready(sock_t s, bool write, int res);
   void consolidate();
-  int next_timeout(int ms);
+  void fd_remove(fd_state &fs);
+  std::int64_t next_timeout_us(int ms);
   void run_timeouts();
+  timer *timer_add(std::int64_t us, cb_t &&cb);
+  void timer_link(timer *t);
+  void timer_unlink(timer *t);
+  void timer_advance(std::int64_t now);
 
   // Hook for subtypes
   virtual void run_subtype_handlers() {}
 
 public:
-  pollset() = default;
+  explicit pollset(engine e = default_engine());
   pollset(const pollset &) = delete;
+  virtual ~pollset();
+
+  //! The engine used when none is specified, which is \c Uring if
+  //! the environment variable \c XDR_POLLSET_ENGINE is set to \c
+  //! uring, and otherwise \c Poll.
+  static engine default_engine();
+  //! The engine actually in use.
+  engine get_engine() const { return ring_ ? engine::Uring : engine::Poll; }
+  //! The underlying io_uring, or \c nullptr when not using
+  //! engine::Uring.
+  io_ring *ring() const { return ring_.get(); }
 
   //! Go through one round of checking all file descriptors.  \arg \c
   //! timeout is a timeout in milliseconds (or -1 to wait forever).
@@ -119,25 +213,22 @@ public:
   //! as the basis of all timeouts.  Time zero is
   //! std::chrono::steady_clock's epoch, which in some implementations
   //! is the time a machine was booted.
-  static std::int64_t now_ms();
+  static std::int64_t now_ms() { return now_us() / 1000; }
+  //! Like PollSet::now_ms(), but in microseconds, which is the
+  //! resolution at which timeouts are actually kept.
+  static std::int64_t now_us();
 
-  //! Abstract class used to represent a pending timeout.
+  //! Abstract class used to represent a pending timeout.  A \c
+  //! Timeout becomes invalid once its callback starts running.
   class Timeout {
-    using iterator = decltype(time_cbs_)::iterator;
-    iterator i_;
-    explicit Timeout(iterator i) : i_(i) {}
-    Timeout &operator=(iterator i) { i_ = i; return *this; }
+    timer *t_;
+    explicit constexpr Timeout(timer *t) : t_(t) {}
     friend class pollset;
   public:
-    //! A null timeout.  Relies on static initalization.
+    //! A null timeout.
     static const Timeout null_;
-    //! After static initialization, Timeouts are null by default.
-    //! However, since \c null_ relies on static initialization,
-    //! static/global Timeouts are not guaranteed to be null and
-    //! should be explicitly initialized from \c
-    //! pollset::timeout_null().
-    Timeout() : i_(null_.i_) {}
-    explicit operator bool() const { return i_ != null_.i_; }
+    constexpr Timeout() : t_(nullptr) {}
+    explicit operator bool() const { return t_; }
   };
 
   //! Set a callback to run a certain number of milliseconds from now.
@@ -146,12 +237,25 @@ public:
   //! \returns an object on which you can call the method
   //! PollSet::timeout_cancel to cancel the timeout.
   template<typename CB> Timeout timeout(std::int64_t ms, CB &&cb) {
-    return timeout_at(now_ms() + ms, std::forward<CB>(cb));
+    return Timeout{timer_add(now_us() + ms * 1000,
+			     cb_t(std::forward<CB>(cb)))};
   }
   //! Set a callback to run at a specific time (as returned by
   //! PollSet::now_ms()).
   template<typename CB> Timeout timeout_at(std::int64_t ms, CB &&cb) {
-    return time_cbs_.emplace(ms, std::forward<CB>(cb));
+    return Timeout{timer_add(ms * 1000,
+			     cb_t(std::forward<CB>(cb)))};
+  }
+  //! Like PollSet::timeout, but with a delay in microseconds.
+  template<typename CB> Timeout timeout_us(std::int64_t us, CB &&cb) {
+    return Timeout{timer_add(now_us() + us,
+			     cb_t(std::forward<CB>(cb)))};
+  }
+  //! Like PollSet::timeout_at, but for a time returned by
+  //! PollSet::now_us().
+  template<typename CB> Timeout timeout_at_us(std::int64_t us, CB &&cb) {
+    return Timeout{timer_add(us,
+			     cb_t(std::forward<CB>(cb)))};
   }
 
   //! An invalid timeout, useful for initializing PollSet::Timeout
@@ -165,15 +269,24 @@ public:
 
   //! Returns the absolute time (in milliseconds) at which a timeout
   //! will run.
-  std::int64_t timeout_time(Timeout t) const { return t.i_->first; }
+  std::int64_t timeout_time(Timeout t) const { return t.t_->when_ / 1000; }
+  //! Returns the absolute time (in microseconds) at which a timeout
+  //! will run.
+  std::int64_t timeout_time_us(Timeout t) const { return t.t_->when_; }
 
-  //! Reschedule a timeout to run at a specific time.  Updates the
-  //! argument \c t, but invalidates any other copies of \c t.
-  void timeout_reschedule_at(Timeout &t, std::int64_t ms);
+  //! Reschedule a timeout to run at a specific time.  Unlike
+  //! cancelling the timeout and creating a new one, this does not
+  //! copy or move the callback, and copies of \c t remain valid.
+  void timeout_reschedule_at(Timeout &t, std::int64_t ms) {
+    timeout_reschedule_at_us(t, ms * 1000);
+  }
   //! Reschedule a timeout some number of milliseconds in the future.
   void timeout_reschedule(Timeout &t, std::int64_t ms) {
-    timeout_reschedule_at(t, now_ms() + ms);
+    timeout_reschedule_at_us(t, now_us() + ms * 1000);
   }
+  //! Reschedule a timeout to run at a time returned by
+  //! PollSet::now_us().
+  void timeout_reschedule_at_us(Timeout &t, std::int64_t us);
 };
 
 //! Adds support for signal handlers, asynchonous events, and
@@ -203,14 +316,43 @@ class pollset_plus : public pollset {
     }
   };
 
-  // Self-pipe used to wake up poll from signal handlers and other threads
-  sock_t selfpipe_[2];
-
-  // Asynchronous events enqueued from other threads
-  std::mutex async_cbs_lock_;
-  std::vector<cb_t> async_cbs_;
-  bool async_pending_{false};
+  // File descriptors used to wake up poll from signal handlers and
+  // other threads:  an eventfd (in both elements) where available,
+  // otherwise a self-pipe.
+  sock_t wakefd_[2];
+  // Set by a signal handler before waking the pollset.
+  std::atomic<bool> signal_wake_{false};
+
+  // Callbacks injected from other threads are kept in an intrusive,
+  // multi-producer, single-consumer queue.  Producers push onto
+  // inject_head_ with a single atomic exchange, then link the new
+  // node to the previous head.  Until then, the node's next_ field
+  // holds &inject_unlinked_.  Only the producer that finds the queue
+  // empty wakes the pollset, so repeated wakeups coalesce.
+  //
+  // Nodes are recycled rather than freed:  after running a batch of
+  // callbacks, the consumer pushes the spent nodes onto inject_free_,
+  // and a producer that runs out of nodes takes the whole free list
+  // (with one exchange) into a stash private to its thread.  So in
+  // the steady state, injecting a callback does not allocate.
+  struct inject_node {
+    std::atomic<inject_node *> next_ {nullptr};
+    cb_t cb_;
+  };
+  static inject_node inject_unlinked_;
+  // Nodes a thread has taken from free lists, usable with any pollset
+  struct inject_stash {
+    inject_node *head_ {nullptr};
+    ~inject_stash();
+  };
+  static thread_local inject_stash inject_stash_;
+  std::atomic<inject_node *> inject_head_{nullptr};
+  std::atomic<inject_node *> inject_free_{nullptr};
+  // Callbacks taken off the queue, oldest first, but not yet run
+  // (because an earlier callback threw an exception).
+  inject_node *inject_run_{nullptr};
   size_t nasync_{0};
+  work_pool *pool_{nullptr};
 
   // Signal callback state
   static constexpr int num_sig = 32;
@@ -218,18 +360,19 @@ class pollset_plus : public pollset {
   static pollset_plus *signal_owners[num_sig];
   static volatile std::sig_atomic_t signal_flags[num_sig];
   bool signal_pending_{false};
-  std::map<int, cb_t> signal_cbs_;
+  std::map<int, std::function<void()>> signal_cbs_;
 
   void wake(wake_type wt);
   void run_pending_asyncs();
-  void inject_cb_vec(std::vector<cb_t>::iterator b,
-		     std::vector<cb_t>::iterator e);
+  inject_node *inject_node_get();
+  void inject_node_push(inject_node *n);
+  void inject_node_free(inject_node *head, inject_node *tail);
   void run_subtype_handlers() override;
   static void signal_handler(int);
   static void erase_signal_cb(int);
 
 public:
-  pollset_plus();
+  explicit pollset_plus(engine e = default_engine());
   ~pollset_plus();
 
   bool pending() const override;
@@ -242,16 +385,15 @@ public:
   //! Inject a callback to run immediately.  Unlike most methods, it
   //! is safe to call this function from another thread.  Being
   //! thread-safe adds extra overhead, so it does not make sense to
-  //! call this function from the same thread as PollSet::poll.  Note
-  //! that \c inject_cb acquires a lock and definitely must <i>not</i>
-  //! be called from a signal handler (or deadlock could ensue).
+  //! call this function from the same thread as PollSet::poll.
+  //! \c inject_cb does not take any locks, and normally does not
+  //! allocate memory, but it may, so must <i>not</i> be called from a
+  //! signal handler.
   template<typename CB> void inject_cb(CB &&cb) {
-    std::lock_guard<std::mutex> lk(async_cbs_lock_);
-    async_cbs_.emplace_back(std::forward<CB>(cb));
-    if (!async_pending_) {
-      async_pending_ = true;
-      wake();
-    }
+    cb_t f {std::forward<CB>(cb)};
+    inject_node *n = inject_node_get();
+    n->cb_ = std::move(f);
+    inject_node_push(n);
   }
 
   //! Execute a task asynchonously in another thread, then run
@@ -260,16 +402,22 @@ public:
   //! be convertible to std::function<R()> for some type \c R.  \arg
   //! \c cb is the callback that processes the result in the main
   //! thread, and must be convertible to std::function<void(R)> for
-  //! the same type \c R.
+  //! the same type \c R.  Tasks run in the pollset's xdr::work_pool.
   template<typename Work, typename CB> void async(Work &&work, CB &&cb) {
     using R = decltype(work());
     async_task<R> *a = new async_task<R> {
       this, std::forward<Work>(work), std::forward<CB>(cb), nullptr
     };
     ++nasync_;
-    std::thread(&async_task<R>::start, a).detach();
+    work_pool &wp = pool_ ? *pool_ : work_pool::shared();
+    wp.submit(std::bind(&async_task<R>::start, a));
   }
 
+  //! Use a specific pool for pollset_plus::async, rather than the
+  //! default work_pool::shared().  The pool must outlive any tasks
+  //! submitted to it.
+  void set_work_pool(work_pool &wp) { pool_ = &wp; }
+
   //! Add a callback for a particular signal.  Note that only one
   //! callback can be added for a particular signal across all
   //! `pollset_plus` instances in a single process.  Hence, calling
@@ -278,7 +426,7 @@ public:
   //! `pollset_plus` had for the signal).  Such callback stealing is
   //! atomic, allowing one to steal a `pollset_plus`'s signals before
   //! deleting it with no risk of signals going uncaught.
-  void signal_cb(int sig, cb_t cb);
+  void signal_cb(int sig, std::function<void()> cb);
 
   //! Remove any previously added callback for a particular signal.
   //! Because signal callbacks are process-wide, this static method
@@ -0,0 +1,101 @@
+
+#include <cassert>
+#include <xdrpp/reactor.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif // __linux__
+
+namespace xdr {
+
+unsigned
+reactor::default_size()
+{
+  unsigned n = std::thread::hardware_concurrency();
+  return n ? n : 1;
+}
+
+reactor::reactor(unsigned n, pollset::engine e)
+{
+  assert(n > 0);
+  for (unsigned i = 0; i < n; i++)
+    ps_.emplace_back(new pollset_plus(e));
+}
+
+reactor::~reactor()
+{
+  stop();
+}
+
+namespace {
+// CPUs the calling thread is allowed to run on, in increasing order
+std::vector<int>
+allowed_cpus()
+{
+  std::vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    for (int i = 0; i < CPU_SETSIZE; i++)
+      if (CPU_ISSET(i, &set))
+	cpus.push_back(i);
+#endif // __linux__
+  return cpus;
+}
+
+// Best effort: a thread that cannot be pinned just runs unpinned
+bool
+pin_self(int cpu)
+{
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else // !__linux__
+  return false;
+#endif // !__linux__
+}
+}
+
+void
+reactor::loop(pollset_plus *ps, int cpu)
+{
+  if (cpu >= 0)
+    pin_self(cpu);
+  while (!stop_.load(std::memory_order_acquire))
+    ps->poll();
+}
+
+void
+reactor::start()
+{
+  assert(!running());
+  stop_.store(false, std::memory_order_release);
+  cpus_.clear();
+  if (pin_) {
+    std::vector<int> allowed = allowed_cpus();
+    for (std::size_t i = 0; !allowed.empty() && i < ps_.size(); i++)
+      cpus_.push_back(allowed[i % allowed.size()]);
+  }
+  for (unsigned i = 0; i < ps_.size(); i++)
+    threads_.emplace_back(&reactor::loop, this, ps_[i].get(), cpu(i));
+}
+
+void
+reactor::stop()
+{
+  if (!running())
+    return;
+  stop_.store(true, std::memory_order_release);
+  for (auto &ps : ps_)
+    ps->wake();
+  for (std::thread &t : threads_)
+    t.join();
+  threads_.clear();
+  cpus_.clear();
+}
+
+}
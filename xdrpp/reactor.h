@@ -0,0 +1,71 @@
+// -*- C++ -*-
+
+//! \file reactor.h Several event loops, each run by its own thread.
+
+#ifndef _XDRPP_REACTOR_H_HEADER_INCLUDED_
+#define _XDRPP_REACTOR_H_HEADER_INCLUDED_ 1
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <xdrpp/pollset.h>
+
+namespace xdr {
+
+//! A fixed set of xdr::pollset_plus event loops, each run by a
+//! dedicated thread, for servers that should use more than one core.
+//! Objects attached to one of the pollsets (sockets, listeners,
+//! timeouts) must only be touched from that pollset's thread, or
+//! before reactor::start and after reactor::stop.  To get work onto
+//! a particular loop from elsewhere, use pollset_plus::inject_cb.
+class reactor {
+  std::vector<std::unique_ptr<pollset_plus>> ps_;
+  std::vector<std::thread> threads_;
+  std::atomic<bool> stop_ {false};
+  bool pin_ {false};
+  std::vector<int> cpus_;
+
+  void loop(pollset_plus *ps, int cpu);
+
+public:
+  //! Number of threads used by default (the number of cores).
+  static unsigned default_size();
+
+  //! Create \c n pollsets using event engine \c e.  The threads are
+  //! not started until reactor::start.
+  explicit reactor(unsigned n = default_size(),
+		   pollset::engine e = pollset::default_engine());
+  //! Calls reactor::stop.
+  ~reactor();
+  reactor(const reactor &) = delete;
+  reactor &operator=(const reactor &) = delete;
+
+  unsigned size() const { return ps_.size(); }
+  pollset_plus &at(unsigned i) { return *ps_.at(i); }
+
+  //! If \c true, reactor::start pins thread \c i to the <tt>i</tt>th
+  //! CPU the process may run on (wrapping around if there are more
+  //! threads than CPUs), so that the connections of each pollset, and
+  //! the sessions allocated for them, stay in one core's caches.  Off
+  //! by default, and ignored on systems without CPU affinity.  Takes
+  //! effect at the next reactor::start.
+  void set_pin_threads(bool pin) { pin_ = pin; }
+  //! The CPU assigned to the thread running pollset \c i, or
+  //! -1 if it is not pinned.  Only meaningful while running.
+  int cpu(unsigned i) const { return i < cpus_.size() ? cpus_[i] : -1; }
+
+  //! Start one thread running each pollset.  The threads keep polling
+  //! until reactor::stop, even when nothing is pending.
+  void start();
+  //! Make each thread return after its current poll iteration, then
+  //! wait for them all to exit.  Must not be called from one of the
+  //! reactor's own threads.
+  void stop();
+  //! True between reactor::start and reactor::stop.
+  bool running() const { return !threads_.empty(); }
+};
+
+}
+
+#endif // !_XDRPP_REACTOR_H_HEADER_INCLUDED_
@@ -105,6 +105,8 @@ rpc_call_stat::message() const
     return "network error when communicating with server";
   case BAD_ALLOC:
     return "insufficient memory to unmarshal result";
+  case TIMEOUT:
+    return "timed out waiting for reply from server";
   default:
     std::cerr << "rpc_call_stat: invalid type" << std::endl;
     std::terminate();
@@ -0,0 +1,41 @@
+/* Statistics gathered by xdr::rpc_metrics, and the RPC program that
+   serves them (see xdrpp/metrics.h). */
+
+namespace xdr {
+
+/* Number of calls whose latency was at most le_ns nanoseconds (and
+   more than the le_ns of the previous bucket). */
+struct rpc_latency_bucket {
+  unsigned hyper le_ns;
+  unsigned hyper count;
+};
+
+/* Counters for one procedure, on the server or client side.  Only
+   completed calls are counted. */
+struct rpc_proc_stats {
+  unsigned prog;
+  unsigned vers;
+  unsigned proc;
+  unsigned hyper calls;
+  unsigned hyper accept_stats[6]; /* Accepted replies, by accept_stat */
+  unsigned hyper denied;	  /* MSG_DENIED replies */
+  unsigned hyper no_reply;	  /* Dropped, timed out, or failed */
+  unsigned hyper bytes_in;	  /* Calls for a server, replies for a client */
+  unsigned hyper bytes_out;
+  unsigned hyper latency_sum_ns;
+  rpc_latency_bucket latency<>;	  /* Non-empty buckets, in order */
+};
+
+struct rpc_stats {
+  rpc_proc_stats server<>;
+  rpc_proc_stats client<>;
+};
+
+program XDRPP_STATS_PROG {
+  version xdrpp_stats_v1 {
+    void stats_null(void) = 0;
+    rpc_stats stats_get(void) = 1;
+  } = 1;
+} = 0x20787070;
+
+}
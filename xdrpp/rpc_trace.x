@@ -0,0 +1,24 @@
+/* Format of the binary trace files written by xdr::trace_writer (see
+   xdrpp/trace.h).  A file is the eight bytes "XDRTRACE" followed by
+   any number of trace_records. */
+
+namespace xdr {
+
+enum trace_kind {
+  TRACE_CALL_IN = 0,		/* Call received by a server */
+  TRACE_REPLY_OUT = 1,		/* Reply sent by a server */
+  TRACE_CALL_OUT = 2,		/* Call sent by a client */
+  TRACE_REPLY_IN = 3		/* Reply received by a client */
+};
+
+struct trace_record {
+  unsigned hyper time_ns;	/* Since the Unix epoch */
+  trace_kind kind;
+  unsigned xid;
+  unsigned prog;
+  unsigned vers;
+  unsigned proc;
+  opaque msg<>;			/* Whole RPC message, empty if none */
+};
+
+}
@@ -1,78 +1,186 @@
 
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <xdrpp/metrics.h>
 #include <xdrpp/server.h>
+#include <xdrpp/trace.h>
 
 namespace xdr {
 
 bool xdr_trace_server = std::getenv("XDR_TRACE_SERVER");
 
+namespace detail {
+const uint32_t rpc_success_hdr_words[6] = {
+  0, swap32le(REPLY), swap32le(MSG_ACCEPTED), swap32le(AUTH_NONE), 0,
+  swap32le(SUCCESS)
+};
+}
+
+namespace {
+
+// Preencoded error replies, with a zero xid.  Replies with further
+// variable fields have them patched in after the copy.
+const uint32_t accepted_error_words[SYSTEM_ERR + 1][6] = {
+#define ACCEPTED_ERROR(stat) {						\
+    0, swap32le(REPLY), swap32le(MSG_ACCEPTED), swap32le(AUTH_NONE), 0,	\
+    swap32le(stat)							\
+  }
+  ACCEPTED_ERROR(SUCCESS), ACCEPTED_ERROR(PROG_UNAVAIL),
+  ACCEPTED_ERROR(PROG_MISMATCH), ACCEPTED_ERROR(PROC_UNAVAIL),
+  ACCEPTED_ERROR(GARBAGE_ARGS), ACCEPTED_ERROR(SYSTEM_ERR),
+#undef ACCEPTED_ERROR
+};
+const uint32_t auth_error_words[5] = {
+  0, swap32le(REPLY), swap32le(MSG_DENIED), swap32le(AUTH_ERROR), 0
+};
+const uint32_t rpc_mismatch_words[6] = {
+  0, swap32le(REPLY), swap32le(MSG_DENIED), swap32le(RPC_MISMATCH),
+  swap32le(2), swap32le(2)
+};
+
+// Allocate a reply of size bytes, starting with the first n bytes of
+// words, and with the xid patched in.
+msg_ptr
+reply_from_template(uint32_t xid, const uint32_t *words, std::size_t n,
+		    std::size_t size)
+{
+  msg_ptr buf(message_t::alloc(size));
+  uint32_t *p = reinterpret_cast<uint32_t *>(buf->data());
+  std::memcpy(p, words, n);
+  p[0] = swap32le(xid);
+  return buf;
+}
+
+} // namespace
+
 msg_ptr
 rpc_accepted_error_msg(uint32_t xid, accept_stat stat)
 {
   assert(stat != SUCCESS && stat != PROG_MISMATCH);
-  msg_ptr buf(message_t::alloc(24));
-  xdr_put p(buf);
-  p(xid);
-  p(REPLY);
-  p(MSG_ACCEPTED);
-  p(AUTH_NONE);
-  p(uint32_t(0));
-  p(stat);
-  assert(p.p_ == p.e_);
-  return buf;
+  if (uint32_t(stat) > SYSTEM_ERR) {
+    msg_ptr buf(reply_from_template(xid, accepted_error_words[0], 24, 24));
+    reinterpret_cast<uint32_t *>(buf->data())[5] = swap32le(stat);
+    return buf;
+  }
+  return reply_from_template(xid, accepted_error_words[stat], 24, 24);
 }
 
 msg_ptr
 rpc_prog_mismatch_msg(uint32_t xid, uint32_t low, uint32_t high)
 {
-  msg_ptr buf(message_t::alloc(32));
-  xdr_put p(buf);
-  p(xid);
-  p(REPLY);
-  p(MSG_ACCEPTED);
-  p(AUTH_NONE);
-  p(uint32_t(0));
-  p(PROG_MISMATCH);
-  p(low);
-  p(high);
-  assert(p.p_ == p.e_);
+  msg_ptr buf(reply_from_template(xid, accepted_error_words[PROG_MISMATCH],
+				  24, 32));
+  uint32_t *p = reinterpret_cast<uint32_t *>(buf->data());
+  p[6] = swap32le(low);
+  p[7] = swap32le(high);
   return buf;
 }
 
 msg_ptr
 rpc_auth_error_msg(uint32_t xid, auth_stat stat)
 {
-  msg_ptr buf(message_t::alloc(20));
-  xdr_put p(buf);
-  p(xid);
-  p(REPLY);
-  p(MSG_DENIED);
-  p(AUTH_ERROR);
-  p(stat);
-  assert(p.p_ == p.e_);
+  msg_ptr buf(reply_from_template(xid, auth_error_words, 16, 20));
+  reinterpret_cast<uint32_t *>(buf->data())[4] = swap32le(stat);
   return buf;
 }
 
 msg_ptr
 rpc_rpc_mismatch_msg(uint32_t xid)
 {
-  msg_ptr buf(message_t::alloc(24));
-  xdr_put p(buf);
-  p(xid);
-  p(REPLY);
-  p(MSG_DENIED);
-  p(RPC_MISMATCH);
-  p(uint32_t(2));
-  p(uint32_t(2));
-  assert(p.p_ == p.e_);
-  return buf;
+  return reply_from_template(xid, rpc_mismatch_words, 24, 24);
+}
+
+
+namespace {
+
+// Read an empty AUTH_NONE opaque_auth.  Anything else, notably
+// AUTH_SYS credentials, which services may inspect in process, goes
+// through the generic decoder so that the body is kept.
+bool
+get_auth_none(const std::uint32_t *&p, const std::uint32_t *e,
+	      opaque_auth &a)
+{
+  if (e - p < 2 || p[0] != swap32le(AUTH_NONE) || p[1] != 0)
+    return false;
+  p += 2;
+  a.flavor = AUTH_NONE;
+  return true;
+}
+
+// Decode the header of a call with empty AUTH_NONE authenticators
+// by reading its fixed-position fields in place,
+// which allocates nothing.  Returns false, without consuming any
+// input, for anything else (including malformed headers), which
+// must go through the generic decoder.
+bool
+fast_call_hdr(xdr_get &g, rpc_msg &hdr)
+{
+  const std::uint32_t *p = g.p_;
+  if (g.e_ - p < 6)
+    return false;
+  std::uint32_t xid = xdr_get::get32(p);
+  if (xdr_get::get32(p) != CALL)
+    return false;
+  call_body &cb = hdr.body.mtype(CALL).cbody();
+  cb.rpcvers = xdr_get::get32(p);
+  cb.prog = xdr_get::get32(p);
+  cb.vers = xdr_get::get32(p);
+  cb.proc = xdr_get::get32(p);
+  if (!get_auth_none(p, g.e_, cb.cred) || !get_auth_none(p, g.e_, cb.verf))
+    return false;
+  hdr.xid = xid;
+  g.p_ = p;
+  return true;
 }
 
+} // namespace
 
 void
 rpc_server_base::register_service_base(service_base *s)
 {
   servers_[s->prog_][s->vers_].reset(s);
+  rebuild_procs();
+}
+
+void
+rpc_server_base::rebuild_procs()
+{
+  std::size_t n = 0;
+  for (const auto &prog : servers_)
+    for (const auto &vers : prog.second)
+      n += vers.second->procs_.size();
+
+  // At most half full, so probe sequences stay short
+  std::size_t size = 1;
+  while (size < 2 * n)
+    size <<= 1;
+  std::vector<proc_slot> procs(size);
+  for (const auto &prog : servers_)
+    for (const auto &vers : prog.second)
+      for (const auto &p : vers.second->procs_) {
+	std::size_t i = proc_hash(prog.first, vers.first, p.first);
+	while (procs[i &= size - 1].thunk_)
+	  ++i;
+	procs[i] = proc_slot{prog.first, vers.first, p.first,
+			     vers.second.get(), p.second};
+      }
+  procs_.swap(procs);
+}
+
+const rpc_server_base::proc_slot *
+rpc_server_base::find_proc(uint32_t prog, uint32_t vers, uint32_t proc) const
+{
+  std::size_t mask = procs_.size() - 1;
+  for (std::size_t i = proc_hash(prog, vers, proc);; ++i) {
+    const proc_slot &ps = procs_[i & mask];
+    if (!ps.thunk_)
+      return nullptr;
+    if (ps.proc_ == proc && ps.prog_ == prog && ps.vers_ == vers)
+      return &ps;
+  }
 }
 
 void
@@ -81,7 +189,10 @@ rpc_server_base::dispatch(void *session, msg_ptr m, service_base::cb_t reply)
   xdr_get g(m);
   rpc_msg hdr;
 
-  try { archive(g, hdr); }
+  try {
+    if (!fast_call_hdr(g, hdr))
+      archive(g, hdr);
+  }
   catch (const xdr_runtime_error &e) {
     std::cerr << "rpc_server_base::dispatch: ignoring malformed header: "
 	      << e.what() << std::endl;
@@ -92,78 +203,291 @@ rpc_server_base::dispatch(void *session, msg_ptr m, service_base::cb_t reply)
     return;
   }
 
-  if (hdr.body.cbody().rpcvers != 2)
+  const call_body &cb = hdr.body.cbody();
+  if (metrics_)
+    reply = metrics_->meter(rpc_metrics::SERVER, cb.prog, cb.vers, cb.proc,
+			    m->size(), std::move(reply));
+  if (xdr_trace_writer && xdr_trace_writer->sample()) {
+    xdr_trace_writer->record(TRACE_CALL_IN, hdr.xid, cb.prog, cb.vers,
+			     cb.proc, m);
+    reply = xdr_trace_writer->trace_reply(TRACE_REPLY_OUT, hdr.xid, cb.prog,
+					  cb.vers, cb.proc, std::move(reply));
+  }
+  if (cb.rpcvers != 2)
     return reply(rpc_rpc_mismatch_msg(hdr.xid));
 
-  auto prog = servers_.find(hdr.body.cbody().prog);
-  if (prog == servers_.end())
-    return reply(rpc_accepted_error_msg(hdr.xid, PROG_UNAVAIL));
+  service_base *s;
+  service_base::thunk_t thunk = nullptr;
+  if (const proc_slot *ps = find_proc(cb.prog, cb.vers, cb.proc)) {
+    s = ps->s_;
+    thunk = ps->thunk_;
+  }
+  else {
+    // Services without per-procedure thunks, and all the errors
+    auto prog = servers_.find(cb.prog);
+    if (prog == servers_.end())
+      return reply(rpc_accepted_error_msg(hdr.xid, PROG_UNAVAIL));
 
-  auto vers = prog->second.find(hdr.body.cbody().vers);
-  if (vers == prog->second.end()) {
-    uint32_t low = prog->second.cbegin()->first;
-    uint32_t high = prog->second.crbegin()->first;
-    return reply(rpc_prog_mismatch_msg(hdr.xid, low, high));
+    auto vers = prog->second.find(cb.vers);
+    if (vers == prog->second.end()) {
+      uint32_t low = prog->second.cbegin()->first;
+      uint32_t high = prog->second.crbegin()->first;
+      return reply(rpc_prog_mismatch_msg(hdr.xid, low, high));
+    }
+    s = vers->second.get();
   }
 
   try {
-    vers->second->process(session, hdr, g, reply);
+    if (thunk)
+      thunk(s, session, hdr, g, std::move(reply));
+    else
+      s->process(session, hdr, g, std::move(reply));
     return;
   }
   catch (const xdr_runtime_error &e) {
     std::cerr << "rpc_server_base::dispatch: " << e.what() << std::endl;
   }
-  reply(rpc_accepted_error_msg(hdr.xid, GARBAGE_ARGS));
+  // Unless the service already took over the reply callback
+  if (reply)
+    reply(rpc_accepted_error_msg(hdr.xid, GARBAGE_ARGS));
 }
 
 
+// State of an accepted connection.  Reply callbacks hold a reference
+// to it, so they can tell if the connection has been closed (and the
+// listener possibly destroyed) by the time they are invoked.
+struct rpc_tcp_listener_common::conn {
+  rpc_tcp_listener_common *const l_;
+  rpc_sock *const ms_;
+  void *const session_;
+  const bool ordered_;		// Listener's setting when accepted
+  bool closed_ {false};
+  unsigned inflight_ {0};	// Calls not yet replied to
+  // Sequence numbers of calls, and (with ordered replies) replies
+  // that are finished but waiting for replies to earlier calls.
+  // done_[i] refers to call number next_reply_ + i.
+  std::uint64_t next_call_ {0};
+  std::uint64_t next_reply_ {0};
+  struct done_reply {
+    bool done_ {false};
+    msg_ptr m_;
+  };
+  std::deque<done_reply> done_;
+
+  conn(rpc_tcp_listener_common *l, rpc_sock *ms, void *session)
+    : l_(l), ms_(ms), session_(session), ordered_(l->ordered_) {}
+};
+
+// Reply callback for one call.  If destroyed without being invoked,
+// the call completes with no reply.
+class rpc_tcp_listener_common::conn_reply {
+  std::shared_ptr<conn> c_;
+  std::uint64_t seq_;
+  void done(msg_ptr &&m) {
+    std::shared_ptr<conn> c;
+    c.swap(c_);
+    if (!c->closed_)
+      c->l_->reply_done(*c, seq_, std::move(m));
+  }
+public:
+  conn_reply(const std::shared_ptr<conn> &c, std::uint64_t seq)
+    : c_(c), seq_(seq) {}
+  conn_reply(conn_reply &&) = default;
+  ~conn_reply() { if (c_) done(nullptr); }
+  void operator()(msg_ptr m) {
+    assert(c_);			// If this fails you replied twice
+    done(std::move(m));
+  }
+};
+
 rpc_tcp_listener_common::rpc_tcp_listener_common(pollset &ps, unique_sock &&s,
 						 bool reg)
   : listen_sock_(s ? std::move(s) : tcp_listen()), use_rpcbind_(reg),
     ps_(ps)
 {
   set_close_on_exec(listen_sock_.get());
-  ps_.fd_cb(listen_sock_.get(), pollset::Read,
-	    std::bind(&rpc_tcp_listener_common::accept_cb, this));
+  accept_start();
 }
 
 rpc_tcp_listener_common::~rpc_tcp_listener_common()
 {
-  ps_.fd_cb(listen_sock_.get(), pollset::Read);
+  assert(conns_.empty());
+  accept_stop();
   // XXX should clean up if use_rpcbind_.
 }
 
+void
+rpc_tcp_listener_common::close_all()
+{
+  while (!conns_.empty())
+    close_conn(conns_.begin()->first);
+}
+
+void
+rpc_tcp_listener_common::close_conn(conn *c)
+{
+  std::shared_ptr<conn> cp {std::move(conns_.at(c))};
+  conns_.erase(c);
+  c->closed_ = true;
+  session_free(c->session_);
+  delete c->ms_;
+  if (accept_paused_ && conns_.size() < max_conns_) {
+    accept_paused_ = false;
+    accept_start();
+  }
+}
+
+void
+rpc_tcp_listener_common::set_max_connections(std::size_t n)
+{
+  max_conns_ = n;
+  if (n && !accept_poll_ && !accept_paused_) {
+    // Connections already accepted by a multishot request would be
+    // lost when pausing it, so poll for readiness instead.
+    accept_stop();
+    accept_poll();
+  }
+  if (accept_paused_ && (!n || conns_.size() < n)) {
+    accept_paused_ = false;
+    accept_start();
+  }
+}
+
+void
+rpc_tcp_listener_common::accept_start()
+{
+  if (accept_poll_)
+    accept_poll();
+  else if (io_ring *ring = ps_.ring())
+    accept_op_ = ring->accept_multishot(listen_sock_.get(),
+					[this](int res, bool more) {
+					  accept_done(res, more);
+					});
+  if (!accept_op_ && !accept_poll_)
+    accept_poll();
+}
+
+void
+rpc_tcp_listener_common::accept_stop()
+{
+  if (accept_op_) {
+    ps_.ring()->cancel(accept_op_);
+    accept_op_ = nullptr;
+  }
+  else if (accept_poll_)
+    ps_.fd_cb(listen_sock_.get(), pollset::Read);
+}
+
+void
+rpc_tcp_listener_common::accept_poll()
+{
+  // accept_cb drains the queue until accept fails with EAGAIN
+  set_nonblock(listen_sock_.get());
+  accept_poll_ = true;
+  ps_.fd_cb(listen_sock_.get(), pollset::Read, [this]() { accept_cb(); });
+}
+
 void
 rpc_tcp_listener_common::accept_cb()
 {
-  sock_t s = accept(listen_sock_.get(), nullptr, 0);
-  if (s == invalid_sock) {
-    std::cerr << "rpc_tcp_listener_common: accept: " << sock_errmsg()
-	      << std::endl;
+  for (unsigned i = 0; i < accept_batch_ && !accept_paused_; i++) {
+    sock_t s = accept_nonblock(listen_sock_.get());
+    if (s == invalid_sock) {
+      if (!sock_eagain())
+	std::cerr << "rpc_tcp_listener_common: accept: " << sock_errmsg()
+		  << std::endl;
+      return;
+    }
+    accepted(s);
+  }
+}
+
+void
+rpc_tcp_listener_common::accept_done(int res, bool more)
+{
+  if (!more)
+    accept_op_ = nullptr;
+  if (res >= 0) {
+    accepted(sock_t(res));
+    if (!more && !accept_op_ && !accept_paused_)
+      accept_start();		// Kernel stopped the multishot request
+    return;
+  }
+  if (res == -EINVAL && !more) {
+    // Kernel too old for multishot accept
+    accept_poll();
     return;
   }
-  set_close_on_exec(s);
+  errno = -res;
+  std::cerr << "rpc_tcp_listener_common: accept: " << sock_errmsg()
+	    << std::endl;
+  if (!more && !accept_op_ && !accept_paused_)
+    accept_start();
+}
+
+void
+rpc_tcp_listener_common::accepted(sock_t s)
+{
   rpc_sock *ms = new rpc_sock(ps_, s);
-  ms->set_servcb(std::bind(&rpc_tcp_listener_common::receive_cb, this, ms,
-			   session_alloc(ms), std::placeholders::_1));
+  std::shared_ptr<conn> c {std::make_shared<conn>(this, ms,
+						  session_alloc(ms))};
+  conn *cp = c.get();
+  conns_.emplace(cp, std::move(c));
+  ms->set_servcb([this, cp](msg_ptr mp) { receive_cb(cp, std::move(mp)); });
+  if (max_conns_ && conns_.size() >= max_conns_ && !accept_paused_) {
+    accept_paused_ = true;
+    accept_stop();
+  }
 }
 
 void
-rpc_tcp_listener_common::receive_cb(rpc_sock *ms, void *session, msg_ptr mp)
+rpc_tcp_listener_common::receive_cb(conn *c, msg_ptr mp)
 {
   if (!mp) {
-    session_free(session);
-    delete ms;
+    close_conn(c);
     return;
   }
+  std::shared_ptr<conn> cp {conns_.at(c)};
+  ++c->inflight_;
+  std::uint64_t seq = c->next_call_++;
+  if (c->ordered_)
+    c->done_.emplace_back();
   try {
-    dispatch(session, std::move(mp), rpc_sock_reply_t(ms));
+    dispatch(c->session_, std::move(mp), conn_reply(cp, seq));
   }
   catch (const xdr_runtime_error &e) {
     std::cerr << e.what() << std::endl;
-    session_free(session);
-    delete ms;
+    if (!c->closed_)
+      close_conn(c);
+    return;
+  }
+  // Handlers that reply right away never pause the connection
+  if (!c->closed_ && max_inflight_ && c->inflight_ >= max_inflight_)
+    c->ms_->ms_->pause_read();
+}
+
+void
+rpc_tcp_listener_common::reply_done(conn &c, std::uint64_t seq, msg_ptr mp)
+{
+  if (!c.ordered_) {
+    if (mp)
+      c.ms_->send_reply(std::move(mp));
+    --c.inflight_;
+  }
+  else {
+    conn::done_reply &d = c.done_.at(seq - c.next_reply_);
+    d.done_ = true;
+    d.m_ = std::move(mp);
+    while (!c.done_.empty() && c.done_.front().done_) {
+      if (c.done_.front().m_)
+	c.ms_->send_reply(std::move(c.done_.front().m_));
+      c.done_.pop_front();
+      ++c.next_reply_;
+      --c.inflight_;
+    }
   }
+  if (c.inflight_ < max_inflight_ || !max_inflight_)
+    c.ms_->ms_->resume_read();
 }
 
 }
@@ -15,13 +15,16 @@
 #include <xdrpp/marshal.h>
 #include <xdrpp/printer.h>
 #include <xdrpp/msgsock.h>
+#include <xdrpp/reactor.h>
 #include <xdrpp/rpcbind.h>
 #include <xdrpp/rpc_msg.hh>
 #include <map>
+#include <unordered_map>
 
 namespace xdr {
 
 extern bool xdr_trace_server;
+class rpc_metrics;
 
 //! Structure that gets marshalled as an RPC success header.
 struct rpc_success_hdr {
@@ -48,7 +51,31 @@ template<> struct xdr_traits<rpc_success_hdr> : xdr_traits_base {
   }
 };
 
+namespace detail {
+//! An rpc_success_hdr already marshaled, with a zero xid.
+extern const uint32_t rpc_success_hdr_words[6];
+}
+
+//! Build a successful reply to call \c xid with result \c t.  This
+//! has the same output as <tt>xdr_to_msg(rpc_success_hdr(xid),
+//! t)</tt>, but copies the header from a preencoded template and
+//! marshals \c t straight into the space after it.
+template<typename T> msg_ptr
+rpc_success_msg(uint32_t xid, const T &t)
+{
+  constexpr std::size_t hdrsize = xdr_traits<rpc_success_hdr>::fixed_size;
+  msg_ptr m(message_t::alloc(hdrsize + xdr_size(t)));
+  std::memcpy(m->data(), detail::rpc_success_hdr_words, hdrsize);
+  xid = swap32le(xid);
+  std::memcpy(m->data(), &xid, sizeof xid);
+  xdr_put p(m->data() + hdrsize, m->end());
+  archive(p, t);
+  assert(p.p_ == p.e_);
+  return m;
+}
+
 // The following produce various pre-formatted error responses.
+// Each is copied from a preencoded template, patching in the xid.
 msg_ptr rpc_accepted_error_msg(uint32_t xid, accept_stat stat);
 msg_ptr rpc_prog_mismatch_msg(uint32_t xid, uint32_t low, uint32_t high);
 msg_ptr rpc_auth_error_msg(uint32_t xid, auth_stat stat);
@@ -171,6 +198,40 @@ dispatch_with_session(C &&c, S *s, T &&t, Rest &&...rest) ->
 	     std::forward<Rest>(rest)...);
 }
 
+//! Largest argument tuple that xdr::dispatch_arg_t will decode in
+//! place rather than boxing each argument on the heap.
+constexpr std::size_t dispatch_inline_arg_limit = 1024;
+
+namespace detail {
+template<typename P, typename C, typename S, typename...Rest>
+class dispatch_arg_helper {
+  using plain = typename P::arg_tuple_type;
+  template<typename T> static auto test(T *) -> decltype(
+    dispatch_with_session<P>(std::declval<C>(), std::declval<S *>(),
+			     std::declval<T>(), std::declval<Rest>()...),
+    std::true_type{});
+  template<typename T> static std::false_type test(...);
+public:
+  using type = typename std::conditional<
+    decltype(test<plain>(nullptr))::value
+      && sizeof(plain) <= dispatch_inline_arg_limit,
+    plain, wrap_transparent_ptr<plain>>::type;
+};
+}
+
+//! Type into which a service decodes the arguments of procedure \c
+//! P before passing them to <tt>dispatch_with_session<P>(c, s,
+//! std::move(args), rest...)</tt>.  If the method of \c c takes its
+//! arguments by reference or by value, this is just \c
+//! P::arg_tuple_type, so the arguments live wherever the service
+//! keeps the tuple (normally on the stack).  Only methods taking
+//! arguments as \c std::unique_ptr (or arguments bigger than
+//! xdr::dispatch_inline_arg_limit) need each argument allocated
+//! separately in an xdr::transparent_ptr.
+template<typename P, typename C, typename S, typename...Rest>
+using dispatch_arg_t =
+  typename detail::dispatch_arg_helper<P, C, S, Rest...>::type;
+
 
 //! Trivial session allocator that just calls new and delete.
 template<typename S> struct session_allocator {
@@ -184,16 +245,99 @@ template<> struct session_allocator<void> {
   void deallocate(void *) {}
 };
 
+//! Session allocator that carves sessions out of large chunks and
+//! recycles the slots of closed connections, so accepting a
+//! connection does not normally hit the general-purpose heap.  Each
+//! slot is padded to a multiple of the cache line size, so sessions
+//! of different connections never share a line.  Copies do not share
+//! state: every copy (for instance, the one each thread of an
+//! xdr::generic_rpc_tcp_sharded_listener gets) has a pool of its
+//! own.  Chunks are freed only when the allocator is destroyed, so
+//! it cannot be assigned to.
+template<typename S> class pooled_session_allocator {
+public:
+  static constexpr std::size_t cache_line = 64;
+
+private:
+  static constexpr std::size_t align_ =
+    alignof(S) > cache_line ? alignof(S) : cache_line;
+  static constexpr std::size_t slot_size_ =
+    (sizeof(S) + align_ - 1) & ~(align_ - 1);
+
+  struct pool {
+    const std::size_t per_chunk_;
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    std::vector<void *> free_;
+    std::size_t in_use_ {0};
+
+    pool(std::size_t per_chunk) : per_chunk_(per_chunk ? per_chunk : 1) {}
+    void *get() {
+      if (free_.empty()) {
+	chunks_.emplace_back(new char[per_chunk_ * slot_size_ + align_]);
+	std::uintptr_t base =
+	  reinterpret_cast<std::uintptr_t>(chunks_.back().get());
+	base = (base + align_ - 1) & ~std::uintptr_t(align_ - 1);
+	for (std::size_t i = per_chunk_; i-- > 0;)
+	  free_.push_back(reinterpret_cast<char *>(base) + i * slot_size_);
+      }
+      void *p = free_.back();
+      free_.pop_back();
+      ++in_use_;
+      return p;
+    }
+    void put(void *p) {
+      free_.push_back(p);
+      --in_use_;
+    }
+  };
+  std::unique_ptr<pool> pool_;
+
+public:
+  //! Slots are allocated \c per_chunk at a time.
+  explicit pooled_session_allocator(std::size_t per_chunk = 64)
+    : pool_(new pool(per_chunk)) {}
+  pooled_session_allocator(const pooled_session_allocator &other)
+    : pool_(new pool(other.pool_->per_chunk_)) {}
+  //! Takes over the pool of \c other, including any sessions
+  //! allocated from it, and leaves \c other an empty pool.
+  pooled_session_allocator(pooled_session_allocator &&other)
+    : pool_(std::move(other.pool_)) {
+    other.pool_.reset(new pool(pool_->per_chunk_));
+  }
+  // Assigning would free the chunks of sessions still in use.
+  pooled_session_allocator &
+  operator=(const pooled_session_allocator &) = delete;
+  pooled_session_allocator &operator=(pooled_session_allocator &&) = delete;
+
+  S *allocate(rpc_sock *s) {
+    void *p = pool_->get();
+    try { return new (p) S{s}; }
+    catch (...) { pool_->put(p); throw; }
+  }
+  void deallocate(S *session) {
+    session->~S();
+    pool_->put(session);
+  }
+
+  //! Number of sessions currently allocated.
+  std::size_t in_use() const { return pool_->in_use_; }
+  //! Number of sessions that fit in the chunks allocated so far.
+  std::size_t capacity() const {
+    return pool_->chunks_.size() * pool_->per_chunk_;
+  }
+};
+
 
 struct service_base {
-  using cb_t = std::function<void(msg_ptr)>;
+  using cb_t = unique_function<void(msg_ptr)>;
 
   const uint32_t prog_;
   const uint32_t vers_;
 
   service_base(uint32_t prog, uint32_t vers) : prog_(prog), vers_(vers) {}
   virtual ~service_base() {}
-  virtual void process(void *session, rpc_msg &hdr, xdr_get &g, cb_t reply) = 0;
+  virtual void process(void *session, rpc_msg &hdr, xdr_get &g,
+		       cb_t &&reply) = 0;
 
   bool check_call(const rpc_msg &hdr) {
     return hdr.body.mtype() == CALL
@@ -212,24 +356,116 @@ struct service_base {
       return false;
     }
   }
+
+  //! Entry point for one procedure of a service, bypassing \c
+  //! process.  The header has already been checked to be a call to
+  //! this service.
+  using thunk_t = void (*)(service_base *, void *session, rpc_msg &hdr,
+			   xdr_get &g, cb_t &&reply);
+  //! Procedure numbers and thunks, which rpc_server_base enters in
+  //! its dispatch table.  Services that leave this empty get all
+  //! their calls through \c process.
+  std::vector<std::pair<std::uint32_t, thunk_t>> procs_;
+
+protected:
+  //! Fill in \c procs_ with a thunk for each procedure \c P of \c
+  //! Interface that calls <tt>S::dispatch<P></tt>.  Does nothing for
+  //! interfaces generated without \c for_each_proc.
+  template<typename S, typename Session, typename Interface>
+  void add_procs() { add_procs1<S, Session, Interface>(0); }
+
+private:
+  template<typename S, typename Session, typename P> static void
+  thunk(service_base *s, void *session, rpc_msg &hdr, xdr_get &g,
+	cb_t &&reply) {
+    static_cast<S *>(s)->template dispatch<P>(
+      static_cast<Session *>(session), hdr, g, std::move(reply));
+  }
+  template<typename S, typename Session> struct proc_adder {
+    service_base *s_;
+    template<typename P> void proc() {
+      s_->procs_.emplace_back(std::uint32_t(P::proc), &thunk<S, Session, P>);
+    }
+  };
+  template<typename S, typename Session, typename Interface> auto
+  add_procs1(int) -> decltype(Interface::for_each_proc(
+				std::declval<proc_adder<S, Session>>())) {
+    Interface::for_each_proc(proc_adder<S, Session>{this});
+  }
+  template<typename S, typename Session, typename Interface>
+  void add_procs1(long) {}
 };
 
 class rpc_server_base {
   std::map<uint32_t,
 	   std::map<uint32_t, std::unique_ptr<service_base>>> servers_;
+
+  // Every procedure of every registered service, in an
+  // open-addressed hash table indexed by (prog, vers, proc), so most
+  // calls are dispatched with one probe and no virtual call.
+  struct proc_slot {
+    uint32_t prog_;
+    uint32_t vers_;
+    uint32_t proc_;
+    service_base *s_;
+    service_base::thunk_t thunk_; // nullptr in empty slots
+  };
+  std::vector<proc_slot> procs_;
+  rpc_metrics *metrics_ {nullptr};
+
+  static std::size_t proc_hash(uint32_t prog, uint32_t vers, uint32_t proc) {
+    std::uint64_t h = (std::uint64_t(prog) << 32 | vers)
+      * 0x9e3779b97f4a7c15ULL ^ proc * 0xc2b2ae3d27d4eb4fULL;
+    return h ^ h >> 32;
+  }
+  void rebuild_procs();
+  const proc_slot *find_proc(uint32_t prog, uint32_t vers,
+			     uint32_t proc) const;
+
 protected:
   void register_service_base(service_base *s);
 public:
+  rpc_server_base() : procs_(1) {}
   void dispatch(void *session, msg_ptr m, service_base::cb_t reply);
+  //! Count calls dispatched from now on in \c m (or stop counting if
+  //! \c m is \c nullptr).  Latency is measured from the time a call
+  //! is dispatched until its reply is handed back to the listener.
+  void set_metrics(rpc_metrics *m) { metrics_ = m; }
 };
 
 
 //! Listens for connections on a TCP socket (optionally registering
 //! the socket with \c rpcbind), and then serves one or more
 //! program/version interfaces to accepted connections.
+//!
+//! Calls are dispatched as they arrive, so a client may pipeline
+//! many calls on one connection, and asynchronous handlers may
+//! process them concurrently.  To keep one connection from tying up
+//! the server, rpc_tcp_listener_common::set_max_inflight limits the
+//! number of calls per connection that have not yet been replied to;
+//! at the limit, the listener stops reading from that connection.
 class rpc_tcp_listener_common : public rpc_server_base {
+  struct conn;
+  class conn_reply;
+
+  io_op *accept_op_ {nullptr};	// Multishot accept with engine::Uring
+  bool accept_poll_ {false};	// Accepting from a pollset callback
+  bool accept_paused_ {false};	// At the connection limit
+  std::unordered_map<conn *, std::shared_ptr<conn>> conns_;
+  unsigned max_inflight_ {0};
+  std::size_t max_conns_ {0};
+  unsigned accept_batch_ {64};
+  bool ordered_ {false};
+
+  void accept_start();
+  void accept_stop();
+  void accept_poll();
   void accept_cb();
-  void receive_cb(rpc_sock *ms, void *session, msg_ptr mp);
+  void accept_done(int res, bool more);
+  void accepted(sock_t s);
+  void receive_cb(conn *c, msg_ptr mp);
+  void reply_done(conn &c, std::uint64_t seq, msg_ptr mp);
+  void close_conn(conn *c);
 
 protected:
   unique_sock listen_sock_;
@@ -241,9 +477,34 @@ protected:
   virtual ~rpc_tcp_listener_common();
   virtual void *session_alloc(rpc_sock *) = 0;
   virtual void session_free(void *session) = 0;
+  //! Close all connections accepted by the listener.  Must be called
+  //! from the destructor of the class implementing \c session_free.
+  void close_all();
 
 public:
   pollset &ps_;
+
+  //! Stop reading from a connection while \c n of its calls are
+  //! awaiting replies (0, the default, means no limit).
+  void set_max_inflight(unsigned n) { max_inflight_ = n; }
+  //! If \c true, send replies in the order calls arrived on each
+  //! connection, holding back replies to later calls that complete
+  //! early.  The default is to send each reply as soon as it is ready.
+  //! Affects only connections accepted afterwards.
+  void set_ordered_replies(bool ordered) { ordered_ = ordered; }
+  //! Stop accepting connections while \c n are open (0, the default,
+  //! means no limit).  Further clients wait in the listen queue (see
+  //! xdr::tcp_listen) until a connection closes.  Setting a limit
+  //! turns off multishot accept with io_uring, which cannot be paused
+  //! without dropping connections.
+  void set_max_connections(std::size_t n);
+  //! Accept at most \c n connections each time the listening socket
+  //! becomes readable, before returning to the event loop (default
+  //! 64).  Has no effect when the pollset uses multishot accept with
+  //! io_uring, as the kernel then delivers every connection anyway.
+  void set_accept_batch(unsigned n) { accept_batch_ = n ? n : 1; }
+  //! Number of connections currently open.
+  std::size_t connections() const { return conns_.size(); }
 };
 
 template<template<typename, typename, typename> class ServiceType,
@@ -254,7 +515,9 @@ protected:
   void *session_alloc(rpc_sock *s) override {
     return sa_.allocate(s);
   }
-  void session_free(void *session) override { sa_.deallocate(session); }
+  void session_free(void *session) override {
+    sa_.deallocate(static_cast<Session *>(session));
+  }
 public:
   //using rpc_tcp_listener_common::rpc_tcp_listener_common;
   generic_rpc_tcp_listener(pollset &ps)
@@ -262,7 +525,7 @@ public:
   generic_rpc_tcp_listener(pollset &ps, unique_sock &&s, bool use_rpcbind,
 			   SessionAllocator sa)
     : rpc_tcp_listener_common(ps, std::move(s), use_rpcbind), sa_(sa) {}
-  ~generic_rpc_tcp_listener() {}
+  ~generic_rpc_tcp_listener() { close_all(); }
 
   //! Add objects implementing RPC program interfaces to the server.
   template<typename T, typename Interface = typename T::rpc_interface_type>
@@ -274,6 +537,79 @@ public:
   }
 };
 
+//! One xdr::generic_rpc_tcp_listener per pollset of an xdr::reactor,
+//! all listening on the same port with \c SO_REUSEPORT so that the
+//! kernel spreads incoming connections across threads.  Each thread
+//! has its own copy of the session allocator, and never touches
+//! another thread's connections.  Registered service objects,
+//! however, are shared by all threads and so must be safe to call
+//! concurrently.  Create the listener and register services before
+//! reactor::start, and destroy it only after reactor::stop.
+template<template<typename, typename, typename> class ServiceType,
+	 typename Session, typename SessionAllocator>
+class generic_rpc_tcp_sharded_listener {
+  using listener_type =
+    generic_rpc_tcp_listener<ServiceType, Session, SessionAllocator>;
+  std::vector<std::unique_ptr<listener_type>> listeners_;
+  std::string port_;
+
+public:
+  //! Listen on \c service (by default, an arbitrary port chosen by
+  //! the kernel) on every pollset in \c r.
+  generic_rpc_tcp_sharded_listener(reactor &r, const char *service = "0",
+				   int family = AF_UNSPEC,
+				   SessionAllocator sa = SessionAllocator{},
+				   int backlog = SOMAXCONN) {
+    for (unsigned i = 0; i < r.size(); i++) {
+      unique_sock s = tcp_listen(i ? port_.c_str() : service, family,
+				 backlog, true);
+      if (!i)
+	port_ = sock_port(s.get());
+      listeners_.emplace_back(new listener_type(r.at(i), std::move(s),
+						false, sa));
+    }
+  }
+
+  //! The port number (as a string) on which the listeners accept
+  //! connections.
+  const std::string &port() const { return port_; }
+
+  //! Add objects implementing RPC program interfaces to the server.
+  template<typename T, typename Interface = typename T::rpc_interface_type>
+  void register_service(T &t) {
+    for (auto &l : listeners_)
+      l->template register_service<T, Interface>(t);
+  }
+
+  //! See rpc_tcp_listener_common::set_max_inflight.
+  void set_max_inflight(unsigned n) {
+    for (auto &l : listeners_)
+      l->set_max_inflight(n);
+  }
+  //! See rpc_tcp_listener_common::set_ordered_replies.
+  void set_ordered_replies(bool ordered) {
+    for (auto &l : listeners_)
+      l->set_ordered_replies(ordered);
+  }
+  //! Limit the connections of each thread.  See
+  //! rpc_tcp_listener_common::set_max_connections.
+  void set_max_connections(std::size_t n) {
+    for (auto &l : listeners_)
+      l->set_max_connections(n);
+  }
+  //! See rpc_server_base::set_metrics.  All threads can share one
+  //! xdr::rpc_metrics.
+  void set_metrics(rpc_metrics *m) {
+    for (auto &l : listeners_)
+      l->set_metrics(m);
+  }
+  //! See rpc_tcp_listener_common::set_accept_batch.
+  void set_accept_batch(unsigned n) {
+    for (auto &l : listeners_)
+      l->set_accept_batch(n);
+  }
+};
+
 
 } // namespace xdr
 
@@ -1,5 +1,7 @@
+#include <cerrno>
 #include <cstring>
 #include <string>
+#include <system_error>
 #include <xdrpp/socket.h>
 
 namespace xdr {
@@ -98,6 +100,18 @@ void get_numinfo(const sockaddr *sa, socklen_t salen,
     *serv = servbuf;
 }
 
+string
+sock_port(sock_t s)
+{
+  sockaddr_storage ss;
+  socklen_t sslen = sizeof(ss);
+  if (getsockname(s.fd_, reinterpret_cast<sockaddr *>(&ss), &sslen) == -1)
+    throw_sockerr("getsockname");
+  string port;
+  get_numinfo(reinterpret_cast<sockaddr *>(&ss), sslen, nullptr, &port);
+  return port;
+}
+
 unique_sock
 tcp_connect1(const addrinfo *ai, bool ndelay)
 {
@@ -130,7 +144,7 @@ tcp_connect(const char *host, const char *service, int family)
 }
 
 unique_sock
-tcp_listen(const char *service, int family, int backlog)
+tcp_listen(const char *service, int family, int backlog, bool reuseport)
 {
   addrinfo hints, *res;
   std::memset(&hints, 0, sizeof(hints));
@@ -149,6 +163,17 @@ tcp_listen(const char *service, int family, int backlog)
 			      ai->ai_protocol)));
   if (!s)
     throw_sockerr("socket");
+  if (reuseport) {
+#ifdef SO_REUSEPORT
+    int one = 1;
+    if (setsockopt(s.get().fd_, SOL_SOCKET, SO_REUSEPORT,
+		   reinterpret_cast<const char *>(&one), sizeof(one)) == -1)
+      throw_sockerr("SO_REUSEPORT");
+#else // !SO_REUSEPORT
+    throw std::system_error(ENOPROTOOPT, std::system_category(),
+			    "SO_REUSEPORT");
+#endif // !SO_REUSEPORT
+  }
   if (bind(s.get().fd_, ai->ai_addr, ai->ai_addrlen) == -1)
     throw_sockerr("bind");
   if (listen (s.get().fd_, backlog) == -1)
@@ -85,6 +85,12 @@ accept(sock_t s, sockaddr *addr, socklen_t *addrlen)
   return ::accept(s.fd(), addr, addrlen);
 }
 
+//! Accept a connection, returning a socket that already has the \c
+//! O_NONBLOCK and close-on-exec flags set (with a single \c accept4
+//! system call where available).  Returns xdr::invalid_sock on
+//! failure, with the error available from sock_errmsg.
+sock_t accept_nonblock(sock_t s);
+
 //! Create a socket (or pipe on unix, where both are file descriptors)
 //! that is connected to itself.
 void create_selfpipe(sock_t ss[2]);
@@ -115,6 +121,10 @@ unique_addrinfo get_addrinfo(const char *host,
 void get_numinfo(const sockaddr *sa, socklen_t salen,
 		 std::string *host, std::string *serv);
 
+//! Return the printable port number to which socket \c s is bound,
+//! e.g., to find the port the kernel picked for a listening socket.
+std::string sock_port(sock_t s);
+
 //! Self-closing socket.  Note that this socket will be closed as soon
 //! as it goes out of scope, hence it is important to see whether
 //! functions you pass it to take a "unique_sock &" or a "const
@@ -167,10 +177,16 @@ tcp_connect(const unique_addrinfo &ai)
 unique_sock tcp_connect(const char *host, const char *service,
 			int family = AF_UNSPEC);
 
-//! Create bind a listening TCP socket.
+//! Create bind a listening TCP socket.  \c backlog bounds the queue of
+//! connections the kernel completes before they are accepted; the
+//! default is the system maximum, so bursts of new connections are
+//! not dropped.  If \c reuseport is \c true,
+//! sets \c SO_REUSEPORT so that several sockets can listen on the
+//! same port (on Linux, the kernel spreads connections among them).
 unique_sock tcp_listen(const char *service = "0",
 		       int family = AF_UNSPEC,
-		       int backlog = 5);
+		       int backlog = SOMAXCONN,
+		       bool reuseport = false);
 
 }
 
@@ -83,6 +83,29 @@ set_close_on_exec(sock_t s)
     throw_sockerr("F_SETFD");
 }
 
+sock_t
+accept_nonblock(sock_t s)
+{
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+  return sock_t(::accept4(s.fd_, nullptr, nullptr,
+			  SOCK_NONBLOCK | SOCK_CLOEXEC));
+#else // !SOCK_NONBLOCK || !SOCK_CLOEXEC
+  int fd = ::accept(s.fd_, nullptr, nullptr);
+  if (fd == -1)
+    return invalid_sock;
+  int n;
+  if ((n = fcntl(fd, F_GETFL)) == -1
+      || fcntl(fd, F_SETFL, n | O_NONBLOCK) == -1
+      || (n = fcntl(fd, F_GETFD)) == -1
+      || fcntl(fd, F_SETFD, n | FD_CLOEXEC) == -1) {
+    int saved_errno = errno;
+    ::close(fd);
+    errno = saved_errno;
+    return invalid_sock;
+  }
+  return sock_t(fd);
+#endif // !SOCK_NONBLOCK || !SOCK_CLOEXEC
+}
 
 void
 create_selfpipe(sock_t ss[2])
@@ -108,6 +108,12 @@ set_close_on_exec(sock_t s)
   // Does windows even have exec?
 }
 
+sock_t
+accept_nonblock(sock_t s)
+{
+  UNIMPL();
+}
+
 void
 create_selfpipe(sock_t ss[2])
 {
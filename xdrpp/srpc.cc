@@ -1,7 +1,10 @@
 
+#include <atomic>
 #include <cerrno>
+#include <chrono>
 #include <cstring>
 #include <iostream>
+#include <unordered_map>
 #include <unistd.h>
 #include <xdrpp/exception.h>
 #include <xdrpp/srpc.h>
@@ -10,49 +13,179 @@ namespace xdr {
 
 bool xdr_trace_client = std::getenv("XDR_TRACE_CLIENT");
 
+// Read exactly len bytes, or throw
+static void
+read_fully(sock_t s, void *buf, std::size_t len, const char *what)
+{
+  char *p = static_cast<char *>(buf);
+  while (len > 0) {
+    ssize_t n = read(s, p, len);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      throw xdr_system_error(what);
+    }
+    if (n == 0)
+      throw xdr_bad_message_size(std::string(what) + ": premature EOF");
+    p += n;
+    len -= n;
+  }
+}
+
+// Write a whole iovec array, or throw
+static void
+write_iov(sock_t s, iovec *iov, int iovcnt, const char *what)
+{
+  while (iovcnt > 0) {
+    ssize_t n = writev(s, iov, iovcnt);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      throw xdr_system_error(what);
+    }
+    for (; iovcnt > 0 && std::size_t(n) >= iov->iov_len; ++iov, --iovcnt)
+      n -= iov->iov_len;
+    if (iovcnt > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+// Decode the length word that precedes a message
+static std::size_t
+message_len(std::uint32_t len, std::size_t maxmsglen, const char *what)
+{
+  len = swap32le(len);
+  if (!(len & 0x80000000))
+    throw xdr_bad_message_size(std::string(what)
+			       + ": message fragments unimplemented");
+  len &= 0x7fffffff;
+  if (len & 3)
+    throw xdr_bad_message_size(std::string(what)
+			       + ": received size not multiple of 4");
+  if (len > maxmsglen)
+    throw xdr_bad_message_size(std::string(what)
+			       + ": received size too big");
+  return len;
+}
+
 msg_ptr
 read_message(sock_t s)
 {
   std::uint32_t len;
-  ssize_t n = read(s, &len, 4);
-  if (n == -1)
-    throw xdr_system_error("xdr::read_message");
-  if (n < 4)
-    throw xdr_bad_message_size("read_message: premature EOF");
-  if (n & 3)
-    throw xdr_bad_message_size("read_message: received size not multiple of 4");
-  if (n >= 0x80000000)
-    throw xdr_bad_message_size("read_message: received size too big");
+  read_fully(s, &len, 4, "xdr::read_message");
+  msg_ptr m = message_t::alloc(message_len(len, 0x7fffffff,
+					   "xdr::read_message"));
+  read_fully(s, m->data(), m->size(), "xdr::read_message");
+  return m;
+}
 
-  len = swap32le(len);
-  if (len & 0x80000000)
-    len &= 0x7fffffff;
-  else
-    throw xdr_bad_message_size("read_message: message fragments unimplemented");
-
-  msg_ptr m = message_t::alloc(len);
-  n = read(s, m->data(), len);
-  if (n == -1)
-    throw xdr_system_error("xdr::read_message");
-  if (n != len)
-    throw xdr_bad_message_size("read_message: premature EOF");
+void
+write_message(sock_t s, const msg_ptr &m)
+{
+  iovec iov;
+  iov.iov_base = const_cast<char *>(m->raw_data());
+  iov.iov_len = m->raw_size();
+  write_iov(s, &iov, 1, "xdr::write_message");
+}
 
+constexpr std::size_t blocking_msg_sock::default_bufsize;
+
+// Ensure at least need bytes are buffered
+void
+blocking_msg_sock::fill(std::size_t need)
+{
+  if (!rbuf_)
+    rbuf_.reset(new char[bufsize_]);
+  if (rbeg_ == rend_)
+    rbeg_ = rend_ = 0;
+  else if (bufsize_ - rbeg_ < need) {
+    std::memmove(rbuf_.get(), rbuf_.get() + rbeg_, rend_ - rbeg_);
+    rend_ -= rbeg_;
+    rbeg_ = 0;
+  }
+  while (rend_ - rbeg_ < need) {
+    ssize_t n = read(s_, rbuf_.get() + rend_, bufsize_ - rend_);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      throw xdr_system_error("xdr::blocking_msg_sock::get");
+    }
+    if (n == 0)
+      throw xdr_bad_message_size("xdr::blocking_msg_sock::get: "
+				 "premature EOF");
+    rend_ += n;
+  }
+}
+
+// Read the rest of a message that did not fit in the buffer (which
+// is empty), reading ahead into the buffer at the same time.
+void
+blocking_msg_sock::read_body(message_t &m, std::size_t pos)
+{
+  rbeg_ = rend_ = 0;
+  while (pos < m.size()) {
+    iovec iov[2];
+    iov[0].iov_base = m.data() + pos;
+    iov[0].iov_len = m.size() - pos;
+    iov[1].iov_base = rbuf_.get();
+    iov[1].iov_len = bufsize_;
+    ssize_t n = readv(s_, iov, 2);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      throw xdr_system_error("xdr::blocking_msg_sock::get");
+    }
+    if (n == 0)
+      throw xdr_bad_message_size("xdr::blocking_msg_sock::get: "
+				 "premature EOF");
+    if (std::size_t(n) > iov[0].iov_len) {
+      rend_ = n - iov[0].iov_len;
+      n = iov[0].iov_len;
+    }
+    pos += n;
+  }
+}
+
+msg_ptr
+blocking_msg_sock::get()
+{
+  fill(4);
+  std::uint32_t len;
+  std::memcpy(&len, rbuf_.get() + rbeg_, 4);
+  msg_ptr m = message_t::alloc(message_len(len, maxmsglen_,
+					   "xdr::blocking_msg_sock::get"));
+  rbeg_ += 4;
+  if (m->size() <= bufsize_) {
+    fill(m->size());
+    std::memcpy(m->data(), rbuf_.get() + rbeg_, m->size());
+    rbeg_ += m->size();
+  }
+  else {
+    std::size_t n = rend_ - rbeg_;
+    std::memcpy(m->data(), rbuf_.get() + rbeg_, n);
+    read_body(*m, n);
+  }
   return m;
 }
 
 void
-write_message(sock_t s, const msg_ptr &m)
+blocking_msg_sock::put(const msg_ptr *m, std::size_t n)
 {
-  ssize_t n = write(s, m->raw_data(), m->raw_size());
-  if (n == -1)
-    throw xdr_system_error("xdr::write_message");
-  // If this assertion fails, the file descriptor may have had
-  // O_NONBLOCK set, which is not allowed for the synchronous
-  // interface.
-  assert(std::size_t(n) == m->raw_size());
+  while (n > 0) {
+    iovec iov[64];
+    int iovcnt = 0;
+    for (; n > 0 && iovcnt < 64; ++m, --n, ++iovcnt) {
+      iov[iovcnt].iov_base = const_cast<char *>((*m)->raw_data());
+      iov[iovcnt].iov_len = (*m)->raw_size();
+    }
+    write_iov(s_, iov, iovcnt, "xdr::blocking_msg_sock::put");
+  }
 }
 
-uint32_t xid_counter;
+// Synchronous clients may be used from several threads at once
+std::atomic<uint32_t> xid_counter;
 
 void
 prepare_call(uint32_t prog, uint32_t vers, uint32_t proc, rpc_msg &hdr)
@@ -65,12 +198,195 @@ prepare_call(uint32_t prog, uint32_t vers, uint32_t proc, rpc_msg &hdr)
   hdr.body.cbody().proc = proc;
 }
 
+constexpr std::size_t srpc_batch::default_window;
+
+void
+srpc_batch::run()
+{
+  std::vector<queued_call> queue;
+  queue.swap(queue_);
+  std::unordered_map<uint32_t, std::shared_ptr<call_state>> pending;
+  std::size_t next = 0;
+  std::vector<msg_ptr> msgs;
+
+  try {
+    while (next < queue.size() || !pending.empty()) {
+      // Top up the window with a single writev
+      std::size_t first = next;
+      while (next < queue.size() && pending.size() < window_) {
+	queued_call &c = queue[next++];
+	pending.emplace(c.state_->xid_, c.state_);
+      }
+      if (next > first) {
+	msgs.clear();
+	for (; first < next; ++first)
+	  msgs.push_back(std::move(queue[first].m_));
+	s_.put(msgs.data(), msgs.size());
+      }
+
+      msg_ptr m = s_.get();
+      xdr_get g(m);
+      rpc_msg hdr;
+      archive(g, hdr);
+      auto i = pending.find(hdr.xid);
+      if (i == pending.end())
+	throw xdr_runtime_error("srpc_batch: unexpected xid");
+      std::shared_ptr<call_state> st = std::move(i->second);
+      pending.erase(i);
+      try {
+	st->decode(hdr, g);
+	st->done_ = true;
+      }
+      catch (const xdr_runtime_error &) {
+	st->err_ = std::current_exception();
+      }
+    }
+  }
+  catch (...) {
+    std::exception_ptr e = std::current_exception();
+    for (auto &p : pending)
+      p.second->err_ = e;
+    for (; next < queue.size(); ++next)
+      queue[next].state_->err_ = e;
+    throw;
+  }
+}
+
 void
 srpc_server::run()
 {
   for (;;)
-    dispatch(nullptr, read_message(s_),
-	     std::bind(write_message, s_, std::placeholders::_1));
+    dispatch(nullptr, s_.get(), [this](msg_ptr m) { if (m) s_.put(m); });
+}
+
+unsigned
+srpc_threaded_listener::default_threads()
+{
+  unsigned n = std::thread::hardware_concurrency();
+  return n ? n : 1;
+}
+
+srpc_threaded_listener::srpc_threaded_listener(unique_sock &&s,
+					       unsigned nthreads,
+					       bool use_rpcbind)
+  : listen_sock_(s ? std::move(s) : tcp_listen()), use_rpcbind_(use_rpcbind),
+    nthreads_(nthreads ? nthreads : 1)
+{
+  // So that accept_loop cannot block in accept if a client resets
+  // its connection after poll reports it
+  set_nonblock(listen_sock_.get());
+  create_selfpipe(wake_);
+}
+
+srpc_threaded_listener::~srpc_threaded_listener()
+{
+  stop();
+  close(wake_[0]);
+  close(wake_[1]);
+}
+
+void
+srpc_threaded_listener::start()
+{
+  assert(!acceptor_.joinable());
+  stopping_ = false;
+  for (unsigned i = 0; i < nthreads_; i++)
+    workers_.emplace_back(&srpc_threaded_listener::worker, this);
+  acceptor_ = std::thread(&srpc_threaded_listener::accept_loop, this);
+}
+
+void
+srpc_threaded_listener::stop()
+{
+  if (!acceptor_.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    stopping_ = true;
+    // Workers notice EOF once their current call is done
+    for (sock_t s : serving_)
+      shutdown(s.fd_, SHUT_RDWR);
+  }
+  cv_.notify_all();
+  char c = 0;
+  write(wake_[1], &c, 1);
+  acceptor_.join();
+  for (std::thread &t : workers_)
+    t.join();
+  workers_.clear();
+  accepted_.clear();
+  // Drain the wakeup byte, so the listener can be restarted
+  read(wake_[0], &c, 1);
+}
+
+void
+srpc_threaded_listener::accept_loop()
+{
+  pollfd pfd[2];
+  pfd[0].fd = listen_sock_.get().fd_;
+  pfd[1].fd = wake_[0].fd_;
+  pfd[0].events = pfd[1].events = POLLIN;
+  for (;;) {
+    if (::poll(pfd, 2, -1) == -1) {
+      if (errno == EINTR)
+	continue;
+      std::cerr << "srpc_threaded_listener: poll: " << sock_errmsg()
+		<< std::endl;
+      std::terminate();
+    }
+    if (pfd[1].revents)
+      return;
+    if (!pfd[0].revents)
+      continue;
+    unique_sock s(accept(listen_sock_.get(), nullptr, 0));
+    if (!s) {
+      if (!sock_eagain() && errno != EINTR && errno != ECONNABORTED) {
+	std::cerr << "srpc_threaded_listener: accept: " << sock_errmsg()
+		  << std::endl;
+	// Probably out of file descriptors; give clients a chance to
+	// disconnect rather than spinning
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+      continue;
+    }
+    set_close_on_exec(s.get());
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      accepted_.push_back(std::move(s));
+    }
+    cv_.notify_one();
+  }
+}
+
+void
+srpc_threaded_listener::worker()
+{
+  std::unique_lock<std::mutex> lk(mu_);
+  for (;;) {
+    cv_.wait(lk, [this]() { return stopping_ || !accepted_.empty(); });
+    if (stopping_)
+      return;
+    unique_sock s = std::move(accepted_.front());
+    accepted_.pop_front();
+    serving_.push_back(s.get());
+    lk.unlock();
+    serve(s.get());
+    lk.lock();
+    serving_.erase(std::find(serving_.begin(), serving_.end(), s.get()));
+  }
+}
+
+void
+srpc_threaded_listener::serve(sock_t s)
+{
+  blocking_msg_sock ms(s);
+  try {
+    for (;;)
+      dispatch(nullptr, ms.get(), [&ms](msg_ptr m) { if (m) ms.put(m); });
+  }
+  catch (const xdr_runtime_error &) {
+    // Client disconnected or sent garbage
+  }
 }
 
 }
@@ -5,16 +5,73 @@
 
 //! \file srpc.h Simple synchronous RPC functions.
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <xdrpp/exception.h>
 #include <xdrpp/server.h>
+#include <xdrpp/trace.h>
 
 namespace xdr {
 
 extern bool xdr_trace_client;
 
+//! Read one message from a blocking stream socket.  Unbuffered, so
+//! it takes at least two system calls; see xdr::blocking_msg_sock.
 msg_ptr read_message(sock_t s);
+//! Write one message to a blocking stream socket.
 void write_message(sock_t s, const msg_ptr &m);
 
+//! Delimited messages over a blocking stream socket, as used by
+//! synchronous clients and servers.  Reads ahead into a buffer that
+//! is reused from message to message, so that a burst of small
+//! messages costs one \c read rather than two per message, and loops
+//! on partial reads and writes.  A message too big for the buffer is
+//! read directly into its own storage.  Does not close the socket.
+//!
+//! Since only data that has already arrived is read ahead, several
+//! objects can share a socket so long as they take turns and each
+//! reads only replies to its own calls.
+class blocking_msg_sock {
+  const sock_t s_;
+  const std::size_t maxmsglen_;
+  const std::size_t bufsize_;
+  std::unique_ptr<char[]> rbuf_;
+  std::size_t rbeg_ {0};
+  std::size_t rend_ {0};
+
+  void fill(std::size_t need);
+  void read_body(message_t &m, std::size_t pos);
+
+public:
+  static constexpr std::size_t default_bufsize = 0x4000;
+
+  explicit blocking_msg_sock(sock_t s,
+			     std::size_t maxmsglen = msg_sock::default_maxmsglen,
+			     std::size_t bufsize = default_bufsize)
+    : s_(s), maxmsglen_(maxmsglen),
+      bufsize_(std::max<std::size_t>(bufsize, 4)) {}
+  blocking_msg_sock(const blocking_msg_sock &) = delete;
+  blocking_msg_sock &operator=(const blocking_msg_sock &) = delete;
+
+  sock_t get_sock() const { return s_; }
+  //! Bytes received but not yet returned by blocking_msg_sock::get.
+  std::size_t buffered() const { return rend_ - rbeg_; }
+
+  //! Read the next message.  \throws xdr_bad_message_size on EOF or
+  //! a malformed or oversized length, and xdr_system_error if the
+  //! read fails.
+  msg_ptr get();
+  //! Write a message.  \throws xdr_system_error if the write fails.
+  void put(const msg_ptr &m) { put(&m, 1); }
+  //! Write \c n messages with as few system calls as possible.
+  void put(const msg_ptr *m, std::size_t n);
+};
+
 void prepare_call(uint32_t prog, uint32_t vers, uint32_t proc, rpc_msg &hdr);
 template<typename P> inline void
 prepare_call(rpc_msg &hdr)
@@ -24,62 +81,194 @@ prepare_call(rpc_msg &hdr)
 }
 
 
-//! Synchronous file descriptor demultiplexer.
-class synchronous_client_base {
-  const sock_t s_;
+namespace detail {
+//! What a synchronous call to procedure \c P returns.
+template<typename P> using srpc_result_t = typename std::conditional<
+  std::is_void<typename P::res_type>::value, void,
+  std::unique_ptr<typename P::res_type>>::type;
 
-  static void moveret(pointer<xdr_void> &) {}
-  template<typename T> static T &&moveret(T &t) { return std::move(t); }
+inline void srpc_moveret(pointer<xdr_void> &) {}
+template<typename T> inline T &&srpc_moveret(T &t) { return std::move(t); }
 
-  //static xdr_void arg_tuple() { return xdr_void{}; }
-  template<typename T> const T &arg_tuple(const T &t) { return t; }
-  template<typename...T> std::tuple<const T &...> arg_tuple(const T &...t) {
-    return std::make_tuple(std::cref(t)...);
+//! Marshal a call to procedure \c P, setting \c xid to its xid.
+template<typename P, typename...A> msg_ptr
+srpc_encode_call(uint32_t &xid, const A &...a)
+{
+  rpc_msg hdr;
+  prepare_call<P>(hdr);
+  xid = hdr.xid;
+
+  if (xdr_trace_client) {
+    std::string s = "CALL ";
+    s += P::proc_name();
+    s += " -> [xid " + std::to_string(xid) + "]";
+    std::clog << xdr_to_string(std::tie(a...), s.c_str());
+  }
+  return xdr_to_msg(hdr, a...);
+}
+
+//! Unmarshal the result of procedure \c P following the already
+//! decoded reply header \c hdr.  \throws xdr_call_error if the server
+//! did not execute the call.
+template<typename P> void
+srpc_decode_reply(const rpc_msg &hdr, xdr_get &g,
+		  pointer<typename P::res_wire_type> &r)
+{
+  check_call_hdr(hdr);
+  archive(g, r.activate());
+  g.done();
+  if (xdr_trace_client) {
+    std::string s = "REPLY ";
+    s += P::proc_name();
+    s += " <- [xid " + std::to_string(hdr.xid) + "]";
+    std::clog << xdr_to_string(*r, s.c_str());
   }
+}
+} // namespace detail
+
+//! Synchronous file descriptor demultiplexer.
+class synchronous_client_base {
+  blocking_msg_sock s_;
 
 public:
   synchronous_client_base(sock_t s) : s_(s) {}
-  synchronous_client_base(const synchronous_client_base &c) : s_(c.s_) {}
+  synchronous_client_base(const synchronous_client_base &c)
+    : s_(c.s_.get_sock()) {}
 
-  template<typename P, typename...A> typename std::conditional<
-    std::is_void<typename P::res_type>::value, void,
-    std::unique_ptr<typename P::res_type>>::type
+  template<typename P, typename...A> detail::srpc_result_t<P>
   invoke(const A &...a) {
-    rpc_msg hdr;
-    prepare_call<P>(hdr);
-    uint32_t xid = hdr.xid;
-
-    if (xdr_trace_client) {
-      std::string s = "CALL ";
-      s += P::proc_name();
-      s += " -> [xid " + std::to_string(xid) + "]";
-      std::clog << xdr_to_string(std::tie(a...), s.c_str());
-    }
-    write_message(s_, xdr_to_msg(hdr, a...));
-    msg_ptr m = read_message(s_);
+    uint32_t xid;
+    msg_ptr call = detail::srpc_encode_call<P>(xid, a...);
+    trace_writer *tw = xdr_trace_writer;
+    if (tw && !tw->sample())
+      tw = nullptr;
+    if (tw)
+      tw->record(TRACE_CALL_OUT, xid, P::interface_type::program,
+		 P::interface_type::version, P::proc, call);
+    s_.put(call);
+    msg_ptr m = s_.get();
+    if (tw)
+      tw->record(TRACE_REPLY_IN, xid, P::interface_type::program,
+		 P::interface_type::version, P::proc, m);
 
     xdr_get g(m);
+    rpc_msg hdr;
     archive(g, hdr);
-    check_call_hdr(hdr);
     if (hdr.xid != xid)
       throw xdr_runtime_error("synchronous_client: unexpected xid");
 
     pointer<typename P::res_wire_type> r;
-    archive(g, r.activate());
-    g.done();
-    if (xdr_trace_client) {
-      std::string s = "REPLY ";
-      s += P::proc_name();
-      s += " <- [xid " + std::to_string(xid) + "]";
-      std::clog << xdr_to_string(*r, s.c_str());
-    }
-    return moveret(r);
+    detail::srpc_decode_reply<P>(hdr, g, r);
+    return detail::srpc_moveret(r);
   }
 
   // because _xdr_client expects a pointer type
   synchronous_client_base *operator->() { return this; }
 };
 
+//! A batch of synchronous calls over a connected stream socket.
+//! Rather than paying a round trip per call, srpc_batch::run writes
+//! calls back to back and matches up the replies by xid as they
+//! arrive, keeping up to \c window calls outstanding.  Calls are
+//! usually added through an xdr::srpc_batch_client, whose methods
+//! return an srpc_batch::reply instead of the result:
+//!
+//! \code
+//!    srpc_batch b{fd.get()};
+//!    srpc_batch_client<MyProg1> c{b};
+//!    std::vector<srpc_batch::reply<MyProg1::hello_t>> rs;
+//!    for (int i = 0; i < 1000; i++)
+//!      rs.push_back(c.hello(i));
+//!    b.run();
+//!    for (auto &r : rs)
+//!      unique_ptr<big_string> result = r.get();
+//! \endcode
+//!
+//! The server must keep reading calls while it has replies to send
+//! (as all the servers in this library do), and the window should
+//! be small enough that \c window calls or replies fit in the
+//! socket buffers; otherwise both sides can block writing.
+class srpc_batch {
+  struct call_state {
+    uint32_t xid_;
+    bool done_ {false};
+    std::exception_ptr err_;
+    virtual ~call_state() {}
+    virtual void decode(const rpc_msg &hdr, xdr_get &g) = 0;
+  };
+  template<typename P> struct typed_state : call_state {
+    pointer<typename P::res_wire_type> r_;
+    void decode(const rpc_msg &hdr, xdr_get &g) override {
+      detail::srpc_decode_reply<P>(hdr, g, r_);
+    }
+  };
+  struct queued_call {
+    msg_ptr m_;
+    std::shared_ptr<call_state> state_;
+  };
+
+  blocking_msg_sock s_;
+  const std::size_t window_;
+  std::vector<queued_call> queue_;
+
+public:
+  static constexpr std::size_t default_window = 64;
+
+  //! The eventual result of one call in a batch.
+  template<typename P> class reply {
+    std::shared_ptr<typed_state<P>> state_;
+    friend class srpc_batch;
+    reply(std::shared_ptr<typed_state<P>> s) : state_(std::move(s)) {}
+  public:
+    //! Returns what synchronous_client_base::invoke would have.  May
+    //! be called once, after srpc_batch::run.  \throws
+    //! xdr_call_error if the server rejected the call, or whatever
+    //! exception prevented run from receiving the reply.
+    detail::srpc_result_t<P> get() {
+      if (state_->err_)
+	std::rethrow_exception(state_->err_);
+      if (!state_->done_)
+	throw xdr_runtime_error("srpc_batch::reply: call has not completed");
+      return detail::srpc_moveret(state_->r_);
+    }
+  };
+
+  srpc_batch(sock_t s, std::size_t window = default_window)
+    : s_(s), window_(window ? window : 1) {}
+
+  //! Queue a call to procedure \c P.  Nothing is sent until
+  //! srpc_batch::run.
+  template<typename P, typename...A> reply<P> add(const A &...a) {
+    std::shared_ptr<typed_state<P>> st = std::make_shared<typed_state<P>>();
+    queue_.push_back(queued_call{
+	detail::srpc_encode_call<P>(st->xid_, a...), st});
+    return reply<P>(std::move(st));
+  }
+
+  //! Number of calls queued.
+  std::size_t size() const { return queue_.size(); }
+
+  //! Send all queued calls and wait for their replies.  A call the
+  //! server rejects only affects that call's reply.  Errors on the
+  //! socket are thrown (and also reported by every reply still
+  //! outstanding).
+  void run();
+};
+
+//! Invoker for xdr::srpc_batch_client.
+class batch_client_base {
+  srpc_batch &b_;
+
+public:
+  batch_client_base(srpc_batch &b) : b_(b) {}
+  batch_client_base(const batch_client_base &c) : b_(c.b_) {}
+
+  template<typename P, typename...A> srpc_batch::reply<P>
+  invoke(const A &...a) { return b_.template add<P>(a...); }
+
+  batch_client_base *operator->() { return this; }
+};
+
 //! Create an RPC client from an interface type and connected stream
 //! socket.  Note that the file descriptor is not closed afterwards
 //! (as you may wish to use different interfaces over the same file
@@ -94,21 +283,41 @@ public:
 template<typename T> using srpc_client =
   typename T::template _xdr_client<synchronous_client_base>;
 
+//! Client whose methods queue calls in an xdr::srpc_batch.
+template<typename T> using srpc_batch_client =
+  typename T::template _xdr_client<batch_client_base>;
+
+
+namespace detail {
+//! Result of a synchronous method, which may return it either by
+//! value or as a \c std::unique_ptr.
+template<typename R> inline const R &
+srpc_result_ref(const R &r)
+{
+  return r;
+}
+template<typename R> inline const R &
+srpc_result_ref(const std::unique_ptr<R> &r)
+{
+  return *r;
+}
+}
 
 template<typename T, typename Session, typename Interface>
 class srpc_service : public service_base {
   template<typename P, typename A> typename
   std::enable_if<std::is_same<void, typename P::res_type>::value,
-		 const xdr_void *>::type
+		 xdr_void>::type
   dispatch1(Session *s, A &a) {
-    static xdr_void v;
     dispatch_with_session<P>(server_, s, std::move(a));
-    return &v;
+    return xdr_void{};
   }
-  template<typename P, typename A> typename
-  std::enable_if<!std::is_same<void, typename P::res_type>::value,
-		 std::unique_ptr<typename P::res_type>>::type
-  dispatch1(Session *s, A &a) {
+  // Methods may return the result either by value or in a unique_ptr
+  template<typename P, typename A> auto
+  dispatch1(Session *s, A &a) -> typename std::enable_if<
+    !std::is_same<void, typename P::res_type>::value,
+    decltype(dispatch_with_session<P>(std::declval<T &>(), s,
+				      std::move(a)))>::type {
     return dispatch_with_session<P>(server_, s, std::move(a));
   }
 
@@ -116,11 +325,14 @@ public:
   T &server_;
 
   srpc_service(T &server)
-    : service_base(Interface::program, Interface::version), server_(server) {}
+    : service_base(Interface::program, Interface::version), server_(server) {
+    add_procs<srpc_service, Session, Interface>();
+  }
 
-  void process(void *session, rpc_msg &hdr, xdr_get &g, cb_t reply) override {
+  void process(void *session, rpc_msg &hdr, xdr_get &g,
+	       cb_t &&reply) override {
     if (!check_call(hdr))
-      reply(nullptr);
+      return reply(nullptr);
     if (!Interface::call_dispatch(*this, hdr.body.cbody().proc,
 				  static_cast<Session *>(session),
 				  hdr, g, std::move(reply)))
@@ -128,8 +340,8 @@ public:
   }
 
   template<typename P>
-  void dispatch(Session *session, rpc_msg &hdr, xdr_get &g, cb_t reply) {
-    wrap_transparent_ptr<typename P::arg_tuple_type> arg;
+  void dispatch(Session *session, rpc_msg &hdr, xdr_get &g, cb_t &&reply) {
+    dispatch_arg_t<P, T &, Session> arg;
     if (!decode_arg(g, arg))
       return reply(rpc_accepted_error_msg(hdr.xid, GARBAGE_ARGS));
     
@@ -140,16 +352,17 @@ public:
       std::clog << xdr_to_string(arg, s.c_str());
     }
 
-    auto res = this->template dispatch1<P>(session, arg);
+    auto &&ret = this->template dispatch1<P>(session, arg);
+    const auto &res = detail::srpc_result_ref(ret);
 
     if (xdr_trace_server) {
       std::string s = "REPLY ";
       s += P::proc_name();
       s += " -> [xid " + std::to_string(hdr.xid) + "]";
-      std::clog << xdr_to_string(*res, s.c_str());
+      std::clog << xdr_to_string(res, s.c_str());
     }
 
-    reply(xdr_to_msg(rpc_success_hdr(hdr.xid), *res));
+    reply(rpc_success_msg(hdr.xid, res));
   }
 };
 
@@ -157,13 +370,13 @@ public:
 //! procedures will be implemented by the RPC server until interface
 //! objects are reigstered with \c register_server.
 class srpc_server : public rpc_server_base {
-  const sock_t s_;
+  blocking_msg_sock s_;
   bool close_on_destruction_;
 
 public:
   srpc_server(sock_t s, bool close_on_destruction = true)
     : s_(s), close_on_destruction_(close_on_destruction) {}
-  ~srpc_server() { if (close_on_destruction_) close(s_); }
+  ~srpc_server() { if (close_on_destruction_) close(s_.get_sock()); }
 
   //! Add objects implementing RPC program interfaces to the server.
   template<typename T, typename Interface = typename T::rpc_interface_type>
@@ -175,11 +388,73 @@ public:
   void run();
 };
 
+//! Serves srpc interfaces on a TCP socket with blocking I/O and a
+//! fixed pool of threads.  Each accepted connection is served by one
+//! worker thread at a time, which reads calls, runs their (ordinary,
+//! synchronous) handlers, and writes replies until the client
+//! disconnects.  Connections accepted while every worker is busy wait
+//! for one to finish, so the pool should be at least as large as the
+//! number of clients expected to stay connected at once.  Handlers
+//! run concurrently in different threads, so registered service
+//! objects must be thread-safe.
+//!
+//! Register services before srpc_threaded_listener::start.
+class srpc_threaded_listener : public rpc_server_base {
+  unique_sock listen_sock_;
+  const bool use_rpcbind_;
+  const unsigned nthreads_;
+  sock_t wake_[2] {invalid_sock, invalid_sock};
+  std::thread acceptor_;
+  std::vector<std::thread> workers_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool stopping_ {false};
+  std::deque<unique_sock> accepted_;	// Waiting for a worker
+  std::vector<sock_t> serving_;		// Being served by workers
+
+  void accept_loop();
+  void worker();
+  void serve(sock_t s);
+
+public:
+  //! Number of worker threads used by default.
+  static unsigned default_threads();
+
+  srpc_threaded_listener(unique_sock &&s,
+			 unsigned nthreads = default_threads(),
+			 bool use_rpcbind = false);
+  //! Calls srpc_threaded_listener::stop.
+  ~srpc_threaded_listener();
+  srpc_threaded_listener(const srpc_threaded_listener &) = delete;
+  srpc_threaded_listener &operator=(const srpc_threaded_listener &) = delete;
+
+  //! Add objects implementing RPC program interfaces to the server.
+  template<typename T, typename Interface = typename T::rpc_interface_type>
+  void register_service(T &t) {
+    register_service_base(new srpc_service<T, void, Interface>(t));
+    if (use_rpcbind_)
+      rpcbind_register(listen_sock_.get(), Interface::program,
+		       Interface::version);
+  }
+
+  //! Start accepting connections.
+  void start();
+  //! Stop accepting connections, disconnect clients (after the calls
+  //! being executed finish), and wait for all threads to exit.
+  void stop();
+};
+
 template<typename Session = void,
 	 typename SessionAllocator = session_allocator<Session>>
 using srpc_tcp_listener =
   generic_rpc_tcp_listener<srpc_service, Session, SessionAllocator>;
 
+template<typename Session = void,
+	 typename SessionAllocator = session_allocator<Session>>
+using srpc_tcp_sharded_listener =
+  generic_rpc_tcp_sharded_listener<srpc_service, Session, SessionAllocator>;
+
 }
 
 #endif // !_XDRPP_SRPC_H_HEADER_INCLUDED_
@@ -0,0 +1,254 @@
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <xdrpp/marshal.h>
+#include <xdrpp/trace.h>
+
+namespace xdr {
+
+constexpr char trace_writer::magic[8];
+
+namespace {
+
+std::uint64_t
+wall_ns()
+{
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(
+    system_clock::now().time_since_epoch()).count();
+}
+
+// Size of a trace_record up to and including the length of msg
+constexpr std::size_t record_hdr_size = 32;
+
+std::unique_ptr<trace_writer>
+trace_writer_from_env()
+{
+  const char *path = std::getenv("XDR_TRACE_FILE");
+  if (!path || !*path)
+    return nullptr;
+  unsigned sample = 1;
+  if (const char *s = std::getenv("XDR_TRACE_SAMPLE"))
+    sample = std::strtoul(s, nullptr, 10);
+  return std::unique_ptr<trace_writer>(new trace_writer(path, sample));
+}
+
+std::unique_ptr<trace_writer> env_trace_writer = trace_writer_from_env();
+
+// Wraps a server's reply callback, or (with an extra error argument)
+// a client's call callback.
+template<typename...E> class traced_reply {
+  trace_writer *tw_;
+  trace_kind kind_;
+  std::uint32_t xid_, prog_, vers_, proc_;
+  unique_function<void(msg_ptr, E...)> cb_;
+
+public:
+  traced_reply(trace_writer *tw, trace_kind kind, std::uint32_t xid,
+	       std::uint32_t prog, std::uint32_t vers, std::uint32_t proc,
+	       unique_function<void(msg_ptr, E...)> &&cb)
+    : tw_(tw), kind_(kind), xid_(xid), prog_(prog), vers_(vers),
+      proc_(proc), cb_(std::move(cb)) {}
+  traced_reply(traced_reply &&) = default;
+  ~traced_reply() {
+    if (cb_)
+      tw_->record(kind_, xid_, prog_, vers_, proc_, nullptr);
+  }
+
+  void operator()(msg_ptr m, E...e) {
+    tw_->record(kind_, xid_, prog_, vers_, proc_, m);
+    unique_function<void(msg_ptr, E...)> cb {std::move(cb_)};
+    cb(std::move(m), e...);
+  }
+};
+
+} // namespace
+
+trace_writer *xdr_trace_writer = env_trace_writer.get();
+
+trace_writer::trace_writer(const std::string &path, unsigned sample,
+			   std::size_t bufsize, unsigned flush_ms)
+  : out_(path, std::ios::binary | std::ios::trunc), sample_(sample),
+    bufsize_(bufsize), flush_ms_(flush_ms), buf_(new char[bufsize]),
+    spare_(new char[bufsize])
+{
+  if (!out_)
+    throw std::system_error(errno, std::system_category(), path);
+  out_.write(magic, sizeof magic);
+  thread_ = std::thread(&trace_writer::run, this);
+}
+
+trace_writer::~trace_writer()
+{
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    stop_ = true;
+  }
+  cv_.notify_one();
+  thread_.join();
+}
+
+void
+trace_writer::run()
+{
+  std::unique_lock<std::mutex> lk(mu_);
+  for (;;) {
+    cv_.wait_for(lk, std::chrono::milliseconds(flush_ms_), [this]() {
+	return stop_ || flush_req_ != flush_done_ || used_ >= bufsize_ / 2;
+      });
+    std::uint64_t req = flush_req_;
+    bool stop = stop_;
+    std::size_t n = used_;
+    used_ = 0;
+    buf_.swap(spare_);
+
+    lk.unlock();
+    if (n) {
+      out_.write(spare_.get(), n);
+      if (req != flush_done_ || stop)
+	out_.flush();
+    }
+    lk.lock();
+
+    flush_done_ = req;
+    flushed_cv_.notify_all();
+    if (stop)
+      break;
+  }
+  out_.flush();
+}
+
+void
+trace_writer::record(trace_kind kind, std::uint32_t xid, std::uint32_t prog,
+		     std::uint32_t vers, std::uint32_t proc, const msg_ptr &m)
+{
+  std::uint32_t len = m ? m->size() : 0;
+  std::size_t size = record_hdr_size + ((len + 3) & ~std::size_t(3));
+  std::uint64_t now = wall_ns();
+
+  std::lock_guard<std::mutex> lk(mu_);
+  if (bufsize_ - used_ < size) {
+    ++dropped_;
+    return;
+  }
+  char *p = buf_.get() + used_;
+  xdr_put put(p, p + record_hdr_size);
+  archive(put, now);
+  archive(put, kind);
+  archive(put, xid);
+  archive(put, prog);
+  archive(put, vers);
+  archive(put, proc);
+  archive(put, len);
+  if (len) {
+    std::memcpy(p + record_hdr_size, m->data(), len);
+    std::memset(p + record_hdr_size + len, 0, size - record_hdr_size - len);
+  }
+  if ((used_ += size) >= bufsize_ / 2)
+    cv_.notify_one();
+}
+
+unique_function<void(msg_ptr)>
+trace_writer::trace_reply(trace_kind kind, std::uint32_t xid,
+			  std::uint32_t prog, std::uint32_t vers,
+			  std::uint32_t proc, unique_function<void(msg_ptr)> cb)
+{
+  return traced_reply<>(this, kind, xid, prog, vers, proc, std::move(cb));
+}
+
+unique_function<void(msg_ptr, int)>
+trace_writer::trace_reply(trace_kind kind, std::uint32_t xid,
+			  std::uint32_t prog, std::uint32_t vers,
+			  std::uint32_t proc,
+			  unique_function<void(msg_ptr, int)> cb)
+{
+  return traced_reply<int>(this, kind, xid, prog, vers, proc, std::move(cb));
+}
+
+void
+trace_writer::flush()
+{
+  std::unique_lock<std::mutex> lk(mu_);
+  std::uint64_t req = ++flush_req_;
+  cv_.notify_one();
+  flushed_cv_.wait(lk, [this, req]() { return flush_done_ >= req; });
+}
+
+std::uint64_t
+trace_writer::dropped()
+{
+  std::lock_guard<std::mutex> lk(mu_);
+  return dropped_;
+}
+
+
+trace_reader::trace_reader(std::istream &in)
+  : in_(in)
+{
+  char buf[sizeof trace_writer::magic];
+  if (!in_.read(buf, sizeof buf)
+      || std::memcmp(buf, trace_writer::magic, sizeof buf))
+    throw xdr_runtime_error("trace_reader: not a trace file");
+}
+
+bool
+trace_reader::next(trace_record &r)
+{
+  // Read the fixed-size part, then the message, into one buffer so
+  // the whole record can be unmarshaled at once.
+  std::uint32_t hdr[record_hdr_size / 4];
+  char *hp = reinterpret_cast<char *>(hdr);
+  if (!in_.read(hp, record_hdr_size)) {
+    if (in_.gcount() == 0)
+      return false;
+    throw xdr_runtime_error("trace_reader: truncated record");
+  }
+  std::size_t len = swap32le(hdr[record_hdr_size / 4 - 1]);
+  std::size_t size = record_hdr_size + ((len + 3) & ~std::size_t(3));
+  std::unique_ptr<std::uint32_t[]> buf(new std::uint32_t[size / 4]);
+  char *p = reinterpret_cast<char *>(buf.get());
+  std::memcpy(p, hp, record_hdr_size);
+  if (!in_.read(p + record_hdr_size, size - record_hdr_size))
+    throw xdr_runtime_error("trace_reader: truncated record");
+  xdr_get g(p, p + size);
+  archive(g, r);
+  g.done();
+  return true;
+}
+
+
+namespace detail {
+
+const char *
+trace_kind_arrow(trace_kind kind)
+{
+  return kind == TRACE_CALL_IN || kind == TRACE_REPLY_IN ? "<-" : "->";
+}
+
+void
+trace_print_time(std::ostream &os, const trace_record &r)
+{
+  os << "[" << r.time_ns / 1000000000 << "."
+     << std::setw(9) << std::setfill('0') << r.time_ns % 1000000000
+     << std::setfill(' ') << "] ";
+}
+
+void
+trace_print_untyped(std::ostream &os, const trace_record &r)
+{
+  os << (r.kind == TRACE_CALL_IN || r.kind == TRACE_CALL_OUT
+	 ? "CALL " : "REPLY ")
+     << r.prog << "." << r.vers << "." << r.proc << " "
+     << trace_kind_arrow(r.kind) << " [xid " << r.xid << "]: ";
+  if (r.msg.empty())
+    os << "no message";
+  else
+    os << r.msg.size() << " bytes";
+  os << std::endl;
+}
+
+} // namespace detail
+
+} // namespace xdr
@@ -0,0 +1,211 @@
+// -*- C++ -*-
+
+//! \file trace.h Binary tracing of RPC calls and replies.  Unlike the
+//! \c XDR_TRACE_SERVER and \c XDR_TRACE_CLIENT pretty-printing, which
+//! formats every message on the calling thread, an xdr::trace_writer
+//! only copies the raw XDR of (a sample of) the messages into a
+//! buffer, which a background thread writes to a file.  The file can
+//! later be rendered as text with xdr::print_trace.
+//!
+//! To trace a program without changing it, set the environment
+//! variable \c XDR_TRACE_FILE to the name of the file, and
+//! optionally \c XDR_TRACE_SAMPLE to \e n to trace only one call in
+//! \e n.
+
+#ifndef _XDRPP_TRACE_H_HEADER_INCLUDED_
+#define _XDRPP_TRACE_H_HEADER_INCLUDED_ 1
+
+#include <condition_variable>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <xdrpp/msgsock.h>
+#include <xdrpp/printer.h>
+#include <xdrpp/rpc_msg.hh>
+#include <xdrpp/rpc_trace.hh>
+
+namespace xdr {
+
+//! Records RPC messages in a binary trace file (see
+//! <tt>xdrpp/rpc_trace.x</tt> for the format).  Messages are
+//! appended to an in-memory buffer under a lock held only for the
+//! copy; a background thread swaps in a second buffer and writes out
+//! the first whenever the buffer is half full, or every \c flush_ms
+//! milliseconds.  Records that do not fit in the buffer are dropped
+//! and counted, so tracing never blocks on disk I/O.
+class trace_writer {
+  std::ofstream out_;
+  const unsigned sample_;
+  const std::size_t bufsize_;
+  const unsigned flush_ms_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;	// Wakes the writer thread
+  std::condition_variable flushed_cv_;
+  std::unique_ptr<char[]> buf_;	// Filled by trace_writer::record
+  std::unique_ptr<char[]> spare_; // Being written to the file
+  std::size_t used_ {0};
+  std::uint64_t dropped_ {0};
+  std::uint64_t flush_req_ {0};
+  std::uint64_t flush_done_ {0};
+  bool stop_ {false};
+  std::thread thread_;
+
+  void run();
+
+public:
+  //! Magic number at the start of trace files.
+  static constexpr char magic[8] = {'X', 'D', 'R', 'T', 'R', 'A', 'C', 'E'};
+
+  //! Trace one call in \c sample (along with its reply) to file \c
+  //! path, buffering up to \c bufsize bytes.  \throws
+  //! std::system_error if the file cannot be created.
+  explicit trace_writer(const std::string &path, unsigned sample = 1,
+			std::size_t bufsize = 1 << 20,
+			unsigned flush_ms = 100);
+  //! Writes out anything buffered.
+  ~trace_writer();
+  trace_writer(const trace_writer &) = delete;
+  trace_writer &operator=(const trace_writer &) = delete;
+
+  //! Decide whether to trace the next call made by this thread.
+  bool sample() {
+    static thread_local unsigned n;
+    return sample_ <= 1 || ++n % sample_ == 0;
+  }
+
+  //! Append a record for message \c m (which may be \c nullptr when
+  //! there was no reply).
+  void record(trace_kind kind, std::uint32_t xid, std::uint32_t prog,
+	      std::uint32_t vers, std::uint32_t proc, const msg_ptr &m);
+
+  //! Wrap the callback that sends (for \c TRACE_REPLY_OUT) or
+  //! receives (for \c TRACE_REPLY_IN) the reply to a call, so that the
+  //! reply is recorded.  A callback destroyed without being invoked
+  //! is recorded as an empty reply.
+  unique_function<void(msg_ptr)>
+  trace_reply(trace_kind kind, std::uint32_t xid, std::uint32_t prog,
+	      std::uint32_t vers, std::uint32_t proc,
+	      unique_function<void(msg_ptr)> cb);
+  //! Same, for an rpc_sock::call_cb_t.
+  unique_function<void(msg_ptr, int)>
+  trace_reply(trace_kind kind, std::uint32_t xid, std::uint32_t prog,
+	      std::uint32_t vers, std::uint32_t proc,
+	      unique_function<void(msg_ptr, int)> cb);
+
+  //! Wait until everything recorded so far is written to the file.
+  void flush();
+  //! Number of records dropped because the buffer was full.
+  std::uint64_t dropped();
+};
+
+//! Trace writer used by servers and clients, or \c nullptr to disable
+//! binary tracing.  Initialized from the \c XDR_TRACE_FILE and \c
+//! XDR_TRACE_SAMPLE environment variables.  Set it before any
+//! threads make or serve calls.
+extern trace_writer *xdr_trace_writer;
+
+//! Reads the records of a binary trace file.
+class trace_reader {
+  std::istream &in_;
+public:
+  //! \throws xdr_runtime_error if \c in is not a trace file.
+  explicit trace_reader(std::istream &in);
+  //! Read the next record.  Returns \c false at the end of the file.
+  //! \throws xdr_runtime_error if the file is truncated or corrupt.
+  bool next(trace_record &r);
+};
+
+namespace detail {
+const char *trace_kind_arrow(trace_kind kind);
+
+template<typename Interface> struct trace_print_proc {
+  const trace_record &r_;
+  std::ostream &os_;
+  bool found_;
+
+  template<typename P> void proc() {
+    if (found_ || P::proc != r_.proc)
+      return;
+    found_ = true;
+    std::string label = std::string(P::proc_name()) + " "
+      + trace_kind_arrow(r_.kind) + " [xid " + std::to_string(r_.xid) + "]";
+    xdr_get g(r_.msg.data(), r_.msg.data() + r_.msg.size());
+    rpc_msg hdr;
+    archive(g, hdr);
+    if (r_.kind == TRACE_CALL_IN || r_.kind == TRACE_CALL_OUT) {
+      typename P::arg_tuple_type args;
+      archive(g, args);
+      os_ << xdr_to_string(args, ("CALL " + label).c_str());
+    }
+    else if (hdr.body.rbody().stat() == MSG_DENIED)
+      os_ << xdr_to_string(hdr.body.rbody().rreply(),
+			   ("REPLY " + label).c_str());
+    else if (hdr.body.rbody().areply().reply_data.stat() != SUCCESS)
+      os_ << xdr_to_string(hdr.body.rbody().areply().reply_data.stat(),
+			   ("REPLY " + label).c_str());
+    else {
+      typename P::res_wire_type res;
+      archive(g, res);
+      os_ << xdr_to_string(res, ("REPLY " + label).c_str());
+    }
+  }
+};
+
+template<typename Interface> bool
+trace_print_interface(std::ostream &os, const trace_record &r)
+{
+  if (Interface::program != r.prog || Interface::version != r.vers
+      || r.msg.empty())
+    return false;
+  trace_print_proc<Interface> v{r, os, false};
+  try {
+    Interface::for_each_proc(v);
+  }
+  catch (const xdr_runtime_error &e) {
+    os << "malformed message: " << e.what() << std::endl;
+    return true;
+  }
+  return v.found_;
+}
+
+void trace_print_untyped(std::ostream &os, const trace_record &r);
+void trace_print_time(std::ostream &os, const trace_record &r);
+} // namespace detail
+
+//! Render one trace record as text.  Arguments and results of
+//! procedures in \c Interfaces (types generated by \c xdrc) are
+//! pretty-printed; other messages are summarized.
+template<typename...Interfaces> void
+print_trace_record(std::ostream &os, const trace_record &r)
+{
+  detail::trace_print_time(os, r);
+  bool found[] = {false, detail::trace_print_interface<Interfaces>(os, r)...};
+  for (bool f : found)
+    if (f)
+      return;
+  detail::trace_print_untyped(os, r);
+}
+
+//! Render a whole trace file as text.  For instance, a program
+//! to print traces of calls to interfaces \c myprog_v1 and \c
+//! myprog_v2 could be:
+//! \code
+//!   int main() { xdr::print_trace<myprog_v1, myprog_v2>(std::cin, std::cout); }
+//! \endcode
+template<typename...Interfaces> void
+print_trace(std::istream &in, std::ostream &out)
+{
+  trace_reader rd(in);
+  trace_record r;
+  while (rd.next(r))
+    print_trace_record<Interfaces...>(out, r);
+}
+
+} // namespace xdr
+
+#endif // !_XDRPP_TRACE_H_HEADER_INCLUDED_
@@ -916,18 +916,88 @@ template<typename T> struct struct_equal_helper<T, xdr_struct_base<>> {
   static bool equal(const T &, const T &) { return true; }
 };
 
-template<typename T, typename F> struct struct_lt_helper {
-  static bool lt(const T &a, const T &b) {
+// Three-way comparison, returning a value less than, equal to, or
+// greater than zero as a is less than, equal to, or greater than b.
+// Ordering structures, unions, and containers field by field with
+// operator< alone would compare each field twice (or test equality
+// and then order), which revisits nested values and takes time
+// quadratic or worse in the depth of recursive structures.  One
+// three-way comparison per field visits each nested value once.
+template<typename T, typename = void> struct compare_helper {
+  static int compare(const T &a, const T &b) {
+    return a < b ? -1 : b < a ? 1 : 0;
+  }
+};
+template<typename T> inline int
+xdr_compare(const T &a, const T &b)
+{
+  return compare_helper<T>::compare(a, b);
+}
+
+template<typename C> inline int
+compare_elements(const C &a, const C &b)
+{
+  std::size_t n = a.size() < b.size() ? a.size() : b.size();
+  for (std::size_t i = 0; i < n; i++)
+    if (int r = xdr_compare(a[i], b[i]))
+      return r;
+  return a.size() < b.size() ? -1 : b.size() < a.size() ? 1 : 0;
+}
+template<typename T, uint32_t N> struct compare_helper<xarray<T,N>> {
+  static int compare(const xarray<T,N> &a, const xarray<T,N> &b) {
+    return compare_elements(a, b);
+  }
+};
+template<typename T, uint32_t N> struct compare_helper<xvector<T,N>> {
+  static int compare(const xvector<T,N> &a, const xvector<T,N> &b) {
+    return compare_elements(a, b);
+  }
+};
+
+template<typename T> struct compare_helper<pointer<T>> {
+  static int compare(const pointer<T> &a, const pointer<T> &b) {
+    if (!a || !b)
+      return !a ? (!b ? 0 : -1) : 1;
+    return xdr_compare(*a, *b);
+  }
+};
+
+template<typename T, typename F> struct struct_compare_helper {
+  static int compare(const T &a, const T &b) {
     Constexpr const typename F::field_info fi {};
-    if ((fi(a) < fi(b)))
-      return true;
-    if ((fi(b) < fi(a)))
-      return false;
-    return struct_lt_helper<T, typename F::next_field>::lt(a, b);
+    if (int r = xdr_compare(fi(a), fi(b)))
+      return r;
+    return struct_compare_helper<T, typename F::next_field>::compare(a, b);
   }
 };
-template<typename T> struct struct_lt_helper<T, xdr_struct_base<>> {
-  static bool lt(const T &, const T &) { return false; }
+template<typename T> struct struct_compare_helper<T, xdr_struct_base<>> {
+  static int compare(const T &, const T &) { return 0; }
+};
+template<typename T> struct compare_helper<T, typename std::enable_if<
+  xdr_traits<T>::is_struct && xdr_traits<T>::xdr_defined>::type> {
+  static int compare(const T &a, const T &b) {
+    return struct_compare_helper<T, xdr_traits<T>>::compare(a, b);
+  }
+};
+
+struct union_field_compare_t {
+  Constexpr union_field_compare_t() {}
+  template<typename T, typename F>
+  void operator()(F T::*mp, const T &a, const T &b, int &out) const {
+    out = xdr_compare(a.*mp, b.*mp);
+  }
+};
+Constexpr const union_field_compare_t union_field_compare {};
+
+template<typename T> struct compare_helper<T, typename std::enable_if<
+  xdr_traits<T>::is_union>::type> {
+  static int compare(const T &a, const T &b) {
+    if (int r = xdr_compare(a._xdr_discriminant(), b._xdr_discriminant()))
+      return r;
+    int r{0};
+    a._xdr_with_mem_ptr(union_field_compare, a._xdr_discriminant(), a, b, r);
+    return r;
+  }
 };
 } // namespace detail
 
@@ -963,7 +1033,7 @@ std::enable_if<xdr_traits<T>::is_struct && xdr_traits<T>::xdr_defined,
 	       bool>::type
 operator<(const T &a, const T &b)
 {
-  return detail::struct_lt_helper<T, xdr_traits<T>>::lt(a, b);
+  return detail::xdr_compare(a, b) < 0;
 }
 
 template<typename T> inline typename
@@ -999,15 +1069,6 @@ struct union_field_equal_t {
   }
 };
 Constexpr const union_field_equal_t union_field_equal {};
-
-struct union_field_lt_t {
-  Constexpr union_field_lt_t() {}
-  template<typename T, typename F>
-  void operator()(F T::*mp, const T &a, const T &b, bool &out) const {
-    out = a.*mp < b.*mp;
-  }
-};
-Constexpr const union_field_lt_t union_field_lt {};
 } // namespace detail
 
 //! Equality of XDR unions.  See note at \c xdr::operator== for XDR
@@ -1030,15 +1091,7 @@ template<typename T> inline typename
 std::enable_if<xdr_traits<T>::is_union, bool>::type
 operator<(const T &a, const T &b)
 {
-  if (a._xdr_discriminant() < b._xdr_discriminant())
-    return true;
-  if (b._xdr_discriminant() < a._xdr_discriminant())
-    return false;
-
-  bool r{false};
-  a._xdr_with_mem_ptr(detail::union_field_lt,
-		      a._xdr_discriminant(), a, b, r);
-  return r;
+  return detail::xdr_compare(a, b) < 0;
 }
 
 } // namespace xdr
@@ -0,0 +1,600 @@
+
+#include <xdrpp/config.h>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <system_error>
+#include <poll.h>
+#include <xdrpp/uring.h>
+
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif // HAVE_LINUX_IO_URING_H
+
+#if HAVE_LINUX_IO_URING_H && defined(__NR_io_uring_setup) \
+  && defined(IORING_FEAT_EXT_ARG)
+#define XDRPP_USE_URING 1
+#endif
+
+namespace xdr {
+
+struct io_op {
+  io_ring::cb_t cb_;
+  bool cancelled_ {false};
+  bool linked_ {false};		// Preceded by poll after EAGAIN
+  std::uint8_t opcode_ {0};
+  sock_t fd_;
+  short events_ {0};
+  std::uint32_t seq_ {0};	// Submission queue position
+  std::uint64_t addr_ {0};
+  std::uint32_t len_ {0};
+  int iovcnt_ {0};
+  iovec iov_[io_ring::max_iov];
+
+  // Buffers to release once the kernel is done with them
+  std::vector<msg_ptr> msgs_;
+  io_slab slab_;
+
+  io_op *prev_ {nullptr};
+  io_op *next_ {nullptr};
+};
+
+#if XDRPP_USE_URING
+
+namespace {
+
+int
+sys_io_uring_setup(unsigned entries, io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		   unsigned flags, const void *arg, std::size_t argsz)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		 arg, argsz);
+}
+
+int
+sys_io_uring_register(int fd, unsigned opcode, const void *arg,
+		      unsigned nr_args)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+template<typename T> inline T *
+ring_ptr(void *base, std::uint32_t off)
+{
+  return reinterpret_cast<T *>(static_cast<char *>(base) + off);
+}
+
+bool
+is_rw(const io_op *op)
+{
+  return op->opcode_ == IORING_OP_READV || op->opcode_ == IORING_OP_WRITEV
+    || op->opcode_ == IORING_OP_READ_FIXED;
+}
+
+} // namespace
+
+struct io_ring::impl {
+  int fd_ {-1};
+  io_uring_params params_;
+
+  void *ring_ {MAP_FAILED};
+  std::size_t ring_size_ {0};
+  void *cq_ring_ {MAP_FAILED};	// Only if no IORING_FEAT_SINGLE_MMAP
+  std::size_t cq_ring_size_ {0};
+  io_uring_sqe *sqes_ {static_cast<io_uring_sqe *>(MAP_FAILED)};
+  std::size_t sqes_size_ {0};
+
+  unsigned *sq_khead_;
+  unsigned *sq_ktail_;
+  unsigned *sq_array_;
+  unsigned sq_mask_;
+  unsigned sq_tail_;
+
+  unsigned *cq_khead_;
+  unsigned *cq_ktail_;
+  io_uring_cqe *cqes_;
+  unsigned cq_mask_;
+
+  char *slab_mem_ {static_cast<char *>(MAP_FAILED)};
+  std::size_t slab_mem_size_ {0};
+  std::size_t slab_size_ {0};
+  std::vector<int> free_slabs_;
+
+  io_op ops_;			// Sentinel of list of all operations
+  std::vector<io_op *> free_ops_;
+
+  impl() { ops_.prev_ = ops_.next_ = &ops_; }
+  ~impl();
+
+  unsigned sq_pending() const {
+    return sq_tail_ - __atomic_load_n(sq_khead_, __ATOMIC_ACQUIRE);
+  }
+  void flush() { __atomic_store_n(sq_ktail_, sq_tail_, __ATOMIC_RELEASE); }
+  int enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+	    const void *arg = nullptr, std::size_t argsz = 0) {
+    flush();
+    return sys_io_uring_enter(fd_, to_submit, min_complete, flags,
+			      arg, argsz);
+  }
+  io_uring_sqe *get_sqe(std::uint32_t *seqp = nullptr);
+  io_op *alloc_op();
+};
+
+io_ring::impl::~impl()
+{
+  if (fd_ >= 0)
+    ::close(fd_);
+  while (ops_.next_ != &ops_) {
+    io_op *op = ops_.next_;
+    ops_.next_ = op->next_;
+    delete op;
+  }
+  for (io_op *op : free_ops_)
+    delete op;
+  if (slab_mem_ != MAP_FAILED)
+    munmap(slab_mem_, slab_mem_size_);
+  if (sqes_ != MAP_FAILED)
+    munmap(sqes_, sqes_size_);
+  if (cq_ring_ != MAP_FAILED)
+    munmap(cq_ring_, cq_ring_size_);
+  if (ring_ != MAP_FAILED)
+    munmap(ring_, ring_size_);
+}
+
+io_uring_sqe *
+io_ring::impl::get_sqe(std::uint32_t *seqp)
+{
+  if (sq_pending() >= params_.sq_entries
+      && enter(sq_pending(), 0, 0) < 0 && errno != EINTR)
+    throw std::system_error(errno, std::system_category(), "io_uring_enter");
+  if (sq_pending() >= params_.sq_entries)
+    throw std::system_error(EBUSY, std::system_category(),
+			    "io_uring submission queue full");
+  unsigned idx = sq_tail_ & sq_mask_;
+  if (seqp)
+    *seqp = sq_tail_;
+  sq_array_[idx] = idx;
+  ++sq_tail_;
+  io_uring_sqe *sqe = &sqes_[idx];
+  std::memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+io_op *
+io_ring::impl::alloc_op()
+{
+  io_op *op;
+  if (free_ops_.empty())
+    op = new io_op;
+  else {
+    op = free_ops_.back();
+    free_ops_.pop_back();
+  }
+  op->next_ = ops_.next_;
+  op->prev_ = &ops_;
+  op->next_->prev_ = op;
+  ops_.next_ = op;
+  return op;
+}
+
+std::unique_ptr<io_ring>
+io_ring::create(unsigned entries, unsigned nslabs, std::size_t slab_size)
+{
+  std::unique_ptr<impl> r {new impl};
+  std::memset(&r->params_, 0, sizeof(r->params_));
+  r->params_.flags = IORING_SETUP_CQSIZE;
+  r->params_.cq_entries = 4 * entries;
+  if ((r->fd_ = sys_io_uring_setup(entries, &r->params_)) < 0)
+    return nullptr;
+  io_uring_params &p = r->params_;
+  constexpr unsigned required = IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE
+    | IORING_FEAT_EXT_ARG;
+  if ((p.features & required) != required)
+    return nullptr;
+
+  r->ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  std::size_t cqsize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && cqsize > r->ring_size_)
+    r->ring_size_ = cqsize;
+  r->ring_ = mmap(nullptr, r->ring_size_, PROT_READ|PROT_WRITE,
+		  MAP_SHARED|MAP_POPULATE, r->fd_, IORING_OFF_SQ_RING);
+  if (r->ring_ == MAP_FAILED)
+    return nullptr;
+  void *cq = r->ring_;
+  if (!single) {
+    r->cq_ring_size_ = cqsize;
+    r->cq_ring_ = cq = mmap(nullptr, cqsize, PROT_READ|PROT_WRITE,
+			    MAP_SHARED|MAP_POPULATE, r->fd_,
+			    IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED)
+      return nullptr;
+  }
+  r->sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+  r->sqes_ = static_cast<io_uring_sqe *>(
+      mmap(nullptr, r->sqes_size_, PROT_READ|PROT_WRITE,
+	   MAP_SHARED|MAP_POPULATE, r->fd_, IORING_OFF_SQES));
+  if (r->sqes_ == MAP_FAILED)
+    return nullptr;
+
+  r->sq_khead_ = ring_ptr<unsigned>(r->ring_, p.sq_off.head);
+  r->sq_ktail_ = ring_ptr<unsigned>(r->ring_, p.sq_off.tail);
+  r->sq_array_ = ring_ptr<unsigned>(r->ring_, p.sq_off.array);
+  r->sq_mask_ = *ring_ptr<unsigned>(r->ring_, p.sq_off.ring_mask);
+  r->sq_tail_ = *r->sq_ktail_;
+  r->cq_khead_ = ring_ptr<unsigned>(cq, p.cq_off.head);
+  r->cq_ktail_ = ring_ptr<unsigned>(cq, p.cq_off.tail);
+  r->cqes_ = ring_ptr<io_uring_cqe>(cq, p.cq_off.cqes);
+  r->cq_mask_ = *ring_ptr<unsigned>(cq, p.cq_off.ring_mask);
+
+  // Registered buffers are optional; without them reads fall back to
+  // ordinary buffers (e.g., if RLIMIT_MEMLOCK is too small).
+  if (nslabs && slab_size) {
+    r->slab_mem_size_ = nslabs * slab_size;
+    r->slab_mem_ = static_cast<char *>(
+        mmap(nullptr, r->slab_mem_size_, PROT_READ|PROT_WRITE,
+	     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0));
+    if (r->slab_mem_ != MAP_FAILED) {
+      std::vector<iovec> iov(nslabs);
+      for (unsigned i = 0; i < nslabs; i++) {
+	iov[i].iov_base = r->slab_mem_ + i * slab_size;
+	iov[i].iov_len = slab_size;
+      }
+      if (sys_io_uring_register(r->fd_, IORING_REGISTER_BUFFERS,
+				iov.data(), nslabs) == 0) {
+	r->slab_size_ = slab_size;
+	for (unsigned i = nslabs; i-- > 0;)
+	  r->free_slabs_.push_back(i);
+      }
+      else {
+	munmap(r->slab_mem_, r->slab_mem_size_);
+	r->slab_mem_ = static_cast<char *>(MAP_FAILED);
+      }
+    }
+  }
+
+  return std::unique_ptr<io_ring>(new io_ring(std::move(r)));
+}
+
+io_ring::io_ring(std::unique_ptr<impl> &&i) : impl_(std::move(i)) {}
+
+io_ring::~io_ring() {}
+
+io_op *
+io_ring::submit(io_op *op)
+{
+  if (op->linked_) {
+    io_uring_sqe *psqe = impl_->get_sqe();
+    psqe->opcode = IORING_OP_POLL_ADD;
+    psqe->fd = op->fd_.fd();
+    psqe->flags = IOSQE_IO_LINK;
+    psqe->user_data = reinterpret_cast<std::uintptr_t>(op) | 1;
+    std::uint32_t ev = op->opcode_ == IORING_OP_WRITEV ? POLLOUT : POLLIN;
+#if XDRPP_WORDS_BIGENDIAN
+    ev = ev << 16 | ev >> 16;
+#endif // XDRPP_WORDS_BIGENDIAN
+    psqe->poll32_events = ev;
+  }
+
+  io_uring_sqe *sqe = impl_->get_sqe(&op->seq_);
+  sqe->opcode = op->opcode_;
+  sqe->fd = op->fd_.fd();
+  sqe->user_data = reinterpret_cast<std::uintptr_t>(op);
+  switch (op->opcode_) {
+  case IORING_OP_POLL_ADD:
+    {
+      std::uint32_t ev = std::uint16_t(op->events_);
+#if XDRPP_WORDS_BIGENDIAN
+      ev = ev << 16 | ev >> 16;
+#endif // XDRPP_WORDS_BIGENDIAN
+      sqe->poll32_events = ev;
+    }
+    break;
+  case IORING_OP_READV:
+  case IORING_OP_WRITEV:
+    sqe->addr = reinterpret_cast<std::uintptr_t>(op->iov_);
+    sqe->len = op->iovcnt_;
+    break;
+  case IORING_OP_READ_FIXED:
+    sqe->addr = op->addr_;
+    sqe->len = op->len_;
+    sqe->buf_index = op->slab_.index_;
+    break;
+#ifdef IORING_ACCEPT_MULTISHOT
+  case IORING_OP_ACCEPT:
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    break;
+#endif // IORING_ACCEPT_MULTISHOT
+  default:
+    std::cerr << "io_ring: unexpected opcode " << int(op->opcode_)
+	      << std::endl;
+    std::terminate();
+  }
+  return op;
+}
+
+io_op *
+io_ring::poll_add(sock_t s, short events, cb_t cb)
+{
+  io_op *op = impl_->alloc_op();
+  op->cb_ = std::move(cb);
+  op->opcode_ = IORING_OP_POLL_ADD;
+  op->fd_ = s;
+  op->events_ = events;
+  ++nactive_;
+  return submit(op);
+}
+
+io_op *
+io_ring::rw(int opcode, sock_t s, const iovec *iov, int iovcnt, cb_t cb)
+{
+  assert(iovcnt > 0 && iovcnt <= max_iov);
+  io_op *op = impl_->alloc_op();
+  op->cb_ = std::move(cb);
+  op->opcode_ = opcode;
+  op->fd_ = s;
+  op->iovcnt_ = iovcnt;
+  std::copy(iov, iov + iovcnt, op->iov_);
+  ++nactive_;
+  return submit(op);
+}
+
+io_op *
+io_ring::readv(sock_t s, const iovec *iov, int iovcnt, cb_t cb)
+{
+  return rw(IORING_OP_READV, s, iov, iovcnt, std::move(cb));
+}
+
+io_op *
+io_ring::writev(sock_t s, const iovec *iov, int iovcnt, cb_t cb)
+{
+  return rw(IORING_OP_WRITEV, s, iov, iovcnt, std::move(cb));
+}
+
+io_op *
+io_ring::read_fixed(sock_t s, const io_slab &slab, std::size_t off,
+		    std::size_t len, cb_t cb)
+{
+  assert(slab && off + len <= slab.size_);
+  io_op *op = impl_->alloc_op();
+  op->cb_ = std::move(cb);
+  op->opcode_ = IORING_OP_READ_FIXED;
+  op->fd_ = s;
+  op->addr_ = reinterpret_cast<std::uintptr_t>(slab.data_ + off);
+  op->len_ = len;
+  op->slab_ = slab;		// Only the index is used until release
+  ++nactive_;
+  submit(op);
+  op->slab_ = io_slab{};	// Caller still owns the slab
+  return op;
+}
+
+io_op *
+io_ring::accept_multishot(sock_t s, cb_t cb)
+{
+#ifdef IORING_ACCEPT_MULTISHOT
+  io_op *op = impl_->alloc_op();
+  op->cb_ = std::move(cb);
+  op->opcode_ = IORING_OP_ACCEPT;
+  op->fd_ = s;
+  ++nactive_;
+  return submit(op);
+#else // !IORING_ACCEPT_MULTISHOT
+  return nullptr;
+#endif // !IORING_ACCEPT_MULTISHOT
+}
+
+void
+io_ring::cancel(io_op *op)
+{
+  assert(!op->cancelled_);
+  op->cancelled_ = true;
+  op->cb_ = nullptr;
+  --nactive_;
+
+  std::uint32_t khead = __atomic_load_n(impl_->sq_khead_, __ATOMIC_ACQUIRE);
+  if (int(op->seq_ - khead) >= 0 && int(impl_->sq_tail_ - op->seq_) > 0) {
+    // Not yet seen by the kernel, so the file descriptor may already
+    // be closed and reused.  Just turn the request (and any poll
+    // linked before it) into a no-op.
+    for (std::uint32_t seq = op->seq_ - op->linked_; seq != op->seq_ + 1;
+	 ++seq) {
+      io_uring_sqe *sqe = &impl_->sqes_[seq & impl_->sq_mask_];
+      std::uint64_t ud = sqe->user_data;
+      std::uint8_t flags = sqe->flags;
+      std::memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_NOP;
+      sqe->flags = flags;
+      sqe->user_data = ud;
+    }
+    return;
+  }
+
+  io_uring_sqe *sqe = impl_->get_sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = reinterpret_cast<std::uintptr_t>(op);
+  if (op->linked_) {
+    sqe = impl_->get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = reinterpret_cast<std::uintptr_t>(op) | 1;
+  }
+}
+
+void
+io_ring::keep(io_op *op, msg_ptr m)
+{
+  assert(op->cancelled_);
+  op->msgs_.push_back(std::move(m));
+}
+
+void
+io_ring::keep(io_op *op, io_slab slab)
+{
+  assert(op->cancelled_ && !op->slab_);
+  op->slab_ = slab;
+}
+
+io_slab
+io_ring::slab_get()
+{
+  io_slab s;
+  if (!impl_->free_slabs_.empty()) {
+    s.index_ = impl_->free_slabs_.back();
+    impl_->free_slabs_.pop_back();
+    s.data_ = impl_->slab_mem_ + s.index_ * impl_->slab_size_;
+    s.size_ = impl_->slab_size_;
+  }
+  return s;
+}
+
+void
+io_ring::slab_put(io_slab &s)
+{
+  if (s) {
+    impl_->free_slabs_.push_back(s.index_);
+    s = io_slab{};
+  }
+}
+
+void
+io_ring::release(io_op *op)
+{
+  op->prev_->next_ = op->next_;
+  op->next_->prev_ = op->prev_;
+  op->cb_ = nullptr;
+  op->msgs_.clear();
+  slab_put(op->slab_);
+  op->cancelled_ = op->linked_ = false;
+  impl_->free_ops_.push_back(op);
+}
+
+void
+io_ring::complete(io_op *op, int res, unsigned flags)
+{
+  bool more = flags & IORING_CQE_F_MORE;
+  if (op->cancelled_) {
+    if (op->opcode_ == IORING_OP_ACCEPT && res >= 0)
+      close(sock_t(res));	// Accepted before the cancel took effect
+    if (!more)
+      release(op);
+    return;
+  }
+
+  if (res == -EAGAIN && is_rw(op)) {
+    // Some kernels do not internally poll sockets with O_NONBLOCK set
+    op->linked_ = true;
+    submit(op);
+    return;
+  }
+  if (res == -ECANCELED && op->linked_) {
+    // The linked poll failed; retry without it to learn the error
+    op->linked_ = false;
+    submit(op);
+    return;
+  }
+
+  cb_t cb {std::move(op->cb_)};
+  if (!more) {
+    --nactive_;
+    release(op);
+    cb(res, false);
+    return;
+  }
+
+  struct restore {
+    io_op *op_;
+    cb_t &cb_;
+    ~restore() { if (!op_->cancelled_) op_->cb_ = std::move(cb_); }
+  } r {op, cb};
+  cb(res, true);
+}
+
+int
+io_ring::run(std::int64_t timeout_us)
+{
+  impl &r = *impl_;
+  unsigned head = *r.cq_khead_;
+  bool ready = head != __atomic_load_n(r.cq_ktail_, __ATOMIC_ACQUIRE);
+  unsigned to_submit = r.sq_pending();
+
+  if (!ready || to_submit) {
+    io_uring_getevents_arg arg;
+    __kernel_timespec ts;
+    std::memset(&arg, 0, sizeof(arg));
+    if (timeout_us >= 0) {
+      ts.tv_sec = timeout_us / 1000000;
+      ts.tv_nsec = timeout_us % 1000000 * 1000;
+      arg.ts = reinterpret_cast<std::uintptr_t>(&ts);
+    }
+    int n = ready ? r.enter(to_submit, 0, 0)
+      : r.enter(to_submit, 1, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+		&arg, sizeof(arg));
+    if (n < 0 && errno != ETIME && errno != EBUSY && errno != EAGAIN)
+      return -1;
+  }
+
+  int nevents = 0;
+  for (;;) {
+    head = *r.cq_khead_;
+    if (head == __atomic_load_n(r.cq_ktail_, __ATOMIC_ACQUIRE))
+      break;
+    const io_uring_cqe &cqe = r.cqes_[head & r.cq_mask_];
+    std::uint64_t ud = cqe.user_data;
+    int res = cqe.res;
+    unsigned flags = cqe.flags;
+    __atomic_store_n(r.cq_khead_, head + 1, __ATOMIC_RELEASE);
+    // Zero is used for cancellations, and odd values for polls
+    // linked to a retried read or write (see io_ring::complete).
+    if (ud && !(ud & 1)) {
+      ++nevents;
+      complete(reinterpret_cast<io_op *>(ud), res, flags);
+    }
+  }
+  return nevents;
+}
+
+#else // !XDRPP_USE_URING
+
+struct io_ring::impl {};
+
+std::unique_ptr<io_ring>
+io_ring::create(unsigned, unsigned, std::size_t)
+{
+  return nullptr;
+}
+
+io_ring::io_ring(std::unique_ptr<impl> &&i) : impl_(std::move(i)) {}
+io_ring::~io_ring() {}
+
+// An io_ring can never be created, so the remaining methods are
+// unreachable.
+io_op *io_ring::submit(io_op *op) { std::terminate(); }
+io_op *io_ring::poll_add(sock_t, short, cb_t) { std::terminate(); }
+io_op *io_ring::rw(int, sock_t, const iovec *, int, cb_t) { std::terminate(); }
+io_op *io_ring::readv(sock_t, const iovec *, int, cb_t) { std::terminate(); }
+io_op *io_ring::writev(sock_t, const iovec *, int, cb_t) { std::terminate(); }
+io_op *io_ring::read_fixed(sock_t, const io_slab &, std::size_t,
+			   std::size_t, cb_t) { std::terminate(); }
+io_op *io_ring::accept_multishot(sock_t, cb_t) { std::terminate(); }
+void io_ring::cancel(io_op *) { std::terminate(); }
+void io_ring::keep(io_op *, msg_ptr) { std::terminate(); }
+void io_ring::keep(io_op *, io_slab) { std::terminate(); }
+io_slab io_ring::slab_get() { std::terminate(); }
+void io_ring::slab_put(io_slab &) { std::terminate(); }
+void io_ring::release(io_op *) { std::terminate(); }
+void io_ring::complete(io_op *, int, unsigned) { std::terminate(); }
+int io_ring::run(std::int64_t) { std::terminate(); }
+
+#endif // !XDRPP_USE_URING
+
+}
@@ -0,0 +1,120 @@
+// -*- C++ -*-
+
+//! \file uring.h Completion-based socket I/O using Linux io_uring.
+//! An \c io_ring queues operations (poll, readv, writev, reads into
+//! registered buffers, and multishot accept) as submission queue
+//! entries, then submits them all and waits for completions with a
+//! single \c io_uring_enter system call per xdr::pollset loop
+//! iteration.  You do not normally create an \c io_ring directly;
+//! instead, construct a \c pollset with \c pollset::engine::Uring and
+//! use \c pollset::ring().
+
+#ifndef _XDRPP_URING_H_HEADER_INCLUDED_
+#define _XDRPP_URING_H_HEADER_INCLUDED_ 1
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <xdrpp/message.h>
+#include <xdrpp/socket.h>
+
+namespace xdr {
+
+//! An operation submitted to an xdr::io_ring.  Opaque to users.
+struct io_op;
+
+//! A buffer from the pool of buffers registered with the kernel.
+struct io_slab {
+  int index_ {-1};
+  char *data_ {nullptr};
+  std::size_t size_ {0};
+  explicit operator bool() const { return index_ >= 0; }
+};
+
+class io_ring {
+public:
+  //! Callback invoked on completion with the result of the system
+  //! call (or a negative \c errno value), and \c true if more
+  //! completions will follow for the same (multishot) operation.
+  using cb_t = std::function<void(int res, bool more)>;
+
+  //! Number of submission queue entries.
+  static constexpr unsigned default_entries = 256;
+  //! Number and size of buffers to register with the kernel.
+  static constexpr unsigned default_nslabs = 128;
+  static constexpr std::size_t default_slab_size = 0x4000;
+  //! Maximum \c iovcnt for io_ring::readv and io_ring::writev.
+  static constexpr int max_iov = 8;
+
+  //! Create a ring.  Returns \c nullptr if io_uring is not compiled
+  //! in, not supported by the running kernel, or disallowed (e.g., by
+  //! a seccomp policy), in which case callers should fall back to
+  //! readiness notification.
+  static std::unique_ptr<io_ring>
+  create(unsigned entries = default_entries,
+	 unsigned nslabs = default_nslabs,
+	 std::size_t slab_size = default_slab_size);
+  ~io_ring();
+  io_ring(const io_ring &) = delete;
+  io_ring &operator=(const io_ring &) = delete;
+
+  //! Wait for \c events (\c POLLIN and/or \c POLLOUT) on a socket.
+  //! One-shot; the result is the \c revents mask.
+  io_op *poll_add(sock_t s, short events, cb_t cb);
+  //! Queue a \c readv.  The \c iovec array is copied, but the buffers
+  //! must remain valid until completion (or see io_ring::keep).
+  io_op *readv(sock_t s, const iovec *iov, int iovcnt, cb_t cb);
+  //! Queue a \c writev.
+  io_op *writev(sock_t s, const iovec *iov, int iovcnt, cb_t cb);
+  //! Queue a read into part of a registered buffer.
+  io_op *read_fixed(sock_t s, const io_slab &slab, std::size_t off,
+		    std::size_t len, cb_t cb);
+  //! Accept connections until cancelled, invoking \c cb with each new
+  //! file descriptor (which will have the close-on-exec flag set).
+  //! Returns \c nullptr if the kernel does not support multishot
+  //! accept.
+  io_op *accept_multishot(sock_t s, cb_t cb);
+
+  //! Cancel an operation.  Its callback will not be invoked again,
+  //! and the operation must not be referenced after this call except
+  //! as an argument to io_ring::keep.
+  void cancel(io_op *op);
+  //! The kernel may still be accessing an operation's buffers after
+  //! it is cancelled.  This transfers ownership of a buffer to the
+  //! operation, to be released after the kernel is done with it.
+  void keep(io_op *op, msg_ptr m);
+  void keep(io_op *op, io_slab slab);
+
+  //! Get a free registered buffer.  Returns a null \c io_slab if all
+  //! buffers are in use.
+  io_slab slab_get();
+  //! Return a registered buffer to the pool.
+  void slab_put(io_slab &slab);
+
+  //! Number of operations whose callbacks have not yet been invoked
+  //! for the final time (not counting cancelled operations).
+  std::size_t active() const { return nactive_; }
+
+  //! Submit all queued operations, wait up to \c timeout_us
+  //! microseconds (or forever if -1) for at least one completion,
+  //! then invoke the callbacks of completed operations.  Returns -1
+  //! with \c errno set to \c EINTR if interrupted by a signal.
+  int run(std::int64_t timeout_us);
+
+private:
+  struct impl;
+  std::unique_ptr<impl> impl_;
+  std::size_t nactive_ {0};
+
+  io_ring(std::unique_ptr<impl> &&i);
+  io_op *rw(int opcode, sock_t s, const iovec *iov, int iovcnt, cb_t cb);
+  io_op *submit(io_op *op);
+  void complete(io_op *op, int res, unsigned flags);
+  void release(io_op *op);
+};
+
+}
+
+#endif // !_XDRPP_URING_H_HEADER_INCLUDED_
@@ -0,0 +1,114 @@
+
+#include <cassert>
+#include <xdrpp/workpool.h>
+
+namespace xdr {
+
+namespace {
+// Pool and index of the worker running on the current thread, if any
+thread_local const work_pool *current_pool;
+thread_local unsigned current_worker;
+}
+
+unsigned
+work_pool::default_size()
+{
+  unsigned n = std::thread::hardware_concurrency();
+  return n ? n : 1;
+}
+
+work_pool &
+work_pool::shared()
+{
+  static work_pool pool;
+  return pool;
+}
+
+work_pool::work_pool(unsigned n)
+{
+  assert(n > 0);
+  for (unsigned i = 0; i < n; i++)
+    workers_.emplace_back(new worker);
+  for (unsigned i = 0; i < n; i++)
+    threads_.emplace_back(&work_pool::run, this, i);
+}
+
+work_pool::~work_pool()
+{
+  {
+    std::lock_guard<std::mutex> lk {idle_lock_};
+    stop_ = true;
+  }
+  idle_cv_.notify_all();
+  for (std::thread &t : threads_)
+    t.join();
+}
+
+void
+work_pool::submit(task_t t)
+{
+  unsigned i = current_pool == this ? current_worker
+    : next_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+  {
+    worker &w = *workers_[i];
+    std::lock_guard<std::mutex> lk {w.lock_};
+    w.q_.push_back(std::move(t));
+  }
+  // Pairs with the increment of sleepers_ in run:  either we see the
+  // sleeper, or it sees the task.
+  queued_.fetch_add(1);
+  if (sleepers_.load()) {
+    std::lock_guard<std::mutex> lk {idle_lock_};
+    idle_cv_.notify_one();
+  }
+}
+
+bool
+work_pool::try_pop(unsigned self, task_t &t)
+{
+  {
+    worker &w = *workers_[self];
+    std::lock_guard<std::mutex> lk {w.lock_};
+    if (!w.q_.empty()) {
+      t = std::move(w.q_.back());
+      w.q_.pop_back();
+      queued_.fetch_sub(1);
+      return true;
+    }
+  }
+  for (unsigned n = 1; n < workers_.size(); n++) {
+    worker &w = *workers_[(self + n) % workers_.size()];
+    std::lock_guard<std::mutex> lk {w.lock_};
+    if (!w.q_.empty()) {
+      t = std::move(w.q_.front());
+      w.q_.pop_front();
+      queued_.fetch_sub(1);
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+work_pool::run(unsigned self)
+{
+  current_pool = this;
+  current_worker = self;
+  task_t t;
+  for (;;) {
+    if (try_pop(self, t)) {
+      t();
+      t = nullptr;
+      continue;
+    }
+    std::unique_lock<std::mutex> lk {idle_lock_};
+    sleepers_.fetch_add(1);
+    while (!queued_.load() && !stop_)
+      idle_cv_.wait(lk);
+    sleepers_.fetch_sub(1);
+    if (stop_ && !queued_.load())
+      return;
+  }
+}
+
+}
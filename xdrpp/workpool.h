@@ -0,0 +1,70 @@
+// -*- C++ -*-
+
+//! \file workpool.h Fixed-size pool of worker threads for CPU-heavy
+//! tasks.
+
+#ifndef _XDRPP_WORKPOOL_H_HEADER_INCLUDED_
+#define _XDRPP_WORKPOOL_H_HEADER_INCLUDED_ 1
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace xdr {
+
+//! A fixed set of worker threads with work stealing.  Each worker has
+//! its own queue.  Tasks submitted from outside the pool are spread
+//! round-robin over the queues, while tasks submitted by a worker go
+//! on that worker's own queue.  A worker runs its own most recently
+//! queued task first, and when its queue is empty, steals the oldest
+//! task from another worker.  Idle workers sleep until a task is
+//! submitted.
+class work_pool {
+public:
+  using task_t = std::function<void()>;
+
+  //! Number of threads used by default (the number of cores).
+  static unsigned default_size();
+  //! A process-wide pool of default_size() threads, created on first
+  //! use, used by pollset_plus::async unless told otherwise.
+  static work_pool &shared();
+
+  explicit work_pool(unsigned n = default_size());
+  //! Runs all tasks already submitted, then joins the threads.
+  ~work_pool();
+  work_pool(const work_pool &) = delete;
+  work_pool &operator=(const work_pool &) = delete;
+
+  unsigned size() const { return workers_.size(); }
+
+  //! Queue a task to run in one of the pool's threads.  Safe to call
+  //! from any thread.  An exception thrown by \c t terminates the
+  //! program.
+  void submit(task_t t);
+
+private:
+  struct worker {
+    std::mutex lock_;
+    std::deque<task_t> q_;
+  };
+  std::vector<std::unique_ptr<worker>> workers_;
+  std::vector<std::thread> threads_;
+  std::atomic<std::size_t> queued_ {0};
+  std::atomic<unsigned> next_ {0};
+  std::atomic<unsigned> sleepers_ {0};
+  std::mutex idle_lock_;
+  std::condition_variable idle_cv_;
+  bool stop_ {false};
+
+  bool try_pop(unsigned self, task_t &t);
+  void run(unsigned self);
+};
+
+}
+
+#endif // !_XDRPP_WORKPOOL_H_HEADER_INCLUDED_